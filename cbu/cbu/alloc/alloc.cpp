@@ -34,20 +34,23 @@
 
 #include "cbu/alloc/pagesize.h"
 #include "cbu/alloc/private/common.h"
+#include "cbu/alloc/private/heap_profiler.h"
+#include "cbu/common/procutil.h"
 #include "cbu/strings/faststr.h"
 
 namespace cbu {
 namespace alloc {
 
 constexpr bool is_alignment_valid_impl(size_t align) noexcept {
-  // return align && (align <= kPageSize) && ((align & (align - 1)) == 0);
-  return ((align - 1) & (align | ~size_t(kPageSize - 1))) == 0;
+  // return align && (align <= kMaxAlignment) && ((align & (align - 1)) == 0);
+  return ((align - 1) & (align | ~size_t(kMaxAlignment - 1))) == 0;
 }
 
 constexpr bool is_alignment_valid_posix_impl(size_t align) noexcept {
   // Equivalent to align >= sizeof(void*) and is_alignment_valid(align)
   // posix_memalign requires align >= sizeof(void*)
-  return ((align - sizeof(void*)) & (align | ~size_t(kPageSize - sizeof(void*)))) == 0;
+  return ((align - sizeof(void*)) &
+          (align | ~size_t(kMaxAlignment - sizeof(void*)))) == 0;
 }
 
 static_assert(!is_alignment_valid_impl(0));
@@ -61,9 +64,12 @@ static_assert(!is_alignment_valid_impl(kPageSize - 1));
 static_assert(is_alignment_valid_impl(kPageSize));
 static_assert(!is_alignment_valid_impl(kPageSize + 1));
 static_assert(!is_alignment_valid_impl(kPageSize + 2));
-static_assert(!is_alignment_valid_impl(kPageSize * 2));
+static_assert(is_alignment_valid_impl(kPageSize * 2));
 static_assert(!is_alignment_valid_impl(kPageSize * 3));
-static_assert(!is_alignment_valid_impl(kPageSize * 4));
+static_assert(is_alignment_valid_impl(kPageSize * 4));
+static_assert(is_alignment_valid_impl(kMaxAlignment));
+static_assert(!is_alignment_valid_impl(kMaxAlignment - kPageSize));
+static_assert(!is_alignment_valid_impl(kMaxAlignment * 2));
 
 static_assert(!is_alignment_valid_posix_impl(0));
 static_assert(!is_alignment_valid_posix_impl(1));
@@ -76,9 +82,11 @@ static_assert(!is_alignment_valid_posix_impl(kPageSize - 1));
 static_assert(is_alignment_valid_posix_impl(kPageSize));
 static_assert(!is_alignment_valid_posix_impl(kPageSize + 1));
 static_assert(!is_alignment_valid_posix_impl(kPageSize + 2));
-static_assert(!is_alignment_valid_posix_impl(kPageSize * 2));
+static_assert(is_alignment_valid_posix_impl(kPageSize * 2));
 static_assert(!is_alignment_valid_posix_impl(kPageSize * 3));
-static_assert(!is_alignment_valid_posix_impl(kPageSize * 4));
+static_assert(is_alignment_valid_posix_impl(kPageSize * 4));
+static_assert(is_alignment_valid_posix_impl(kMaxAlignment));
+static_assert(!is_alignment_valid_posix_impl(kMaxAlignment * 2));
 
 
 bool is_alignment_valid(size_t align) noexcept {
@@ -89,20 +97,112 @@ bool is_alignment_valid_posix(size_t align) noexcept {
   return is_alignment_valid_posix_impl(align);
 }
 
+namespace {
+
+[[gnu::noinline]] void* allocate_in_handle(ArenaHandle* handle, size_t size,
+                                           AllocateOptions options) noexcept {
+  void* ptr = nullptr;
+  if (options.align > kPageSize) {
+    ptr = alloc_large_aligned(size, options.align, options.zero,
+                              options.populate, handle);
+  } else if (size > kSmallAllocLimit) {
+    ptr = alloc_large_in_handle(handle, size, options.zero);
+    if (options.populate && ptr) populate_pages(ptr, pagesize_ceil(size));
+  } else if (size != 0) {
+    ptr = alloc_small_in_handle(
+        handle, options.align > 16
+                    ? size_to_category_aligned(size, options.align)
+                    : size_to_category(size));
+    if (false_no_fail(ptr == nullptr)) return nomem();
+    if (options.zero) ptr = memset_no_builtin(ptr, 0, size);
+  }
+  return ptr;
+}
+
+// Moves a block within its arena handle
+[[gnu::noinline]] void* reallocate_in_handle(ArenaHandle* handle, void* ptr,
+                                             size_t new_size,
+                                             AllocateOptions options) noexcept {
+  void* nptr =
+      allocate_in_handle(handle, new_size, options.with_zero(false));
+  if (true_no_fail(nptr)) {
+    nptr = memcpy_no_builtin(nptr, ptr,
+                             std::min(allocated_size(ptr), new_size));
+    reclaim(ptr);
+  }
+  return nptr;
+}
+
+[[gnu::noinline]] void* allocate_overaligned(size_t size,
+                                             AllocateOptions options) noexcept {
+  if (options.arena) return allocate_in_handle(options.arena, size, options);
+  if (size == 0) return nullptr;
+  void* ptr = alloc_large_aligned(size, options.align, options.zero,
+                                  options.populate, nullptr);
+  if (false_no_fail(ptr == nullptr)) return nomem();
+  return ptr;
+}
+
+// Keeps the block if it's large enough (its address doesn't change, so it
+// stays aligned), and moves it to a new aligned block otherwise
+[[gnu::noinline]] void* reallocate_overaligned(
+    void* ptr, size_t new_size, AllocateOptions options) noexcept {
+  if (ptr == nullptr) return allocate(new_size, options.with_zero(false));
+  if (new_size == 0) {
+    reclaim(ptr);
+    return nullptr;
+  }
+  size_t old_size = allocated_size(ptr);
+  if (uintptr_t(ptr) % options.align == 0 && new_size <= old_size &&
+      new_size > old_size / 2)
+    return ptr;
+  AllocateOptions new_options = options.with_zero(false);
+  if (!new_options.arena) {
+    if (ArenaHandle* handle = uintptr_t(ptr) % kPageSize
+                                  ? small_arena_handle(ptr)
+                                  : large_arena_handle(ptr))
+      new_options = new_options.with_arena(handle);
+  }
+  void* nptr = allocate(new_size, new_options);
+  if (true_no_fail(nptr)) {
+    nptr = memcpy_no_builtin(nptr, ptr, std::min(old_size, new_size));
+    reclaim(ptr);
+  }
+  return nptr;
+}
+
+}  // namespace
+
 void* allocate(size_t size, AllocateOptions options) noexcept {
   if (size_t boundary = options.align) {
+    // Large alignments are served by the page allocator without rounding
+    // size up to the alignment
+    if (boundary > kPageSize) [[unlikely]]
+      return allocate_overaligned(size, options);
     size = (size + boundary - 1) & ~(boundary - 1);
     // Once size is properly adjusted, our allocation design guarantees proper
-    // alignment.
+    // alignment for large blocks.  Small blocks need a category whose size
+    // is a multiple of the alignment.
+  }
+
+  if (options.arena) [[unlikely]]
+    return allocate_in_handle(options.arena, size, options);
+
+#ifdef CBU_ALLOC_HEAP_PROFILER
+  if (heap_profile_should_sample(size)) [[unlikely]] {
+    if (void* ptr = heap_profile_allocate(size, options)) return ptr;
   }
+#endif
 
   void* ptr = nullptr;
 
   if (size > kSmallAllocLimit) {
-    ptr = alloc_large(size, options.zero);
+    ptr = alloc_large(size, options.zero, options.populate);
     if (false_no_fail(ptr == nullptr)) return nomem();
   } else if (size != 0) {
-    if (__builtin_constant_p(size)) { // For LTO
+    if (options.align > 16) {
+      ptr = alloc_small_category(size_to_category_aligned(size, options.align));
+    } else if (__builtin_constant_p(size)) { // For LTO
       ptr = alloc_small_category(size_to_category(size));
     } else {
       ptr = alloc_small(size);
@@ -114,6 +214,12 @@ void* allocate(size_t size, AllocateOptions options) noexcept {
 }
 
 void* allocate(size_t size) noexcept {
+#ifdef CBU_ALLOC_HEAP_PROFILER
+  if (heap_profile_should_sample(size)) [[unlikely]] {
+    if (void* ptr = heap_profile_allocate(size, {})) return ptr;
+  }
+#endif
+
   void* ptr = nullptr;
 
   if (size > kSmallAllocLimit) {
@@ -134,6 +240,8 @@ void* allocate(size_t size) noexcept {
 
 void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
   if (size_t boundary = options.align) {
+    if (boundary > kPageSize) [[unlikely]]
+      return reallocate_overaligned(ptr, new_size, options);
     new_size = (new_size + boundary - 1) & ~(boundary - 1);
   }
 
@@ -141,13 +249,15 @@ void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
     reclaim(ptr);
     return nullptr;
   } else if (uintptr_t(ptr) % kPageSize) {  // Was small block.
+    if (ArenaHandle* handle = small_arena_handle(ptr)) [[unlikely]]
+      return reallocate_in_handle(handle, ptr, new_size, options);
     unsigned old_cat = small_allocated_category(ptr);
     size_t old_size = category_to_size(old_cat);
     size_t copy_size;
     void* nptr;
     if (new_size <= kSmallAllocLimit) {
       // Small to small.
-      unsigned new_cat = size_to_category(new_size);
+      unsigned new_cat = size_to_category_aligned(new_size, options.align);
       if (old_cat == new_cat) return ptr;
       nptr = alloc_small_category(new_cat);
       copy_size = std::min(old_size, new_size);
@@ -165,8 +275,11 @@ void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
   } else if (ptr == nullptr) {
     return allocate(new_size, options.with_align(0).with_zero(false));
   } else {  // Was large block.
+    if (ArenaHandle* handle = large_arena_handle(ptr)) [[unlikely]]
+      return reallocate_in_handle(handle, ptr, new_size, options);
     if (new_size <= kSmallAllocLimit) {
-      void* nptr = alloc_small(new_size);
+      void* nptr = alloc_small_category(
+          size_to_category_aligned(new_size, options.align));
       if (true_no_fail(nptr)) {
         nptr = memcpy_no_builtin(nptr, ptr, new_size);
         free_large(ptr);
@@ -204,6 +317,54 @@ size_t allocated_size(void* ptr) noexcept {
     return large_allocated_size(ptr);
 }
 
+size_t allocate_batch(size_t size, size_t n, void** out) noexcept {
+#ifndef CBU_ALLOC_HEAP_PROFILER
+  if (size - 1 < kSmallAllocLimit) {
+    size_t done = alloc_small_batch(size_to_category(size), n, out);
+    if (false_no_fail(done < n)) nomem();
+    return done;
+  }
+#endif
+  // Large blocks (or every block, if sampled by the heap profiler)
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = allocate(size);
+    if (false_no_fail(out[i] == nullptr && size != 0)) return i;
+  }
+  return n;
+}
+
+namespace {
+
+// size is 0 if unknown
+void reclaim_batch_impl(void** ptrs, size_t n, size_t size) noexcept {
+  // Free large blocks one by one, and pack small blocks to the front
+  size_t small = 0;
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = ptrs[i];
+    if (uintptr_t(ptr) % kPageSize) {
+      if (size > small_allocated_size(ptr))
+        fatal<"Memory corrupt: size invalid at free_small">();
+      ptrs[small++] = ptr;
+    } else if (ptr) {
+      if (size)
+        free_large(ptr, size);
+      else
+        free_large(ptr);
+    }
+  }
+  if (small) free_small_batch(ptrs, small);
+}
+
+}  // namespace
+
+void reclaim_batch(void** ptrs, size_t n) noexcept {
+  reclaim_batch_impl(ptrs, n, 0);
+}
+
+void reclaim_batch(void** ptrs, size_t n, size_t size) noexcept {
+  reclaim_batch_impl(ptrs, n, size);
+}
+
 void trim(size_t pad) noexcept {
   small_trim(pad);
   large_trim(pad);
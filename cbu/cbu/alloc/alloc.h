@@ -36,20 +36,35 @@
 namespace cbu {
 namespace alloc {
 
+// Alignments up to the page size are served by small blocks of suitable
+// categories or by page alignment; larger ones (e.g., kTHPSize for huge page
+// aligned buffers) are carved out of the page allocator.
+constexpr size_t kMaxAlignment = size_t(1) << 30;
+
 [[gnu::const]] bool is_alignment_valid(size_t align) noexcept;
 [[gnu::const]] bool is_alignment_valid_posix(size_t align) noexcept;
 
+struct ArenaHandle;
+
 struct AllocateOptions {
-  // allocate/reallocte only; Maximum supported alignment is pagesize.
+  // allocate/reallocte only; Maximum supported alignment is kMaxAlignment.
   // Caller's responsibility to ensure align is valid, as determined by
   // is_alignment_valid
-  uint16_t align = 0;
+  uint32_t align = 0;
   // allocate/allocate_page only; Not supported by reallocate
   bool zero : 1 = false;
   // Allow allocation from brk; This is only supported by allocate_page;
   // Use this only if you will directly unmap the memory rather than call
   // reclaim_page.  force_mmap always disables THP.
   bool force_mmap : 1 = false;
+  // allocate/allocate_page only; Pre-fault all pages (with
+  // MADV_POPULATE_WRITE, or MAP_POPULATE for new mappings of their own), so
+  // that first touches don't page fault.  Small blocks are always carved
+  // from pages already touched, so this only matters for large blocks.
+  bool populate : 1 = false;
+  // allocate only; Allocate from the arena instead of the global heap.
+  // reallocate keeps blocks in the arenas they're in.
+  ArenaHandle* arena = nullptr;
 
   template <typename Modifier>
   constexpr AllocateOptions with(Modifier modifier) noexcept {
@@ -58,7 +73,7 @@ struct AllocateOptions {
     return res;
   }
 
-  constexpr AllocateOptions with_align(uint16_t a) noexcept {
+  constexpr AllocateOptions with_align(uint32_t a) noexcept {
     return with([&](AllocateOptions* o) constexpr noexcept { o->align = a; });
   }
 
@@ -70,11 +85,20 @@ struct AllocateOptions {
     return with(
         [&](AllocateOptions* o) constexpr noexcept { o->force_mmap = m; });
   }
+
+  constexpr AllocateOptions with_populate(bool p) noexcept {
+    return with(
+        [&](AllocateOptions* o) constexpr noexcept { o->populate = p; });
+  }
+
+  constexpr AllocateOptions with_arena(ArenaHandle* a) noexcept {
+    return with([&](AllocateOptions* o) constexpr noexcept { o->arena = a; });
+  }
 };
 
 
 // High-level interfaces
-// Supported options: align; zero
+// Supported options: align; zero; populate; arena
 void* allocate(size_t size, AllocateOptions options) noexcept;
 // Same as allocate(size, AllocateOptions{}), but optimized for the common case
 void* allocate(size_t size) noexcept;
@@ -86,6 +110,89 @@ void* allocate(size_t size) noexcept;
 [[gnu::noinline]] size_t allocated_size(void* ptr) noexcept;
 void trim(size_t pad) noexcept;
 
+// Batch interfaces, for programs allocating or freeing many blocks at once.
+// allocate_batch allocates n blocks of the same size into out, and returns the
+// number of blocks allocated, which is less than n only if memory is
+// exhausted.  Small blocks are carved from the thread cache a run at a time.
+// reclaim_batch frees n blocks (which may be of different sizes; null
+// pointers are ignored).  Small blocks not kept in the thread cache are
+// returned to their runs directly, which is most efficient if blocks of the
+// same run are adjacent in ptrs, e.g., in the order allocate_batch returned
+// them.  The contents of ptrs are clobbered.
+size_t allocate_batch(size_t size, size_t n, void** out) noexcept;
+void reclaim_batch(void** ptrs, size_t n) noexcept;
+void reclaim_batch(void** ptrs, size_t n, size_t size) noexcept;
+
+// Independent arenas, e.g., for a cache shard or a tenant, so that its memory
+// doesn't fragment the global heap, and can be freed all at once.
+// Blocks are allocated from an arena with AllocateOptions::arena, and freed
+// with reclaim as usual, or all together with destroy_arena_handle, which
+// unmaps all memory of the arena.
+// Blocks in arenas aren't cached by threads, and each arena has a lock, so
+// allocating and freeing them is slower than from the global heap.  Free small
+// blocks are kept for reuse by the same arena until it's destroyed.
+// At most 128 arenas may exist at the same time; create_arena_handle returns
+// nullptr beyond that.
+ArenaHandle* create_arena_handle() noexcept;
+void destroy_arena_handle(ArenaHandle* arena) noexcept;
+
+// Sets the process-wide budget of free small blocks held by thread caches
+// (CBU_ALLOC_THREAD_CACHE_BUDGET, in MiB, sets the initial value).
+// Each thread cache starts flushing blocks early, and raises its limits as it
+// keeps freeing, as long as the budget permits.  When it's exhausted, caches
+// of threads idle for a while are scavenged by busy threads.
+// Returns false if thread cache budgets aren't compiled in.
+bool set_thread_cache_budget(size_t bytes) noexcept;
+
+// Allocates bytes from the page arena (or options.arena), pre-faults them and
+// frees them again, so that later allocations (e.g., on a latency-critical
+// path) reuse resident memory instead of page faulting.
+// The pages are kept as clean (known zero) free pages, which are never
+// purged, so this is best done once at startup.
+// Supported options: force_mmap; arena
+bool prewarm(size_t bytes, AllocateOptions options = {}) noexcept;
+
+// Starts a background thread that purges free pages gradually, so that pages
+// freed decay_ms milliseconds ago have mostly been returned to the system
+// (with MADV_FREE where available).  Threads freeing memory then purge pages
+// only in emergencies.
+// Calling it again changes decay_ms.  Returns false if the thread can't be
+// started.
+bool start_background_purge(unsigned decay_ms) noexcept;
+
+struct PressureMonitorOptions {
+  // The cgroup v2 directory to watch.  By default, that of the process, found
+  // from /proc/self/cgroup.  Any directory with files memory.current,
+  // memory.high (or memory.max) and memory.pressure would do, e.g., for
+  // testing.
+  const char* cgroup_dir = nullptr;
+  // Trim when memory.current reaches this percentage of memory.high (or
+  // memory.max if memory.high is "max").  0 to disable.
+  unsigned usage_percent = 90;
+  // Trim when "some avg10" of memory.pressure, i.e., the percentage of time
+  // some tasks stalled on memory in the last 10 seconds, reaches this.
+  // 0 to disable.
+  unsigned stall_percent = 10;
+  unsigned interval_ms = 1000;
+};
+
+// Starts a background thread that checks memory usage and pressure of the
+// cgroup every interval_ms milliseconds.  When either threshold is reached,
+// it scavenges caches of idle threads (with CBU_ALLOC_THREAD_CACHE_BUDGET)
+// and does trim(0), returning all free pages to the system.
+// Nothing is done (or costs anything) until this is called.  Calling it again
+// changes the thresholds and interval, but not the directory.
+// Returns false if the directory can't be opened or the thread can't be
+// started.
+bool start_pressure_monitor(
+    const PressureMonitorOptions& options = {}) noexcept;
+
+// Run time tunables (thread cache size, trim thresholds, brk and THP usage)
+// are parsed once, before memory is first obtained from the system, from
+// cbu_malloc_conf (if the program defines it) and then environment variable
+// CBU_MALLOC_CONF.  See malloc/README.md for the options.  get_stats reports
+// the values in effect.
+
 // Low-level interface -- page allocation
 // Allocating pages is like anonymous mmap (however, if you prefer the memory
 // to be zero'd you need to set options.zero to true).
@@ -112,3 +219,8 @@ nomem() noexcept;
 
 }  // namespace alloc
 }  // namespace cbu
+
+// Programs may define this to tune the allocator, e.g.
+//   extern "C" const char* cbu_malloc_conf = "thp=never,brk=0";
+// Options in environment variable CBU_MALLOC_CONF take precedence.
+extern "C" const char* cbu_malloc_conf;
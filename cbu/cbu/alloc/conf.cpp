@@ -0,0 +1,190 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/alloc/private/conf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string_view>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/stats.h"
+#include "cbu/common/bit.h"
+#include "cbu/fsyscall/fsyscall.h"
+#include "cbu/sys/low_level_mutex.h"
+
+extern "C" {
+
+// Overridden by programs defining it
+[[gnu::weak]] constinit const char* cbu_malloc_conf = nullptr;
+
+}  // extern "C"
+
+namespace cbu::alloc {
+
+constinit Config g_conf;
+std::atomic<bool> g_conf_ready{false};
+
+namespace {
+
+// Limits of small_cache_flush.  Transfer batches and flush limits are
+// counted in unsigned, but very large caches make little sense.
+constexpr unsigned kMinSmallCacheFlush = 8;
+constexpr unsigned kMaxSmallCacheFlush = 4096;
+constexpr size_t kMaxInitialAllocSize = 1024 * 1024 * 1024;
+
+constinit LowLevelMutex g_conf_lock;
+
+// Don't use stdio, which may allocate memory
+void warn(std::string_view msg, std::string_view arg) noexcept {
+  constexpr std::string_view prefix = "cbu malloc: ";
+  fsys_write(2, prefix.data(), prefix.size());
+  fsys_write(2, msg.data(), msg.size());
+  fsys_write(2, arg.data(), arg.size());
+  fsys_write(2, "\n", 1);
+}
+
+// Accepts decimal numbers with an optional suffix K, M or G (binary)
+bool parse_size(std::string_view s, size_t* res) noexcept {
+  size_t n = 0;
+  size_t i = 0;
+  for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+    if (n > (SIZE_MAX - 9) / 10) return false;
+    n = n * 10 + (s[i] - '0');
+  }
+  if (i == 0) return false;
+  unsigned shift = 0;
+  if (i + 1 == s.size()) {
+    switch (s[i] | 0x20) {
+      case 'k': shift = 10; break;
+      case 'm': shift = 20; break;
+      case 'g': shift = 30; break;
+      default: return false;
+    }
+  } else if (i != s.size()) {
+    return false;
+  }
+  if (n > (SIZE_MAX >> shift)) return false;
+  *res = n << shift;
+  return true;
+}
+
+bool parse_bool(std::string_view s, bool* res) noexcept {
+  if (s == "1" || s == "true" || s == "yes") {
+    *res = true;
+  } else if (s == "0" || s == "false" || s == "no") {
+    *res = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool apply(std::string_view key, std::string_view value) noexcept {
+  size_t n;
+  bool b;
+  if (key == "small_cache_flush") {
+    if (!parse_size(value, &n) || n < kMinSmallCacheFlush ||
+        n > kMaxSmallCacheFlush)
+      return false;
+    g_conf.small_cache_flush = n;
+  } else if (key == "min_trim_threshold") {
+    if (!parse_size(value, &n)) return false;
+    g_conf.min_trim_threshold = n;
+  } else if (key == "max_trim_threshold") {
+    if (!parse_size(value, &n)) return false;
+    g_conf.max_trim_threshold = n;
+  } else if (key == "initial_alloc_size") {
+    if (!parse_size(value, &n) || n > kMaxInitialAllocSize) return false;
+    g_conf.initial_alloc_size = pow2_ceil(std::max<size_t>(n, kPageSize));
+  } else if (key == "brk") {
+    if (!parse_bool(value, &b)) return false;
+#ifdef CBU_NO_BRK
+    // Can't be turned on
+    if (b) return false;
+#else
+    g_conf.use_brk = b;
+#endif
+  } else if (key == "thp") {
+    if (value == "default")
+      g_conf.thp = ThpPolicy::kDefault;
+    else if (value == "always")
+      g_conf.thp = ThpPolicy::kAlways;
+    else if (value == "never")
+      g_conf.thp = ThpPolicy::kNever;
+    else
+      return false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Parses comma separated key=value pairs.  Invalid ones are reported and
+// ignored.
+void parse(std::string_view conf) noexcept {
+  while (!conf.empty()) {
+    size_t comma = conf.find(',');
+    std::string_view pair = conf.substr(0, comma);
+    conf.remove_prefix(comma == conf.npos ? conf.size() : comma + 1);
+    if (pair.empty()) continue;
+    size_t eq = pair.find('=');
+    if (eq == pair.npos || !apply(pair.substr(0, eq), pair.substr(eq + 1)))
+      warn("Invalid option in CBU_MALLOC_CONF: ", pair);
+  }
+}
+
+}  // namespace
+
+void load_config_slow() noexcept {
+  std::lock_guard locker(g_conf_lock);
+  if (g_conf_ready.load(std::memory_order_relaxed)) return;
+  if (const char* conf = cbu_malloc_conf) parse(conf);
+  if (const char* conf = getenv("CBU_MALLOC_CONF")) parse(conf);
+  if (g_conf.min_trim_threshold > g_conf.max_trim_threshold) {
+    warn("min_trim_threshold exceeds max_trim_threshold; ", "using the max");
+    g_conf.min_trim_threshold = g_conf.max_trim_threshold;
+  }
+  g_conf_ready.store(true, std::memory_order_release);
+}
+
+void get_config_stats(Stats* stats) noexcept {
+  load_config();
+  stats->small_cache_flush = g_conf.small_cache_flush;
+  stats->min_trim_threshold = g_conf.min_trim_threshold;
+  stats->max_trim_threshold = g_conf.max_trim_threshold;
+  stats->initial_alloc_size = g_conf.initial_alloc_size;
+  stats->use_brk = g_conf.use_brk;
+  static constexpr const char* kThpNames[] = {"default", "always", "never"};
+  stats->thp = kThpNames[unsigned(g_conf.thp)];
+}
+
+}  // namespace cbu::alloc
@@ -0,0 +1,86 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined CBU_ALLOC_PER_CPU_CACHE && !defined CBU_SINGLE_THREADED
+
+#include "cbu/alloc/private/cpu_cache.h"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include "cbu/alloc/private/permanent.h"
+#include "cbu/alloc/private/rseq.h"
+
+namespace cbu::alloc {
+
+constinit CpuCache* g_cpu_caches[kMaxCpus] = {};
+
+namespace {
+
+constinit SimplePermaAlloc<CpuCache> g_cpu_cache_allocator;
+
+[[gnu::noinline]] CpuCache* create_cpu_cache(CpuCache** slot) noexcept {
+  void* mem = g_cpu_cache_allocator.alloc();
+  if (false_no_fail(mem == nullptr)) return nullptr;
+  CpuCache* cache = new (mem) CpuCache;
+  CpuCache* got = nullptr;
+  if (!std::atomic_ref(*slot).compare_exchange_strong(
+          got, cache, std::memory_order_acq_rel, std::memory_order_acquire)) {
+    g_cpu_cache_allocator.free(cache);
+    cache = got;
+  }
+  return cache;
+}
+
+}  // namespace
+
+CpuCache* get_cpu_cache() noexcept {
+  // Negative values (CPU unknown) become very large
+  unsigned cpu = current_cpu();
+  if (cpu >= kMaxCpus) [[unlikely]]
+    return nullptr;
+  CpuCache** slot = &g_cpu_caches[cpu];
+  CpuCache* cache = load_acquire(slot);
+  if (cache == nullptr) [[unlikely]]
+    cache = create_cpu_cache(slot);
+  return cache;
+}
+
+void clear_cpu_caches() noexcept {
+  for (CpuCache*& slot : g_cpu_caches) {
+    if (CpuCache* cache = load_acquire(&slot)) {
+      std::lock_guard locker(cache->lock);
+      cache->small_cache.clear();
+    }
+  }
+}
+
+}  // namespace cbu::alloc
+
+#endif  // CBU_ALLOC_PER_CPU_CACHE && !CBU_SINGLE_THREADED
@@ -0,0 +1,364 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/alloc/heap_profiler.h"
+
+#ifdef CBU_ALLOC_HEAP_PROFILER
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <new>
+
+#include "cbu/alloc/private/common.h"
+#include "cbu/alloc/private/heap_profiler.h"
+#include "cbu/alloc/private/permanent.h"
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu::alloc {
+
+constinit thread_local int64_t t_heap_sample_countdown = 0;
+
+namespace {
+
+constexpr unsigned kMaxDepth = 32;
+constexpr unsigned kBucketTableSize = 4096;
+constexpr unsigned kSampleTableSize = 4096;
+
+// While sampling is disabled, check again after this many bytes
+constexpr int64_t kDisabledCountdown = 64 * 1024 * 1024;
+
+// Sampled allocations with the same stack
+struct StackBucket {
+  StackBucket* next;  // In hash chain
+  size_t hash;
+  unsigned depth;
+  void* pcs[kMaxDepth];
+  uint64_t alloc_count;
+  uint64_t alloc_bytes;
+  uint64_t live_count;
+  uint64_t live_bytes;
+};
+
+// A live sampled block
+struct Sample {
+  Sample* next;  // In hash chain
+  void* ptr;
+  size_t size;
+  StackBucket* bucket;
+};
+
+constinit std::atomic<size_t> g_sample_interval{512 * 1024};
+
+constinit LowLevelMutex g_lock{};
+constinit StackBucket* g_buckets[kBucketTableSize] = {};
+constinit Sample* g_samples[kSampleTableSize] = {};
+constinit SimplePermaAlloc<StackBucket> g_bucket_allocator;
+constinit SimplePermaAlloc<Sample> g_sample_allocator;
+
+constinit std::atomic<bool> g_dump_requested{false};
+constinit std::atomic<const char*> g_dump_prefix{nullptr};
+constinit std::atomic<unsigned> g_dump_seq{0};
+
+// 0 means this thread hasn't initialized its countdown yet
+constinit thread_local uint64_t t_rng = 0;
+
+uint64_t next_random() noexcept {
+  uint64_t x = t_rng;
+  if (x == 0) {
+    static constinit std::atomic<uint64_t> seed{0};
+    x = (seed.fetch_add(1, std::memory_order_relaxed) + 1) *
+            0x9e3779b97f4a7c15u ^
+        uintptr_t(&t_rng);
+    if (x == 0) x = 1;
+  }
+  // xorshift64
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  t_rng = x;
+  return x;
+}
+
+// Exponentially distributed, so that samples form a Poisson process over
+// allocated bytes.  This is what pprof assumes when it unbiases the profile.
+int64_t next_sample_countdown(size_t interval) noexcept {
+  double u = double((next_random() >> 11) + 1) * 0x1p-53;  // (0, 1]
+  double v = -std::log(u) * double(interval);
+  return int64_t(std::min(v, 64. * double(interval))) + 1;
+}
+
+// Walks the frame pointer chain.  We have no idea of the stack boundaries, so
+// we stop as soon as a frame doesn't look sane.
+[[gnu::always_inline]] inline unsigned capture_stack(void** pcs) noexcept {
+  uintptr_t* fp = static_cast<uintptr_t*>(__builtin_frame_address(0));
+  unsigned depth = 0;
+  while (fp && depth < kMaxDepth) {
+    uintptr_t pc = fp[1];
+    if (pc == 0) break;
+    pcs[depth++] = reinterpret_cast<void*>(pc);
+    uintptr_t* next = reinterpret_cast<uintptr_t*>(fp[0]);
+    if (next <= fp || uintptr_t(next) - uintptr_t(fp) > 1024 * 1024 ||
+        uintptr_t(next) % sizeof(uintptr_t))
+      break;
+    fp = next;
+  }
+  return depth;
+}
+
+size_t hash_stack(void* const* pcs, unsigned depth) noexcept {
+  size_t h = depth;
+  for (unsigned i = 0; i < depth; ++i)
+    h = (h ^ uintptr_t(pcs[i])) * 0x100000001b3u;
+  return h ^ (h >> 29);
+}
+
+inline unsigned sample_index(const void* ptr) noexcept {
+  return (uintptr_t(ptr) >> kPageSizeBits) % kSampleTableSize;
+}
+
+// Called with g_lock held
+StackBucket* find_bucket(void* const* pcs, unsigned depth) noexcept {
+  size_t hash = hash_stack(pcs, depth);
+  StackBucket** head = &g_buckets[hash % kBucketTableSize];
+  for (StackBucket* b = *head; b; b = b->next) {
+    if (b->hash == hash && b->depth == depth &&
+        memcmp(b->pcs, pcs, depth * sizeof(void*)) == 0)
+      return b;
+  }
+  void* mem = g_bucket_allocator.alloc();
+  if (false_no_fail(mem == nullptr)) return nullptr;
+  StackBucket* b = new (mem) StackBucket{};
+  b->hash = hash;
+  b->depth = depth;
+  std::copy_n(pcs, depth, b->pcs);
+  b->next = *head;
+  *head = b;
+  return b;
+}
+
+// Buffered output without allocating memory
+class Writer {
+ public:
+  explicit Writer(int fd) noexcept : fd_(fd) {}
+  ~Writer() { flush(); }
+
+  template <typename... Args>
+  void print(const char* fmt, Args... args) noexcept {
+    if (sizeof(buf_) - n_ < kMaxLine) flush();
+    int l = snprintf(buf_ + n_, sizeof(buf_) - n_, fmt, args...);
+    if (l > 0) n_ += std::min<size_t>(l, sizeof(buf_) - n_ - 1);
+  }
+
+  void write(const void* p, size_t l) noexcept {
+    flush();
+    write_all(p, l);
+  }
+
+  bool ok() const noexcept { return ok_; }
+
+ private:
+  void flush() noexcept {
+    write_all(buf_, n_);
+    n_ = 0;
+  }
+
+  void write_all(const void* p, size_t l) noexcept {
+    const char* s = static_cast<const char*>(p);
+    while (ok_ && l) {
+      ssize_t r = fsys_write(fd_, s, l);
+      if (r > 0) {
+        s += r;
+        l -= r;
+      } else if (r == 0 || !fsys_errno(r, EINTR)) {
+        ok_ = false;
+      }
+    }
+  }
+
+  static constexpr size_t kMaxLine = 64;
+
+  int fd_;
+  bool ok_ = true;
+  size_t n_ = 0;
+  char buf_[4096];
+};
+
+void write_buckets(Writer* w) noexcept {
+  std::lock_guard locker(g_lock);
+
+  uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+  for (StackBucket* head : g_buckets) {
+    for (StackBucket* b = head; b; b = b->next) {
+      live_count += b->live_count;
+      live_bytes += b->live_bytes;
+      alloc_count += b->alloc_count;
+      alloc_bytes += b->alloc_bytes;
+    }
+  }
+  w->print("heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%zu\n",
+           (unsigned long long)live_count, (unsigned long long)live_bytes,
+           (unsigned long long)alloc_count, (unsigned long long)alloc_bytes,
+           g_sample_interval.load(std::memory_order_relaxed));
+
+  for (StackBucket* head : g_buckets) {
+    for (StackBucket* b = head; b; b = b->next) {
+      w->print("%6llu: %8llu [%6llu: %8llu] @",
+               (unsigned long long)b->live_count,
+               (unsigned long long)b->live_bytes,
+               (unsigned long long)b->alloc_count,
+               (unsigned long long)b->alloc_bytes);
+      for (unsigned i = 0; i < b->depth; ++i) w->print(" %p", b->pcs[i]);
+      w->print("\n");
+    }
+  }
+}
+
+void write_mapped_libraries(Writer* w) noexcept {
+  w->print("\nMAPPED_LIBRARIES:\n");
+  int fd = fsys_open2("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (fsys_failure(fd)) return;
+  char buf[4096];
+  ssize_t l;
+  while ((l = fsys_read(fd, buf, sizeof(buf))) > 0) w->write(buf, l);
+  fsys_close(fd);
+}
+
+void dump_requested_profile() noexcept {
+  const char* prefix = g_dump_prefix.load(std::memory_order_acquire);
+  if (prefix == nullptr) return;
+  char path[4096];
+  int l = snprintf(path, sizeof(path), "%s.%d.%u.heap", prefix, int(getpid()),
+                   g_dump_seq.fetch_add(1, std::memory_order_relaxed));
+  if (l <= 0 || size_t(l) >= sizeof(path)) return;
+  int fd = fsys_open3(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fsys_failure(fd)) return;
+  write_heap_profile(fd);
+  fsys_close(fd);
+}
+
+void heap_profile_signal_handler(int) {
+  g_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+void* heap_profile_allocate(size_t size, AllocateOptions options) noexcept {
+  size_t interval = g_sample_interval.load(std::memory_order_relaxed);
+  if (interval == 0) {
+    t_heap_sample_countdown = kDisabledCountdown;
+    return nullptr;
+  }
+  // Don't take a sample the first time we get here -- that's only because the
+  // thread's countdown starts at 0.
+  bool first = (t_rng == 0);
+  t_heap_sample_countdown = next_sample_countdown(interval);
+  if (first || size == 0) return nullptr;
+
+  if (g_dump_requested.load(std::memory_order_relaxed) &&
+      g_dump_requested.exchange(false, std::memory_order_relaxed))
+    dump_requested_profile();
+
+  void* ptr = alloc_large(size, options.zero, options.populate);
+  if (false_no_fail(ptr == nullptr)) return nullptr;
+  mark_large_block_sampled(ptr);
+
+  void* pcs[kMaxDepth];
+  unsigned depth = capture_stack(pcs);
+
+  std::lock_guard locker(g_lock);
+  // If we fail to allocate metadata, the block is still flagged as sampled,
+  // and heap_profile_free simply doesn't find it
+  StackBucket* bucket = find_bucket(pcs, depth);
+  if (false_no_fail(bucket == nullptr)) return ptr;
+  void* mem = g_sample_allocator.alloc();
+  if (false_no_fail(mem == nullptr)) return ptr;
+  Sample** head = &g_samples[sample_index(ptr)];
+  *head = new (mem) Sample{*head, ptr, size, bucket};
+  bucket->alloc_count++;
+  bucket->alloc_bytes += size;
+  bucket->live_count++;
+  bucket->live_bytes += size;
+  return ptr;
+}
+
+void heap_profile_free(void* ptr) noexcept {
+  std::lock_guard locker(g_lock);
+  for (Sample** p = &g_samples[sample_index(ptr)]; *p; p = &(*p)->next) {
+    Sample* sample = *p;
+    if (sample->ptr == ptr) {
+      *p = sample->next;
+      sample->bucket->live_count--;
+      sample->bucket->live_bytes -= sample->size;
+      g_sample_allocator.free(sample);
+      return;
+    }
+  }
+}
+
+bool set_heap_sample_interval(size_t bytes) noexcept {
+  g_sample_interval.store(bytes, std::memory_order_relaxed);
+  return true;
+}
+
+bool write_heap_profile(int fd) noexcept {
+  Writer w(fd);
+  write_buckets(&w);
+  write_mapped_libraries(&w);
+  return w.ok();
+}
+
+bool install_heap_profile_signal(int signo, const char* path_prefix) noexcept {
+  g_dump_prefix.store(path_prefix, std::memory_order_release);
+  struct sigaction sa = {};
+  sa.sa_handler = heap_profile_signal_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(signo, &sa, nullptr) == 0;
+}
+
+}  // namespace cbu::alloc
+
+#else  // !CBU_ALLOC_HEAP_PROFILER
+
+namespace cbu::alloc {
+
+bool set_heap_sample_interval(size_t) noexcept { return false; }
+bool write_heap_profile(int) noexcept { return false; }
+bool install_heap_profile_signal(int, const char*) noexcept { return false; }
+
+}  // namespace cbu::alloc
+
+#endif
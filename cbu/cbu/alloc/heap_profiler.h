@@ -0,0 +1,66 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace cbu {
+namespace alloc {
+
+// Sampling heap profiler.
+//
+// Only available if compiled with CBU_ALLOC_HEAP_PROFILER; otherwise all
+// functions are no-ops that return false.
+//
+// Allocations are sampled on average once every interval bytes (using an
+// exponential distribution, as tcmalloc does), so that non-sampled allocations
+// only pay a decrement of a thread-local countdown.  Sampled blocks are always
+// placed on their own pages.
+// Stacks are captured by walking frame pointers, so for useful results, the
+// program should be compiled with -fno-omit-frame-pointer.
+//
+// Profiles are written in the legacy text format of gperftools (heap_v2),
+// which pprof understands.  Each profile has both the live heap (default
+// in pprof, or -inuse_space) and all sampled allocations since the start
+// (-alloc_space).
+
+// The default interval is 512 KiB.  0 disables sampling.
+bool set_heap_sample_interval(size_t bytes) noexcept;
+
+// Writes a profile to fd.  This function doesn't allocate memory.
+bool write_heap_profile(int fd) noexcept;
+
+// Install a handler for signo.  On receipt of the signal, a profile is
+// written to "<path_prefix>.<pid>.<seq>.heap" by the thread doing the next
+// sampled allocation (writing in the signal handler may deadlock).
+// path_prefix must remain valid.
+bool install_heap_profile_signal(int signo, const char* path_prefix) noexcept;
+
+}  // namespace alloc
+}  // namespace cbu
@@ -0,0 +1,151 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef CBU_ALLOC_NUMA
+
+#include "cbu/alloc/private/numa.h"
+
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "cbu/alloc/private/rseq.h"
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu::alloc {
+namespace {
+
+constinit std::atomic<bool> g_numa_ready{false};
+constinit LowLevelMutex g_numa_lock{};
+constinit unsigned g_node_count = 1;
+constinit bool g_topology_fake = false;
+constinit uint8_t g_cpu_to_node[kMaxNumaCpus] = {};
+
+// Parses a cpulist like "0-3,8-11" (up to end or a semicolon), and assigns
+// the CPUs to node.  Returns the position after the list.
+const char* parse_cpulist(const char* s, unsigned node) noexcept {
+  while (*s && *s != ';') {
+    char* end;
+    unsigned long lo = strtoul(s, &end, 10);
+    if (end == s) {
+      ++s;  // Skip garbage, including the trailing '\n' of sysfs files
+      continue;
+    }
+    unsigned long hi = lo;
+    s = end;
+    if (*s == '-') {
+      hi = strtoul(s + 1, &end, 10);
+      s = end;
+    }
+    for (unsigned long cpu = lo; cpu <= hi && cpu < kMaxNumaCpus; ++cpu)
+      g_cpu_to_node[cpu] = node;
+    if (*s == ',') ++s;
+  }
+  return s;
+}
+
+void read_fake_topology(const char* s) noexcept {
+  g_topology_fake = true;
+  unsigned node = 0;
+  for (;;) {
+    s = parse_cpulist(s, node);
+    if (*s != ';' || node + 1 >= kMaxNumaNodes) break;
+    ++s;
+    ++node;
+  }
+  g_node_count = node + 1;
+}
+
+void read_sys_topology() noexcept {
+  unsigned max_node = 0;
+  for (unsigned node = 0; node < kMaxNumaNodes; ++node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+             node);
+    int fd = fsys_open2(path, O_RDONLY | O_CLOEXEC);
+    if (fsys_failure(fd)) continue;
+    char buf[4096];
+    ssize_t l = fsys_read(fd, buf, sizeof(buf) - 1);
+    fsys_close(fd);
+    if (l <= 0) continue;
+    buf[l] = '\0';
+    parse_cpulist(buf, node);
+    max_node = node;
+  }
+  g_node_count = max_node + 1;
+}
+
+[[gnu::noinline]] void init_topology() noexcept {
+  std::lock_guard locker(g_numa_lock);
+  if (g_numa_ready.load(std::memory_order_relaxed)) return;
+  if (const char* fake = getenv("CBU_ALLOC_NUMA_TOPOLOGY"))
+    read_fake_topology(fake);
+  else
+    read_sys_topology();
+  g_numa_ready.store(true, std::memory_order_release);
+}
+
+inline void ensure_topology() noexcept {
+  if (!g_numa_ready.load(std::memory_order_acquire)) [[unlikely]]
+    init_topology();
+}
+
+}  // namespace
+
+unsigned current_numa_node() noexcept {
+  ensure_topology();
+  if (g_node_count == 1) return 0;
+  int cpu = current_cpu();
+  if (cpu < 0) cpu = fsys_sched_getcpu();
+  if (cpu < 0 || unsigned(cpu) >= kMaxNumaCpus) return 0;
+  return g_cpu_to_node[cpu];
+}
+
+unsigned numa_node_count() noexcept {
+  ensure_topology();
+  return g_node_count;
+}
+
+void numa_bind_preferred(void* ptr, size_t size, unsigned node) noexcept {
+  ensure_topology();
+  if (g_topology_fake || g_node_count == 1 || node >= kMaxNumaNodes) return;
+  unsigned long mask[kMaxNumaNodes / (8 * sizeof(long))] = {};
+  mask[node / (8 * sizeof(long))] = 1ul << (node % (8 * sizeof(long)));
+  // Failure is harmless -- the pages just go wherever the kernel likes
+  fsys_generic(__NR_mbind, long, 6, ptr, size, MPOL_PREFERRED, mask,
+               kMaxNumaNodes + 1, 0);
+}
+
+}  // namespace cbu::alloc
+
+#endif  // CBU_ALLOC_NUMA
@@ -28,21 +28,28 @@
 
 #include "cbu/alloc/private/page.h"
 
+#include <errno.h>
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
+#include <array>
+#include <atomic>
 #include <mutex>
+#include <new>
 #include <optional>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/private/common.h"
+#include "cbu/alloc/private/heap_profiler.h"
+#include "cbu/alloc/private/numa.h"
 #include "cbu/alloc/private/rb.h"
 #include "cbu/alloc/private/tc.h"
 #include "cbu/alloc/private/trie.h"
 #include "cbu/common/byte_size.h"
 #include "cbu/common/hint.h"
+#include "cbu/common/procutil.h"
 #include "cbu/fsyscall/fsyscall.h"
 
 namespace cbu {
@@ -120,6 +127,7 @@ Page* PageTreeAllocator::allocate(size_t size) noexcept {
       desc = ad_.remove(desc);
       Page* ret = desc->addr;
       free_description(desc);
+      total_bytes_ -= size;
       return ret;
     }
 
@@ -129,6 +137,7 @@ Page* PageTreeAllocator::allocate(size_t size) noexcept {
         desc->addr = byte_advance(ret, size);
         desc->size = small_idx_to_size(k) - size;
         szad_small_[small_size_to_idx(desc->size)].insert(desc);
+        total_bytes_ -= size;
         return ret;
       }
     }
@@ -151,12 +160,22 @@ Page* PageTreeAllocator::allocate(size_t size) noexcept {
       desc->size -= size;
       insert_to_szad(desc);
     }
+    total_bytes_ -= size;
     return ret;
   } else {
     return nullptr;
   }
 }
 
+void PageTreeAllocator::drop_all() noexcept {
+  // Every description is in exactly one of the size trees
+  for (auto& tree : szad_small_)
+    while (Description* desc = tree.try_pop_first()) free_description(desc);
+  while (Description* desc = szad_large_.try_pop_first())
+    free_description(desc);
+  total_bytes_ = 0;
+}
+
 bool PageTreeAllocator::reclaim(Page* page, size_t size,
                                 uint32_t option_bitmask) noexcept {
   CBU_HINT_ASSERT(page != nullptr);
@@ -164,6 +183,7 @@ bool PageTreeAllocator::reclaim(Page* page, size_t size,
   assert(size % kPageSize == 0);
 
   Description* desc;
+  const size_t reclaimed_size = size;
 
   // Can we merge right?
   Description* succ = (option_bitmask & RECLAIM_PAGE_NOMERGE_RIGHT)
@@ -201,6 +221,7 @@ bool PageTreeAllocator::reclaim(Page* page, size_t size,
   }
 
   insert_to_szad(desc);
+  total_bytes_ += reclaimed_size;
   return true;
 }
 
@@ -215,6 +236,7 @@ bool PageTreeAllocator::reclaim_nomerge(Page* page, size_t size) noexcept {
   desc->size = size;
   desc = ad_.insert(desc);
   insert_to_szad(desc);
+  total_bytes_ += size;
   return true;
 }
 
@@ -232,6 +254,7 @@ bool PageTreeAllocator::extend_nomove(Page* ptr, size_t old,
   Description* succ = ad_.search(target);
   if (succ && (succ->size >= grow)) {
     // Yes
+    total_bytes_ -= grow;
     succ = remove_from_szad(succ);
     if (succ->size == grow) {
       // Perfect size.
@@ -261,24 +284,10 @@ Description* PageTreeAllocator::get_deallocate_candidates(
 
     p = szad_large_.remove(p);
     p = ad_.remove(p);
+    total_bytes_ -= p->size;
 
     if constexpr (kTHPSize > 0) {
-      if (thp_aware && kTHPSize * 2 < threshold) {
-        // Split from right
-        Page* end = byte_advance(p->addr, p->size);
-        if (size_t offset = uintptr_t(end) % kTHPSize) {
-          p->size -= offset;
-          reclaim_nomerge(byte_back(end, offset), offset);
-        }
-
-        // Split from left
-        if (size_t adjust = (-uintptr_t(p->addr)) % kTHPSize) {
-          Page* addr = p->addr;
-          p->addr = byte_advance(p->addr, adjust);
-          p->size -= adjust;
-          reclaim_nomerge(addr, adjust);
-        }
-      }
+      if (thp_aware && kTHPSize * 2 < threshold) trim_to_thp(p);
     }
 
     p->rblink_1.left(list);
@@ -292,6 +301,7 @@ Description* PageTreeAllocator::get_deallocate_candidates(
     auto& tree = szad_small_[idx];
     while (Description* q = tree.try_pop_first()) {
       q = ad_.remove(q);
+      total_bytes_ -= q->size;
       q->rblink_1.left(list);
       list = q;
     }
@@ -300,6 +310,62 @@ Description* PageTreeAllocator::get_deallocate_candidates(
   return list;
 }
 
+Description* PageTreeAllocator::get_purge_candidates(size_t bytes,
+                                                    bool thp_aware) noexcept {
+  Description* list = nullptr;
+  size_t taken = 0;
+
+  while (taken < bytes) {
+    Description* p = szad_large_.last();
+    if (!p) break;
+
+    p = szad_large_.remove(p);
+    p = ad_.remove(p);
+    total_bytes_ -= p->size;
+
+    // Don't split huge pages, unless the run is too small to contain any
+    if constexpr (kTHPSize > 0) {
+      if (thp_aware && p->size >= kTHPSize * 2) trim_to_thp(p);
+    }
+
+    taken += p->size;
+    p->rblink_1.left(list);
+    list = p;
+  }
+
+  for (size_t i = kSmallMaxSize; i > 0 && taken < bytes; i -= kPageSize) {
+    auto& tree = szad_small_[small_size_to_idx(i)];
+    while (taken < bytes) {
+      Description* q = tree.try_pop_first();
+      if (!q) break;
+      q = ad_.remove(q);
+      total_bytes_ -= q->size;
+      taken += q->size;
+      q->rblink_1.left(list);
+      list = q;
+    }
+  }
+
+  return list;
+}
+
+void PageTreeAllocator::trim_to_thp(Description* p) noexcept {
+  // Split from right
+  Page* end = byte_advance(p->addr, p->size);
+  if (size_t offset = uintptr_t(end) % kTHPSize) {
+    p->size -= offset;
+    reclaim_nomerge(byte_back(end, offset), offset);
+  }
+
+  // Split from left
+  if (size_t adjust = (-uintptr_t(p->addr)) % kTHPSize) {
+    Page* addr = p->addr;
+    p->addr = byte_advance(p->addr, adjust);
+    p->size -= adjust;
+    reclaim_nomerge(addr, adjust);
+  }
+}
+
 void PageTreeAllocator::remove_by_range(Page* page, size_t size) noexcept {
   remove_by_range(page, size, [](void*, size_t) noexcept {});
 }
@@ -308,6 +374,10 @@ template <typename Callback>
 void PageTreeAllocator::remove_by_range(Page* page, size_t size,
                                         Callback callback) noexcept {
   Page* end = byte_advance(page, size);
+  auto removed = [&](Page* subrange, size_t subsize) {
+    total_bytes_ -= subsize;
+    callback(subrange, subsize);
+  };
 
   Description* p = ad_.psearch(page);
 
@@ -320,7 +390,7 @@ void PageTreeAllocator::remove_by_range(Page* page, size_t size,
       if (page < p_end) {
         if (end < p_end) {
           // Special case - the range is in the middle of p_prev
-          callback(page, size);
+          removed(page, size);
           p = remove_from_szad(p);
           p->size = byte_distance(p->addr, page);
           insert_to_szad(p);
@@ -333,12 +403,14 @@ void PageTreeAllocator::remove_by_range(Page* page, size_t size,
             p_new->size = byte_distance(end, p_end);
             p_new = ad_.insert(p_new);
             p_new = insert_to_szad(p_new);
+          } else {
+            total_bytes_ -= byte_distance(end, p_end);
           }
           return;
 
         } else {
           // The range covers a suffix of the node
-          callback(page, byte_distance(page, p_end));
+          removed(page, byte_distance(page, p_end));
           p = remove_from_szad(p);
           p->size = byte_distance(p->addr, page);
           p = insert_to_szad(p);
@@ -365,11 +437,11 @@ void PageTreeAllocator::remove_by_range(Page* page, size_t size,
       p->addr = end;
       p->size = byte_distance(end, p_end);
       p = insert_to_szad(p);
-      callback(page, byte_distance(page, end));
+      removed(page, byte_distance(page, end));
       return;
     } else {
       // Otheriwse, we should remove the whole node
-      callback(page, p->size);
+      removed(page, p->size);
       auto next_p = ad_.next(p);
       p = ad_.remove(p);
       p = remove_from_szad(p);
@@ -387,10 +459,135 @@ void PageTreeAllocator::remove_by_list(const Description* list) noexcept {
   }
 }
 
+namespace {
+
+// Weights of epochs in DecayState (16-bit fixed point), from the latest
+// complete epoch to the oldest.
+// smootherstep(x) = 6x^5 - 15x^4 + 10x^3, where x goes from 1 down to 0.
+constexpr auto kDecayWeights = [] {
+  std::array<uint32_t, DecayState::kEpochs> res{};
+  for (unsigned i = 0; i < DecayState::kEpochs; ++i) {
+    double x = double(DecayState::kEpochs - 1 - i) / DecayState::kEpochs;
+    double h = x * x * x * (x * (x * 6 - 15) + 10);
+    res[i] = uint32_t(h * 65536);
+  }
+  return res;
+}();
+
+static_assert(kDecayWeights[0] > 65000);
+static_assert(kDecayWeights[DecayState::kEpochs - 1] == 0);
+
+#ifdef MADV_FREE
+// Set if the kernel doesn't support MADV_FREE (added in Linux 4.5)
+constinit std::atomic<bool> g_madv_free_unsupported{false};
+#endif
+
+#ifdef MADV_POPULATE_WRITE
+// Set if the kernel doesn't support MADV_POPULATE_WRITE (added in Linux 5.14)
+constinit std::atomic<bool> g_madv_populate_unsupported{false};
+#endif
+
+}  // namespace
+
+constinit std::atomic<uint64_t> g_purge_decay_ns{0};
+
+size_t DecayState::advance(uint64_t now_ns, uint64_t decay_ns,
+                           size_t current) noexcept {
+  uint64_t epoch_ns = std::max<uint64_t>(decay_ns / kEpochs, 1);
+  if (epoch_start_ == 0) epoch_start_ = now_ns;
+
+  // Bytes entering the state in the current (incomplete) epoch
+  size_t added = current > last_ ? current - last_ : 0;
+
+  if (now_ns >= epoch_start_ + epoch_ns) {
+    uint64_t n = (now_ns - epoch_start_) / epoch_ns;
+    epoch_start_ += n * epoch_ns;
+    if (n >= kEpochs) {
+      std::fill_n(history_, kEpochs, 0);
+      n = 1;
+    }
+    head_ = (head_ + 1) % kEpochs;
+    history_[head_] = added;
+    while (--n) {
+      head_ = (head_ + 1) % kEpochs;
+      history_[head_] = 0;
+    }
+    added = 0;
+    last_ = current;
+  }
+
+  size_t allowed = added;
+  for (unsigned i = 0; i < kEpochs; ++i) {
+    size_t bytes = history_[(head_ + kEpochs - i) % kEpochs];
+    allowed += (bytes * kDecayWeights[i]) >> 16;
+  }
+  allowed = std::min(allowed, current);
+  // The caller is going to purge down to allowed
+  last_ = std::min(last_, allowed);
+  return allowed;
+}
+
+namespace {
+
+#if defined __x86_64__ && defined __LP64__
+// Traditionally x86-64 had 48-bit virtual address, but recent processors
+// support 57 bits (56 bits for user space)
+constexpr size_t kPointerValidBits = 56;
+#elif defined __aarch64__
+// Recent aarch64 and Linux kernel can enable 52-bit address space
+constexpr size_t kPointerValidBits = 52;
+#else
+constexpr size_t kPointerValidBits = sizeof(void*) * 8;
+#endif
+
+template <size_t... I>
+constexpr std::array<Arena, kArenaShards> make_arena_shards(
+    RawPageAllocator* allocator, std::index_sequence<I...>) noexcept {
+  return {{Arena(allocator, I)...}};
+}
+
+// Shard owning each page of arena_brk and arena_mmap (unused with 1 shard),
+// or arena handle (kArenaHandleOwnerBase + index) owning each page
+Trie<kPointerValidBits - kPageSizeBits, uint8_t> arena_owner_trie;
+
+bool set_arena_owner(Page* page, size_t size, unsigned shard) noexcept {
+  uintptr_t v = uintptr_t(page) >> kPageSizeBits;
+  uintptr_t end = v + (size >> kPageSizeBits);
+  while (v < end) {
+    uint8_t* p = arena_owner_trie.lookup(v);
+    if (false_no_fail(p == nullptr)) return false;
+    // Fill the rest of the leaf node
+    size_t n = std::min<uintptr_t>(end - v, 64 - uintptr_t(p) % 64);
+    memset(p, shard, n);
+    v += n;
+  }
+  return true;
+}
+
+inline unsigned arena_owner(const Page* page) noexcept {
+  if constexpr (kArenaShards == 1) return 0;
+  return *arena_owner_trie.lookup_fail_crash(uintptr_t(page) >> kPageSizeBits);
+}
+
+inline unsigned current_arena_shard() noexcept {
+  if constexpr (kArenaShards == 1) return 0;
+#ifdef CBU_ALLOC_NUMA
+  // One shard per node
+  return current_numa_node() % kArenaShards;
+#else
+  ThreadCache* tc = get_thread_cache();
+  return tc ? tc->arena_shard : 0;
+#endif
+}
+
+}  // namespace
+
 #ifndef CBU_NO_BRK
-constinit Arena arena_brk{&RawPageAllocator::instance_brk};
+constinit std::array<Arena, kArenaShards> arena_brk = make_arena_shards(
+    &RawPageAllocator::instance_brk, std::make_index_sequence<kArenaShards>());
 #endif
-constinit Arena arena_mmap{&RawPageAllocator::instance_mmap};
+constinit std::array<Arena, kArenaShards> arena_mmap = make_arena_shards(
+    &RawPageAllocator::instance_mmap, std::make_index_sequence<kArenaShards>());
 constinit Arena arena_mmap_no_thp{&RawPageAllocator::instance_mmap_no_thp};
 
 Page* Arena::allocate(size_t size, bool zero) noexcept {
@@ -400,7 +597,9 @@ Page* Arena::allocate(size_t size, bool zero) noexcept {
   std::lock_guard locker(lock_);
 
   // First try allocating from one of tree_clean_ and tree_dirty_,
+  // (or tree_lazy_, which is as good as tree_dirty_ if we don't need zero)
   Page* page = (zero ? tree_clean_ : tree_dirty_).allocate(size);
+  if (!page && !zero) page = tree_lazy_.allocate(size);
 
   if (page) {
     // Remove pages from tree_all as well
@@ -412,12 +611,14 @@ Page* Arena::allocate(size_t size, bool zero) noexcept {
     if (page) {
       tree_clean_.remove_by_range(page, size);
       if (zero) {
-        tree_dirty_.remove_by_range(page, size,
-                                    [](Page* subrange, size_t subsize) {
-                                      memset(subrange, 0, subsize);
-                                    });
+        auto clear = [](Page* subrange, size_t subsize) {
+          memset(subrange, 0, subsize);
+        };
+        tree_dirty_.remove_by_range(page, size, clear);
+        tree_lazy_.remove_by_range(page, size, clear);
       } else {
         tree_dirty_.remove_by_range(page, size);
+        tree_lazy_.remove_by_range(page, size);
       }
     }
   }
@@ -425,9 +626,26 @@ Page* Arena::allocate(size_t size, bool zero) noexcept {
   if (!page) {
     size_t alloc_size = cbu::pow2_ceil(
         std::max(std::min(total_bytes_allocated_, kMaxAllocSize), size),
-        kInitialAllocSize);
+        g_conf.initial_alloc_size);
     page = raw_page_allocator_->allocate(alloc_size);
     if (page == nullptr) return nullptr;
+    if (shard_ >= kArenaHandleOwnerBase) {
+      if (!set_arena_owner(page, alloc_size, shard_)) {
+        discard(page, alloc_size);
+        return nullptr;
+      }
+    } else if constexpr (kArenaShards > 1) {
+      if (this != &arena_mmap_no_thp &&
+          !set_arena_owner(page, alloc_size, shard_)) {
+        discard(page, alloc_size);
+        return nullptr;
+      }
+#ifdef CBU_ALLOC_NUMA
+      // Bind only if each shard serves exactly one node
+      if (this != &arena_mmap_no_thp && numa_node_count() <= kArenaShards)
+        numa_bind_preferred(page, alloc_size, shard_);
+#endif
+    }
     if (size < alloc_size)
       reclaim_unlocked(byte_advance(page, size), alloc_size - size,
                        RECLAIM_PAGE_NOMERGE_LEFT | RECLAIM_PAGE_CLEAN);
@@ -440,15 +658,19 @@ void Arena::reclaim_unlocked(Page* page, size_t size,
                              uint32_t option_bitmask) noexcept {
   // Don't modify total_bytes_allocated_ here -- this function is also
   // called from allocate.
-  if (!(option_bitmask & RECLAIM_PAGE_CLEAN)) reclaim_count_ += size;
+  if (!(option_bitmask & (RECLAIM_PAGE_CLEAN | RECLAIM_PAGE_LAZY))) {
+    reclaim_count_ += size;
+    bytes_reclaimed_ += size;
+  }
 
   if (false_no_fail(!tree_all_.reclaim(page, size, option_bitmask))) {
     discard(page, size);
     return;
   }
 
-  auto& tree =
-      (option_bitmask & RECLAIM_PAGE_CLEAN) ? tree_clean_ : tree_dirty_;
+  auto& tree = (option_bitmask & RECLAIM_PAGE_CLEAN)  ? tree_clean_
+               : (option_bitmask & RECLAIM_PAGE_LAZY) ? tree_lazy_
+                                                      : tree_dirty_;
   if (false_no_fail(!tree.reclaim(page, size, option_bitmask))) {
     tree_all_.remove_by_range(page, size);
     discard(page, size);
@@ -493,19 +715,25 @@ void Arena::reclaim_list(Page* page, size_t size) noexcept {
 }
 
 void Arena::discard(Page* ptr, size_t size) noexcept {
-  if (raw_page_allocator_->use_brk())
+  if (!raw_page_allocator_->can_unmap()) {
+    stat_add_shared(&madvise_calls_, 1);
     fsys_madvise(ptr, size, MADV_DONTNEED);
-  else
+  } else {
+    stat_add_shared(&munmap_calls_, 1);
+    stat_add_shared(&bytes_unmapped_, size);
     fsys_munmap(ptr, size);
+  }
 }
 
 bool Arena::extend_nomove(Page* ptr, size_t old, size_t grow) noexcept {
   std::lock_guard locker(lock_);
   // Try tree_clean first, which is more likely to succeed
   if (!tree_clean_.extend_nomove(ptr, old, grow) &&
-               !tree_dirty_.extend_nomove(ptr, old, grow))
+               !tree_dirty_.extend_nomove(ptr, old, grow) &&
+               !tree_lazy_.extend_nomove(ptr, old, grow))
     return false;
   tree_all_.remove_by_range(byte_advance(ptr, old), grow);
+  total_bytes_allocated_ += grow;
   return true;
 }
 
@@ -513,18 +741,39 @@ Description* Arena::trim_and_extract_unlocked(
     std::optional<size_t> threshold_opt) noexcept {
   size_t threshold = threshold_opt
                          ? *threshold_opt
-                         : std::clamp(total_bytes_allocated_, kMinTrimThreshold,
-                                      kMaxTrimThreshold);
-
-  if (reclaim_count_ < threshold * 2) return nullptr;
+                         : std::clamp(total_bytes_allocated_,
+                                      g_conf.min_trim_threshold,
+                                      g_conf.max_trim_threshold);
+
+  if (!threshold_opt &&
+      g_purge_decay_ns.load(std::memory_order_relaxed) != 0) {
+    // The background thread takes care of purging, unless it falls far
+    // behind
+    if (tree_dirty_.total_bytes() <=
+        std::max(total_bytes_allocated_, emergency_dirty_bytes()))
+      return nullptr;
+  } else if (reclaim_count_ < threshold * 2) {
+    return nullptr;
+  }
   reclaim_count_ = 0;
-  // We only check tree_dirty.  This is probably OK.
+  // We only check tree_dirty (and tree_lazy on explicit trim).  This is
+  // probably OK.
   // Pages in tree_clean_ are most likely not populated by kernel yet.
-  Description* list = tree_dirty_.get_deallocate_candidates(
-      threshold, kTHPSize && raw_page_allocator_->allow_thp());
-  // Even if we use BRK, we still have to remove the memory out of tree_all_,
-  // and then add them back, because we will run madvise without holding the
-  // lock.
+  bool thp_aware = raw_page_allocator_->thp_aware();
+  Description* list =
+      tree_dirty_.get_deallocate_candidates(threshold, thp_aware);
+  if (threshold_opt) {
+    if (Description* lazy =
+            tree_lazy_.get_deallocate_candidates(threshold, thp_aware)) {
+      Description* tail = lazy;
+      while (tail->rblink_1.left()) tail = tail->rblink_1.left();
+      tail->rblink_1.left(list);
+      list = lazy;
+    }
+  }
+  // Even if we can't unmap (BRK or an arena handle), we still have to remove
+  // the memory out of tree_all_, and then add them back, because we will run
+  // madvise without holding the lock.
   tree_all_.remove_by_list(list);
   return list;
 }
@@ -535,9 +784,11 @@ Description* Arena::trim_and_extract(std::optional<size_t> threshold) noexcept {
 }
 
 void Arena::clear_description_list(Description* clean) noexcept {
-  if (raw_page_allocator_->use_brk()) {
-    for (Description* cur = clean; cur; cur = cur->rblink_1.left())
+  if (!raw_page_allocator_->can_unmap()) {
+    for (Description* cur = clean; cur; cur = cur->rblink_1.left()) {
+      stat_add_shared(&madvise_calls_, 1);
       fsys_madvise(cur->addr, cur->size, MADV_DONTNEED);
+    }
     std::lock_guard locker(lock_);
     while (clean) {
       Description* cur = clean;
@@ -548,6 +799,8 @@ void Arena::clear_description_list(Description* clean) noexcept {
   } else {
     while (clean) {
       Description* cur = clean;
+      stat_add_shared(&munmap_calls_, 1);
+      stat_add_shared(&bytes_unmapped_, cur->size);
       fsys_munmap(cur->addr, cur->size);
       clean = cur->rblink_1.left();
       free_description(cur);
@@ -555,22 +808,108 @@ void Arena::clear_description_list(Description* clean) noexcept {
   }
 }
 
-namespace {
+void Arena::decay(uint64_t now_ns, uint64_t decay_ns) noexcept {
+  Description* dirty;
+  Description* lazy;
+  {
+    std::lock_guard locker(lock_);
+    dirty = extract_over_limit_unlocked(
+        &tree_dirty_,
+        dirty_decay_.advance(now_ns, decay_ns, tree_dirty_.total_bytes()));
+    lazy = extract_over_limit_unlocked(
+        &tree_lazy_,
+        lazy_decay_.advance(now_ns, decay_ns, tree_lazy_.total_bytes()));
+  }
+  clear_description_list(lazy);
+  clear_description_list(lazy_free_description_list(dirty));
+}
 
-#if defined __x86_64__ && defined __LP64__
-// Traditionally x86-64 had 48-bit virtual address, but recent processors
-// support 57 bits (56 bits for user space)
-constexpr size_t kPointerValidBits = 56;
-#elif defined __aarch64__
-// Recent aarch64 and Linux kernel can enable 52-bit address space
-constexpr size_t kPointerValidBits = 52;
-#else
-constexpr size_t kPointerValidBits = sizeof(void*) * 8;
+Description* Arena::extract_over_limit_unlocked(PageTreeAllocator* tree,
+                                                size_t limit) noexcept {
+  size_t bytes = tree->total_bytes();
+  if (bytes <= limit) return nullptr;
+  Description* list = tree->get_purge_candidates(
+      bytes - limit, raw_page_allocator_->thp_aware());
+  tree_all_.remove_by_list(list);
+  return list;
+}
+
+Description* Arena::lazy_free_description_list(Description* list) noexcept {
+#ifdef MADV_FREE
+  if (g_madv_free_unsupported.load(std::memory_order_relaxed)) return list;
+
+  Description* done = nullptr;
+  while (list) {
+    Description* cur = list;
+    stat_add_shared(&madvise_calls_, 1);
+    if (fsys_failure(fsys_madvise(cur->addr, cur->size, MADV_FREE))) {
+      g_madv_free_unsupported.store(true, std::memory_order_relaxed);
+      break;
+    }
+    list = cur->rblink_1.left();
+    cur->rblink_1.left(done);
+    done = cur;
+  }
+
+  if (done) {
+    std::lock_guard locker(lock_);
+    while (done) {
+      Description* cur = done;
+      reclaim_unlocked(cur->addr, cur->size, RECLAIM_PAGE_LAZY);
+      done = cur->rblink_1.left();
+      free_description(cur);
+    }
+  }
 #endif
+  return list;
+}
+
+void Arena::drop_all() noexcept {
+  std::lock_guard locker(lock_);
+  tree_clean_.drop_all();
+  tree_dirty_.drop_all();
+  tree_lazy_.drop_all();
+  tree_all_.drop_all();
+  total_bytes_allocated_ = 0;
+}
+
+void Arena::get_stats(ArenaStats* stats) noexcept {
+  {
+    std::lock_guard locker(lock_);
+    stats->bytes_in_use = total_bytes_allocated_;
+    stats->bytes_clean = tree_clean_.total_bytes();
+    stats->bytes_dirty = tree_dirty_.total_bytes();
+    stats->bytes_lazy = tree_lazy_.total_bytes();
+    stats->bytes_reclaimed = bytes_reclaimed_;
+  }
+  stats->bytes_mapped =
+      raw_page_allocator_->mapped_bytes() - stat_load(&bytes_unmapped_);
+  stats->bytes_raw_cached = raw_page_allocator_->cached_bytes();
+  stats->madvise_calls = stat_load(&madvise_calls_);
+  stats->munmap_calls = stat_load(&munmap_calls_);
+}
+
+namespace {
 
 // uint32_t is absolutely sufficient (4G * 4K is 16384 Gigabytes)
 Trie<kPointerValidBits - kPageSizeBits, uint32_t> large_block_trie;
 
+// Blocks are smaller than 4 GiB, so we can use the highest bits as flags:
+// for blocks sampled by the heap profiler, for blocks with mappings of
+// their own, and for blocks in arena handles
+constexpr uint32_t kLargeBlockSampled = uint32_t(1) << 31;
+constexpr uint32_t kLargeBlockMapped = uint32_t(1) << 30;
+constexpr uint32_t kLargeBlockInHandle = uint32_t(1) << 29;
+constexpr uint32_t kLargeBlockPagesMask = kLargeBlockInHandle - 1;
+
+// Blocks of at least this size get mappings of their own, so that realloc
+// can move them with mremap instead of memcpy.
+// Smaller blocks never have their own mappings, and vice versa.
+constexpr size_t kDirectMapThreshold = 16 * 1024 * 1024;
+
+constinit uint64_t direct_blocks = 0;
+constinit uint64_t direct_bytes = 0;
+
 uint32_t* lookup_large_block(const Page* page) {
   return large_block_trie.lookup(reinterpret_cast<uintptr_t>(page) >>
                                  kPageSizeBits);
@@ -590,27 +929,68 @@ bool set_large_block_size(Page* page, size_t n) noexcept {
 
 size_t lookup_large_block_size_fail_crash(const Page* page) {
   uint32_t* ptr = lookup_large_block_fail_crash(page);
-  return size_t(load_acquire(ptr)) << kPageSizeBits;
+  return size_t(load_acquire(ptr) & kLargeBlockPagesMask) << kPageSizeBits;
 }
 
 Page* allocate_page_uncached(size_t size, AllocateOptions options) {
+  unsigned shard = current_arena_shard();
 #ifndef CBU_NO_BRK
-  if (!options.force_mmap) {
-    Page* page = arena_brk.allocate(size, options.zero);
+  if (!options.force_mmap && g_conf.use_brk) {
+    Page* page = arena_brk[shard].allocate(size, options.zero);
     if (page) return page;
   }
 #endif
-  return (kTHPSize && options.force_mmap ? arena_mmap_no_thp : arena_mmap)
+  return (kTHPSize && options.force_mmap ? arena_mmap_no_thp
+                                         : arena_mmap[shard])
       .allocate(size, options.zero);
 }
 
+// The arena owning a page allocated without force_mmap
+Arena* owner_arena(Page* page) noexcept {
+#ifndef CBU_NO_BRK
+  if (RawPageAllocator::is_from_brk(page))
+    return &arena_brk[arena_owner(page)];
+#endif
+  return &arena_mmap[arena_owner(page)];
+}
+
+// Reclaims a list of pages of the same size to the arenas owning them
+void reclaim_list_to_owners(Arena* arenas, unsigned shards, Page* page,
+                            size_t size) noexcept {
+  if (shards == 1) {
+    arenas->reclaim_list(page, size);
+    return;
+  }
+  Page* lists[kArenaShards] = {};
+  while (page) {
+    Page* next = page->next;
+    unsigned shard = arena_owner(page);
+    page->next = lists[shard];
+    lists[shard] = page;
+    page = next;
+  }
+  for (unsigned i = 0; i < shards; ++i)
+    if (lists[i]) arenas[i].reclaim_list(lists[i], size);
+}
+
 }  // namespace
 
-void PageCategoryCache::clear(Arena* arena) noexcept {
+void PageCategoryCache::clear(Arena* arenas, unsigned shards) noexcept {
+  if (shards > 1) {
+    for (unsigned i = 0; i < kPageCategories; ++i) {
+      Page* page = std::exchange(page_list[i], nullptr);
+      stat_store(&page_count[i], 0);
+      if (page)
+        reclaim_list_to_owners(arenas, shards, page, page_category_to_size(i));
+    }
+    return;
+  }
+
+  Arena* arena = arenas;
   std::lock_guard locker_b(arena->lock_);
   for (unsigned i = 0; i < kPageCategories; ++i) {
     Page* page = std::exchange(page_list[i], nullptr);
-    page_count[i] = 0;
+    stat_store(&page_count[i], 0);
     while (page) {
       Page* next = page->next;
       arena->reclaim_unlocked(page, page_category_to_size(i));
@@ -625,7 +1005,7 @@ Page* try_allocate_from_cache(PageCategoryCache* cache, size_t cat) {
   if (cache->page_list[cat]) {
     Page* ret = cache->page_list[cat];
     cache->page_list[cat] = ret->next;
-    cache->page_count[cat]--;
+    stat_store(&cache->page_count[cat], cache->page_count[cat] - 1);
     return CBU_HINT_NONNULL(ret);
   }
   return nullptr;
@@ -648,16 +1028,26 @@ void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
 #endif
   bool use_no_thp = kTHPSize && (option_bitmask & RECLAIM_PAGE_NO_THP);
 
-  Arena* arena =
+  // The owner is looked up lazily, since the page may go to the thread cache
+  Arena* arenas =
 #ifndef CBU_NO_BRK
-      from_brk ? &arena_brk :
+      from_brk ? arena_brk.data() :
 #endif
       use_no_thp ? &arena_mmap_no_thp
-                 : &arena_mmap;
+                 : arena_mmap.data();
+  unsigned shards = use_no_thp ? 1 : kArenaShards;
+
+  bool cacheable = size <= PageCategoryCache::page_category_to_size(
+                               PageCategoryCache::kPageMaxCategory);
+#ifdef CBU_ALLOC_NUMA
+  // Don't let thread caches hand out pages of other nodes
+  if (cacheable && shards > 1 && arena_owner(page) != current_arena_shard())
+    cacheable = false;
+#endif
 
-  if (size <= PageCategoryCache::page_category_to_size(
-                  PageCategoryCache::kPageMaxCategory)) {
+  if (cacheable) {
     if (ThreadCache* tc = get_or_create_thread_cache()) {
+      ThreadCacheUse use(tc);
       PageCategoryCache* page_cache_ptr = &tc->page_category_cache;
 #ifndef CBU_NO_BRK
       if (from_brk) {
@@ -679,11 +1069,13 @@ void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
 
       if (page_cache.page_count[cat] <
           PageCategoryCache::kPagePreferredCount * 2) {
-        page_cache.page_count[cat]++;
+        stat_store(&page_cache.page_count[cat], page_cache.page_count[cat] + 1);
         page_cache.page_list[cat] = page;
       } else {
         // Keep some, and free the rest
-        page_cache.page_count[cat] -= PageCategoryCache::kPagePreferredCount;
+        stat_store(&page_cache.page_count[cat],
+                   page_cache.page_count[cat] -
+                       PageCategoryCache::kPagePreferredCount);
 
         Page* check = cache_head;
         for (unsigned count = 1; count < PageCategoryCache::kPagePreferredCount;
@@ -691,12 +1083,13 @@ void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
           check = check->next;
         page_cache.page_list[cat] = std::exchange(check->next, nullptr);
 
-        arena->reclaim_list(page, size);
+        reclaim_list_to_owners(arenas, shards, page, size);
       }
       return;
     }
   }
 
+  Arena* arena = (shards > 1) ? &arenas[arena_owner(page)] : arenas;
   arena->reclaim(page, size, option_bitmask);
 }
 
@@ -704,17 +1097,47 @@ void reclaim_page(Page* ptr, size_t size, AllocateOptions options) noexcept {
   reclaim_page(ptr, size, options.force_mmap ? RECLAIM_PAGE_NO_THP : 0);
 }
 
+void populate_pages(void* ptr, size_t size) noexcept {
+#ifdef MADV_POPULATE_WRITE
+  if (!g_madv_populate_unsupported.load(std::memory_order_relaxed)) {
+    auto r = fsys_madvise(ptr, size, MADV_POPULATE_WRITE);
+    // Other errors (e.g., out of memory) are left to the first touch
+    if (!fsys_failure(r) || !fsys_errno(r, EINVAL)) return;
+    g_madv_populate_unsupported.store(true, std::memory_order_relaxed);
+  }
+#endif
+  // Touch each page with a write that doesn't change anything
+  for (size_t off = 0; off < size; off += kPageSize)
+    std::atomic_ref(*static_cast<char*>(byte_advance(ptr, off)))
+        .fetch_or(0, std::memory_order_relaxed);
+}
+
+namespace {
+
+[[gnu::noinline]] Page* allocate_page_populate(
+    size_t size, AllocateOptions options) noexcept {
+  Page* page = allocate_page(size, options.with_populate(false));
+  if (true_no_fail(page != nullptr)) populate_pages(page, size);
+  return page;
+}
+
+}  // namespace
+
 // Allocate contiguous pages of size bytes
 Page* allocate_page(size_t size, AllocateOptions options) noexcept {
   assert(size != 0);
   assert(size % kPageSize == 0);
 
+  if (options.populate) [[unlikely]]
+    return allocate_page_populate(size, options);
+
   ThreadCache* tc = get_thread_cache();
 
   if (tc && !options.zero &&
       size <= PageCategoryCache::page_category_to_size(
                   PageCategoryCache::kPageMaxCategory)) {
     size_t cat = PageCategoryCache::size_to_page_category(size);
+    ThreadCacheUse use(tc);
 #ifndef CBU_NO_BRK
     if (!options.force_mmap) {
       Page* ret = try_allocate_from_cache(&tc->page_category_cache_brk, cat);
@@ -733,14 +1156,44 @@ Page* allocate_page(size_t size, AllocateOptions options) noexcept {
   return allocate_page_uncached(size, options);
 }
 
-void* alloc_large(size_t n, bool zero) noexcept {
+namespace {
+
+void* alloc_direct(size_t n, bool populate) noexcept {
+  void* p = fsys_mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                          (populate ? MAP_POPULATE : 0),
+                      -1, 0);
+  if (false_no_fail(fsys_mmap_failed(p))) return nomem();
+  uint32_t* desc = lookup_large_block(static_cast<Page*>(p));
+  if (false_no_fail(desc == nullptr)) {
+    fsys_munmap(p, n);
+    return nomem();
+  }
+  store_release(desc, uint32_t(n >> kPageSizeBits) | kLargeBlockMapped);
+  stat_add_shared(&direct_blocks, 1);
+  stat_add_shared(&direct_bytes, n);
+  return p;
+}
+
+void free_direct(void* ptr, size_t n) noexcept {
+  fsys_munmap(ptr, n);
+  stat_add_shared(&direct_blocks, -1);
+  stat_add_shared(&direct_bytes, -n);
+}
+
+}  // namespace
+
+void* alloc_large(size_t n, bool zero, bool populate) noexcept {
   n = pagesize_ceil(n);
   if constexpr (sizeof(void*) > 4) {
     // We don't support allocating more than 4 gigabytes at one time
     if (n != uint32_t(n)) return nomem();
     n = uint32_t(n);
   }
-  Page* page = allocate_page(n, alloc::AllocateOptions().with_zero(zero));
+  // Fresh mappings are always zero
+  if (n >= kDirectMapThreshold) return alloc_direct(n, populate);
+  Page* page = allocate_page(
+      n, alloc::AllocateOptions().with_zero(zero).with_populate(populate));
   if (false_no_fail(!page)) return nullptr;
   if (!set_large_block_size(page, n)) {
     reclaim_page(page, n);
@@ -749,16 +1202,51 @@ void* alloc_large(size_t n, bool zero) noexcept {
   return page;
 }
 
+#ifdef CBU_ALLOC_HEAP_PROFILER
+void mark_large_block_sampled(void* ptr) noexcept {
+  uint32_t* desc = lookup_large_block_fail_crash(static_cast<Page*>(ptr));
+  store_release(desc, load_acquire(desc) | kLargeBlockSampled);
+}
+#endif
+
 void free_large(void* ptr) noexcept {
   Page* page = static_cast<Page*>(ptr);
-  size_t size = lookup_large_block_size_fail_crash(page);
-  reclaim_page(page, size);
+  uint32_t* desc = lookup_large_block_fail_crash(page);
+  uint32_t v = load_acquire(desc);
+#ifdef CBU_ALLOC_HEAP_PROFILER
+  if (v & kLargeBlockSampled) [[unlikely]] {
+    heap_profile_free(ptr);
+    v &= ~kLargeBlockSampled;
+    store_release(desc, v);
+  }
+#endif
+  size_t size = size_t(v & kLargeBlockPagesMask) << kPageSizeBits;
+  if (v & kLargeBlockMapped)
+    free_direct(ptr, size);
+  else if (v & kLargeBlockInHandle) [[unlikely]]
+    arena_handle_of_page(page)->arena.reclaim(page, size);
+  else
+    reclaim_page(page, size);
 }
 
 void free_large(void* ptr, size_t size) noexcept {
+#ifdef CBU_ALLOC_HEAP_PROFILER
+  // The block may be much larger than size if it's sampled
+  (void)size;
+  free_large(ptr);
+#else
+  // Only the descriptor tells whether the block is in a handle
+  if (arena_handles_used()) [[unlikely]] {
+    free_large(ptr);
+    return;
+  }
   Page* page = static_cast<Page*>(ptr);
   size = pagesize_ceil(size);
-  reclaim_page(page, size);
+  if (size >= kDirectMapThreshold)
+    free_direct(ptr, size);
+  else
+    reclaim_page(page, size);
+#endif
 }
 
 void* realloc_large(void* ptr, size_t newsize) noexcept {
@@ -766,9 +1254,35 @@ void* realloc_large(void* ptr, size_t newsize) noexcept {
   newsize = pagesize_ceil(newsize);
   Page* page = (Page*)ptr;
   uint32_t* desc = lookup_large_block_fail_crash((Page*)ptr);
-  size_t oldsize = load_acquire(desc) << kPageSizeBits;
+  uint32_t v = load_acquire(desc);
+  size_t oldsize = size_t(v & kLargeBlockPagesMask) << kPageSizeBits;
   if (oldsize == newsize) {
     return ptr;
+  } else if ((v & kLargeBlockSampled) ||
+             (newsize >= kDirectMapThreshold) !=
+                 (oldsize >= kDirectMapThreshold)) {
+    // Keep it simple -- always move a sampled block.
+    // Also move between a dedicated mapping and the arena.  This copies at
+    // most kDirectMapThreshold bytes, or, when growing into a mapping, saves
+    // copying for all growth thereafter.
+    void* nptr = alloc_large(newsize, false);
+    if (true_no_fail(nptr)) {
+      nptr = memcpy(nptr, ptr, std::min(oldsize, newsize));
+      free_large(ptr);
+    }
+    return nptr;
+  } else if (v & kLargeBlockMapped) {
+    // Let the kernel move page tables instead of copying
+    void* nptr = fsys_mremap(ptr, oldsize, newsize, MREMAP_MAYMOVE);
+    if (false_no_fail(fsys_mmap_failed(nptr))) return nomem();
+    uint32_t* ndesc = lookup_large_block(static_cast<Page*>(nptr));
+    // The old range is gone, so there's no way to fail gracefully
+    if (false_no_fail(ndesc == nullptr))
+      cbu::fatal<"Out of memory for large block metadata">();
+    store_release(ndesc,
+                  uint32_t(newsize >> kPageSizeBits) | kLargeBlockMapped);
+    stat_add_shared(&direct_bytes, newsize - oldsize);
+    return nptr;
   } else if (oldsize > newsize) {
     // Shrink
     store_release(desc, newsize >> kPageSizeBits);
@@ -777,7 +1291,7 @@ void* realloc_large(void* ptr, size_t newsize) noexcept {
     return ptr;
   } else {
     // Extend
-    Arena* arena = &arena_mmap;
+    Arena* arena = owner_arena(page);
     if (arena->extend_nomove((Page*)ptr, oldsize, newsize - oldsize)) {
       store_release(desc, newsize >> kPageSizeBits);
       return ptr;
@@ -797,35 +1311,226 @@ size_t large_allocated_size(const void* ptr) noexcept {
   return lookup_large_block_size_fail_crash(static_cast<const Page*>(ptr));
 }
 
+namespace {
+
+constinit LowLevelMutex arena_handles_lock{};
+constinit ArenaHandle* arena_handles[kMaxArenaHandles] = {};
+constinit std::atomic<bool> arena_handles_created{false};
+
+constexpr size_t kArenaHandleBytes = pagesize_ceil(sizeof(ArenaHandle));
+
+}  // namespace
+
+ArenaHandle* create_arena_handle() noexcept {
+  Page* mem = allocate_page(kArenaHandleBytes);
+  if (false_no_fail(mem == nullptr)) return nullptr;
+  std::lock_guard locker(arena_handles_lock);
+  for (unsigned i = 0; i < kMaxArenaHandles; ++i) {
+    if (arena_handles[i] == nullptr) {
+      ArenaHandle* handle = new (mem) ArenaHandle(kArenaHandleOwnerBase + i);
+      store_release(&arena_handles[i], handle);
+      arena_handles_created.store(true, std::memory_order_relaxed);
+      return handle;
+    }
+  }
+  reclaim_page(mem, kArenaHandleBytes);
+  return nullptr;
+}
+
+void destroy_arena_handle(ArenaHandle* handle) noexcept {
+  if (handle == nullptr) return;
+  handle->arena.drop_all();
+  handle->raw_page_allocator.unmap_all();
+  // Entries in large_block_trie and arena_owner_trie are left as they are.
+  // They'll be overwritten if the addresses are reused.
+  {
+    std::lock_guard locker(arena_handles_lock);
+    store_release(
+        &arena_handles[handle->arena.shard() - kArenaHandleOwnerBase], nullptr);
+  }
+  reclaim_page(reinterpret_cast<Page*>(handle), kArenaHandleBytes);
+}
+
+bool arena_handles_used() noexcept {
+  return arena_handles_created.load(std::memory_order_relaxed);
+}
+
+ArenaHandle* arena_handle_of_page(const Page* page) noexcept {
+  unsigned owner =
+      *arena_owner_trie.lookup_fail_crash(uintptr_t(page) >> kPageSizeBits);
+  if (owner < kArenaHandleOwnerBase)
+    fatal<"Memory corrupt: page not in an arena handle">();
+  return load_acquire(&arena_handles[owner - kArenaHandleOwnerBase]);
+}
+
+void* alloc_large_in_handle(ArenaHandle* handle, size_t n, bool zero) noexcept {
+  n = pagesize_ceil(n);
+  if (n > size_t(kLargeBlockPagesMask) << kPageSizeBits) return nomem();
+  Page* page = handle->arena.allocate(n, zero);
+  if (false_no_fail(page == nullptr)) return nomem();
+  uint32_t* desc = lookup_large_block(page);
+  if (false_no_fail(desc == nullptr)) {
+    handle->arena.reclaim(page, n);
+    return nomem();
+  }
+  store_release(desc, uint32_t(n >> kPageSizeBits) | kLargeBlockInHandle);
+  return page;
+}
+
+// Blocks aligned beyond the page size are carved out of a larger run of pages
+// (or a larger mapping), and the excess at both ends is returned right away,
+// so no more than the block itself stays allocated, and nothing is copied.
+void* alloc_large_aligned(size_t n, size_t align, bool zero, bool populate,
+                          ArenaHandle* handle) noexcept {
+  n = pagesize_ceil(std::max<size_t>(n, 1));
+  if (n != uint32_t(n) || n > size_t(kLargeBlockPagesMask) << kPageSizeBits)
+    return nomem();
+  size_t total = n + align - kPageSize;
+  if (total < n) return nomem();
+
+  if (n >= kDirectMapThreshold && handle == nullptr) {
+    void* p = fsys_mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (false_no_fail(fsys_mmap_failed(p))) return nomem();
+    Page* page = static_cast<Page*>(cbu::pow2_ceil(p, align));
+    size_t lead = uintptr_t(page) - uintptr_t(p);
+    if (lead) fsys_munmap(p, lead);
+    if (size_t tail = total - lead - n)
+      fsys_munmap(byte_advance(page, n), tail);
+    uint32_t* desc = lookup_large_block(page);
+    if (false_no_fail(desc == nullptr)) {
+      fsys_munmap(page, n);
+      return nomem();
+    }
+    store_release(desc, uint32_t(n >> kPageSizeBits) | kLargeBlockMapped);
+    stat_add_shared(&direct_blocks, 1);
+    stat_add_shared(&direct_bytes, n);
+    if (populate) populate_pages(page, n);
+    return page;
+  }
+
+  Page* p = handle ? handle->arena.allocate(total, zero)
+                   : allocate_page(total, AllocateOptions().with_zero(zero));
+  if (false_no_fail(p == nullptr)) return nomem();
+  // Zeroed pages are zero throughout
+  uint32_t clean = zero ? RECLAIM_PAGE_CLEAN : 0;
+  auto give_back = [handle, clean](Page* page, size_t size, uint32_t flags) {
+    if (handle)
+      handle->arena.reclaim(page, size, clean | flags);
+    else
+      reclaim_page(page, size, clean | flags);
+  };
+  Page* page = static_cast<Page*>(cbu::pow2_ceil(static_cast<void*>(p), align));
+  size_t lead = byte_distance(p, page);
+  if (lead) give_back(p, lead, RECLAIM_PAGE_NOMERGE_RIGHT);
+  if (size_t tail = total - lead - n)
+    give_back(byte_advance(page, n), tail, RECLAIM_PAGE_NOMERGE_LEFT);
+
+  uint32_t* desc = lookup_large_block(page);
+  if (false_no_fail(desc == nullptr)) {
+    give_back(page, n, 0);
+    return nomem();
+  }
+  store_release(desc, uint32_t(n >> kPageSizeBits) |
+                          (handle ? kLargeBlockInHandle : 0));
+  if (populate) populate_pages(page, n);
+  return page;
+}
+
+ArenaHandle* large_arena_handle(const void* ptr) noexcept {
+  if (!arena_handles_used()) return nullptr;
+  const Page* page = static_cast<const Page*>(ptr);
+  if (load_acquire(lookup_large_block_fail_crash(page)) & kLargeBlockInHandle)
+    return arena_handle_of_page(page);
+  return nullptr;
+}
+
+bool prewarm(size_t bytes, AllocateOptions options) noexcept {
+  bytes = pagesize_ceil(bytes);
+  if (bytes == 0) return true;
+  // Zeroed, so that they can be returned as clean pages, which aren't purged
+  Page* page;
+  if (options.arena)
+    page = options.arena->arena.allocate(bytes, true);
+  else
+    page = allocate_page_uncached(bytes, options.with_zero(true));
+  if (false_no_fail(page == nullptr)) return false;
+  populate_pages(page, bytes);
+  if (options.arena)
+    options.arena->arena.reclaim(page, bytes, RECLAIM_PAGE_CLEAN);
+  else
+    reclaim_page(page, bytes,
+                 RECLAIM_PAGE_CLEAN |
+                     (options.force_mmap ? RECLAIM_PAGE_NO_THP : 0));
+  return true;
+}
+
 void large_trim(size_t pad) noexcept {
   ThreadCache* tc = get_thread_cache();
+  ThreadCacheUse use(tc);
 
-#ifndef CBU_NO_BRK
-  {
-    Arena* arena = &arena_brk;
-    if (tc) tc->page_category_cache_brk.clear(arena);
+  auto trim = [pad](Arena* arena) {
     Description* clean_list = arena->trim_and_extract(pad);
     arena->clear_description_list(clean_list);
-  }
+  };
+
+#ifndef CBU_NO_BRK
+  if (tc) tc->page_category_cache_brk.clear(arena_brk.data(), kArenaShards);
+  for (Arena& arena : arena_brk) trim(&arena);
 #endif
 
-  {
-    Arena* arena = &arena_mmap;
-    if (tc) tc->page_category_cache.clear(arena);
-    Description* clean_list = arena->trim_and_extract(pad);
-    arena->clear_description_list(clean_list);
-  }
+  if (tc) tc->page_category_cache.clear(arena_mmap.data(), kArenaShards);
+  for (Arena& arena : arena_mmap) trim(&arena);
 
   if constexpr (kTHPSize > 0) {
-    Arena* arena = &arena_mmap_no_thp;
-    if (tc) tc->page_category_cache_no_thp.clear(arena);
-    Description* clean_list = arena->trim_and_extract(pad);
-    arena->clear_description_list(clean_list);
+    if (tc) tc->page_category_cache_no_thp.clear(&arena_mmap_no_thp, 1);
+    trim(&arena_mmap_no_thp);
   }
 
   // Doesn't make much sense to free description_cache - that's allocated from
   // PermaAlloc and never returned to system
 }
 
+void large_decay(uint64_t now_ns) noexcept {
+  uint64_t decay_ns = g_purge_decay_ns.load(std::memory_order_relaxed);
+  if (decay_ns == 0) return;
+#ifndef CBU_NO_BRK
+  for (Arena& arena : arena_brk) arena.decay(now_ns, decay_ns);
+#endif
+  for (Arena& arena : arena_mmap) arena.decay(now_ns, decay_ns);
+  if constexpr (kTHPSize > 0) arena_mmap_no_thp.decay(now_ns, decay_ns);
+}
+
+void get_page_stats(Stats* stats) noexcept {
+  static_assert(Stats::kMaxArenas >= 3);
+  // Shards are summed up
+  auto add = [stats](Arena* arenas, unsigned shards, const char* name) {
+    ArenaStats* res = &stats->arenas[stats->arena_count++];
+    arenas[0].get_stats(res);
+    for (unsigned i = 1; i < shards; ++i) {
+      ArenaStats shard_stats;
+      arenas[i].get_stats(&shard_stats);
+      res->bytes_in_use += shard_stats.bytes_in_use;
+      res->bytes_clean += shard_stats.bytes_clean;
+      res->bytes_dirty += shard_stats.bytes_dirty;
+      res->bytes_lazy += shard_stats.bytes_lazy;
+      res->bytes_reclaimed += shard_stats.bytes_reclaimed;
+      res->madvise_calls += shard_stats.madvise_calls;
+      res->munmap_calls += shard_stats.munmap_calls;
+      // Shards share the same RawPageAllocator
+      res->bytes_mapped -= arenas[i].bytes_unmapped();
+    }
+    res->name = name;
+  };
+#ifndef CBU_NO_BRK
+  add(arena_brk.data(), kArenaShards, "brk");
+#endif
+  add(arena_mmap.data(), kArenaShards, "mmap");
+  if constexpr (kTHPSize > 0) add(&arena_mmap_no_thp, 1, "mmap_no_thp");
+
+  stats->direct_blocks = stat_load(&direct_blocks);
+  stats->direct_bytes = stat_load(&direct_bytes);
+}
+
 }  // namespace alloc
 }  // namespace cbu
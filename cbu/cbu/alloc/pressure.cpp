@@ -0,0 +1,222 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/private/common.h"
+#include "cbu/alloc/private/tc.h"
+#include "cbu/alloc/stats.h"
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu::alloc {
+
+#ifndef CBU_SINGLE_THREADED
+
+namespace {
+
+constexpr unsigned kMinPressureIntervalMs = 10;
+
+constinit std::atomic<bool> g_pressure_thread_started{false};
+constinit std::atomic<unsigned> g_usage_percent{0};
+constinit std::atomic<unsigned> g_stall_percent{0};
+constinit std::atomic<unsigned> g_interval_ms{0};
+// Opened once by the first start_pressure_monitor
+constinit int g_cgroup_fd = -1;
+constinit uint64_t g_pressure_trims = 0;
+
+// Reads a small file in the cgroup directory, returning false if it can't
+bool read_cgroup_file(const char* name, char* buf, size_t size) noexcept {
+  int fd = fsys_openat3(g_cgroup_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fsys_failure(fd)) return false;
+  ssize_t l = fsys_read(fd, buf, size - 1);
+  fsys_close(fd);
+  if (l <= 0) return false;
+  buf[l] = '\0';
+  return true;
+}
+
+// Reads memory.current, memory.high or memory.max.
+// Returns UINT64_MAX for "max", or if the file can't be read.
+uint64_t read_cgroup_bytes(const char* name) noexcept {
+  char buf[64];
+  if (!read_cgroup_file(name, buf, sizeof(buf))) return UINT64_MAX;
+  char* end;
+  unsigned long long v = strtoull(buf, &end, 10);
+  if (end == buf) return UINT64_MAX;
+  return v;
+}
+
+// Returns "some avg10" of memory.pressure, i.e., the percentage of time some
+// tasks of the cgroup stalled on memory in the last 10 seconds
+double read_stall_avg10() noexcept {
+  char buf[256];
+  if (!read_cgroup_file("memory.pressure", buf, sizeof(buf))) return 0;
+  if (strncmp(buf, "some ", 5) != 0) return 0;
+  const char* p = strstr(buf, "avg10=");
+  if (p == nullptr) return 0;
+  return strtod(p + 6, nullptr);
+}
+
+bool under_pressure() noexcept {
+  unsigned usage_percent = g_usage_percent.load(std::memory_order_relaxed);
+  if (usage_percent) {
+    uint64_t limit = read_cgroup_bytes("memory.high");
+    if (limit == UINT64_MAX) limit = read_cgroup_bytes("memory.max");
+    uint64_t current = read_cgroup_bytes("memory.current");
+    if (limit != UINT64_MAX && current != UINT64_MAX &&
+        current >= limit / 100 * usage_percent)
+      return true;
+  }
+  unsigned stall_percent = g_stall_percent.load(std::memory_order_relaxed);
+  return stall_percent && read_stall_avg10() >= stall_percent;
+}
+
+void* pressure_thread(void*) {
+  for (;;) {
+    unsigned interval = g_interval_ms.load(std::memory_order_relaxed);
+    struct timespec ts = {time_t(interval / 1000),
+                          long(interval % 1000 * 1'000'000)};
+    fsys_nanosleep(&ts, nullptr);
+    if (!under_pressure()) continue;
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+    // Blocks of idle threads go back to their runs and pages to our page
+    // cache, which trim then returns to the arenas before purging them
+    scavenge_idle_thread_caches();
+#endif
+    trim(0);
+    stat_add_shared(&g_pressure_trims, 1);
+  }
+  return nullptr;
+}
+
+// Finds the cgroup v2 directory of the process from the "0::/path" line of
+// /proc/self/cgroup
+int open_own_cgroup() noexcept {
+  int fd = fsys_open2("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+  if (fsys_failure(fd)) return -1;
+  char buf[4096];
+  ssize_t l = fsys_read(fd, buf, sizeof(buf) - 1);
+  fsys_close(fd);
+  if (l <= 0) return -1;
+  buf[l] = '\0';
+  const char* p = (strncmp(buf, "0::", 3) == 0) ? buf : strstr(buf, "\n0::");
+  if (p == nullptr) return -1;
+  p = strchr(p, '/');
+  if (p == nullptr) return -1;
+  char path[4096 + 16];
+  int n = snprintf(path, sizeof(path), "/sys/fs/cgroup%.*s",
+                   int(strcspn(p, "\n")), p);
+  if (n <= 0 || size_t(n) >= sizeof(path)) return -1;
+  return fsys_open2(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+void set_pressure_options(const PressureMonitorOptions& options) noexcept {
+  g_usage_percent.store(options.usage_percent, std::memory_order_relaxed);
+  g_stall_percent.store(options.stall_percent, std::memory_order_relaxed);
+  g_interval_ms.store(std::max(options.interval_ms, kMinPressureIntervalMs),
+                      std::memory_order_relaxed);
+}
+
+// The thread doesn't survive fork; the child may start another one
+void pressure_atfork_child() {
+  g_pressure_thread_started.store(false, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+bool start_pressure_monitor(
+    const PressureMonitorOptions& options) noexcept {
+  if (g_pressure_thread_started.exchange(true, std::memory_order_relaxed)) {
+    set_pressure_options(options);
+    return true;
+  }
+
+  if (g_cgroup_fd < 0) {
+    g_cgroup_fd = options.cgroup_dir
+                      ? fsys_open2(options.cgroup_dir,
+                                   O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                      : open_own_cgroup();
+    if (fsys_failure(g_cgroup_fd)) {
+      g_cgroup_fd = -1;
+      g_pressure_thread_started.store(false, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  set_pressure_options(options);
+
+  static constinit std::atomic<bool> atfork_registered{false};
+  if (!atfork_registered.exchange(true, std::memory_order_relaxed))
+    pthread_atfork(nullptr, nullptr, pressure_atfork_child);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+
+  // The thread shouldn't receive any signal meant for the process
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int err = pthread_create(&thread, &attr, pressure_thread, nullptr);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  pthread_attr_destroy(&attr);
+
+  if (err != 0) {
+    g_pressure_thread_started.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  pthread_setname_np(thread, "cbu_pressure");
+  return true;
+}
+
+void get_pressure_stats(Stats* stats) noexcept {
+  stats->pressure_trims = stat_load(&g_pressure_trims);
+}
+
+#else  // CBU_SINGLE_THREADED
+
+bool start_pressure_monitor(const PressureMonitorOptions&) noexcept {
+  return false;
+}
+
+void get_pressure_stats(Stats*) noexcept {}
+
+#endif
+
+}  // namespace cbu::alloc
@@ -32,13 +32,37 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <array>
 #include <atomic>
+#include <iterator>
 #include <type_traits>
 
 #include "cbu/alloc/pagesize.h"
+#include "cbu/alloc/private/conf.h"
 #include "cbu/common/bit.h"
 #include "cbu/sys/low_level_mutex.h"
 
+#if defined CBU_ALLOC_REMOTE_FREE && defined CBU_SINGLE_THREADED
+#  error "CBU_ALLOC_REMOTE_FREE and CBU_SINGLE_THREADED are incompatible"
+#endif
+
+#ifndef CBU_ALLOC_ARENAS
+#  ifdef CBU_ALLOC_NUMA
+#    define CBU_ALLOC_ARENAS 8
+#  else
+#    define CBU_ALLOC_ARENAS 1
+#  endif
+#endif
+
+#if CBU_ALLOC_ARENAS > 1 && defined CBU_SINGLE_THREADED
+#  error "CBU_ALLOC_ARENAS and CBU_SINGLE_THREADED are incompatible"
+#endif
+
+#if defined CBU_ALLOC_THREAD_CACHE_BUDGET && defined CBU_SINGLE_THREADED
+#  error \
+    "CBU_ALLOC_THREAD_CACHE_BUDGET and CBU_SINGLE_THREADED are incompatible"
+#endif
+
 namespace cbu {
 namespace alloc {
 
@@ -52,6 +76,9 @@ inline constexpr bool false_no_fail(bool r) { return r; }
 inline constexpr bool never_fails() { return false; }
 #endif
 
+#ifdef CBU_ALLOC_POW2_CATEGORIES
+
+// Legacy layout: power-of-2 categories, 16 to 1024 bytes
 constexpr unsigned kMaxCategory = 6;
 constexpr unsigned kNumCategories = kMaxCategory + 1;
 
@@ -69,6 +96,11 @@ constexpr unsigned size_to_category(size_t m) noexcept {
   return (cat - 3);
 }
 
+// Power-of-2 categories are always naturally aligned
+constexpr unsigned size_to_category_aligned(size_t m, size_t) noexcept {
+  return size_to_category(m);
+}
+
 constexpr size_t divide_by_category_size(size_t m, unsigned n) noexcept {
   return (m >> (4 + n));
 }
@@ -77,6 +109,99 @@ constexpr size_t multiply_by_category_size(size_t m, unsigned n) noexcept {
   return (m << (4 + n));
 }
 
+#else
+
+// Roughly 4 categories per power of 2, like tcmalloc's size classes.
+// Small blocks are allocated from single-page runs, whose first block is
+// occupied by the run header.  Each category is the largest multiple of 16
+// that fits the same number of blocks in a page, e.g. 816 instead of 768
+// (both give 4 blocks per run); 896 is omitted because it gives no more blocks
+// per run than 1024.
+inline constexpr uint16_t kCategorySizes[] = {
+    16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+    224, 256, 336, 400, 448, 512, 576, 672, 816, 1024,
+};
+
+constexpr unsigned kNumCategories = std::size(kCategorySizes);
+constexpr unsigned kMaxCategory = kNumCategories - 1;
+
+constexpr size_t category_to_size(unsigned n) noexcept {
+  return kCategorySizes[n];
+}
+
+static_assert(kPageSize == category_to_size(kMaxCategory) * 4,
+              "kPageSize/kMaxCategory");
+constexpr size_t kSmallAllocLimit = kPageSize / 4;
+
+inline constexpr auto kSizeToCategory = [] {
+  std::array<uint8_t, kSmallAllocLimit / 16 + 1> res{};
+  unsigned cat = 0;
+  for (size_t i = 1; i < res.size(); ++i) {
+    while (category_to_size(cat) < i * 16) ++cat;
+    res[i] = cat;
+  }
+  return res;
+}();
+
+constexpr unsigned size_to_category(size_t m) noexcept {
+  assert(m != 0);
+  assert(m <= kSmallAllocLimit);
+  return kSizeToCategory[(m + 15) / 16];
+}
+
+// Blocks are at multiples of the category size from the page boundary, so
+// they're aligned to the largest power of 2 dividing the category size.
+// For alignments larger than 16, we may have to pick a larger category.
+// m must be a multiple of align (0 means no alignment requirement).
+constexpr unsigned size_to_category_aligned(size_t m, size_t align) noexcept {
+  unsigned cat = size_to_category(m);
+  if (align > 16)
+    while (category_to_size(cat) & (align - 1)) ++cat;
+  return cat;
+}
+
+// ceil(2**32 / size), so that m / size == (m * reciprocal) >> 32 for all
+// m <= kPageSize
+inline constexpr auto kCategoryReciprocals = [] {
+  std::array<uint32_t, kNumCategories> res{};
+  for (unsigned i = 0; i < kNumCategories; ++i)
+    res[i] = ((uint64_t(1) << 32) + category_to_size(i) - 1) /
+             category_to_size(i);
+  return res;
+}();
+
+constexpr size_t divide_by_category_size(size_t m, unsigned n) noexcept {
+  assert(m <= kPageSize);
+  return (uint64_t(m) * kCategoryReciprocals[n]) >> 32;
+}
+
+constexpr size_t multiply_by_category_size(size_t m, unsigned n) noexcept {
+  return m * category_to_size(n);
+}
+
+static_assert([] {
+  for (unsigned n = 0; n < kNumCategories; ++n) {
+    if (category_to_size(n) % 16) return false;
+    if (n && category_to_size(n) <= category_to_size(n - 1)) return false;
+    for (size_t m = 0; m <= kPageSize; ++m)
+      if (divide_by_category_size(m, n) != m / category_to_size(n))
+        return false;
+  }
+  for (size_t m = 1; m <= kSmallAllocLimit; ++m) {
+    unsigned cat = size_to_category(m);
+    if (category_to_size(cat) < m) return false;
+    if (cat && category_to_size(cat - 1) >= m) return false;
+    for (size_t align = 16; align <= m; align *= 2) {
+      if (m % align) break;
+      if (category_to_size(size_to_category_aligned(m, align)) % align)
+        return false;
+    }
+  }
+  return true;
+}());
+
+#endif
+
 template <typename T>
 inline constexpr T pagesize_floor(T size) noexcept {
   return pow2_floor(size, kPageSize);
@@ -87,6 +212,9 @@ inline constexpr T pagesize_ceil(T size) noexcept {
   return pow2_ceil(size, kPageSize);
 }
 
+struct Stats;
+struct ArenaHandle;
+
 // Page allocators
 struct Page {
   union {
@@ -103,26 +231,60 @@ constexpr uint32_t RECLAIM_PAGE_NOMERGE_RIGHT = 2;
 constexpr uint32_t RECLAIM_PAGE_NO_THP = 4;
 // Use this if the caller knows the page is clean
 constexpr uint32_t RECLAIM_PAGE_CLEAN = 8;
+// Used by Arena internally for pages purged with MADV_FREE
+constexpr uint32_t RECLAIM_PAGE_LAZY = 16;
 
 void reclaim_page(Page*, size_t, uint32_t option_bitmask) noexcept;
 bool extend_page_nomove(Page*, size_t, size_t) noexcept;
+// Pre-faults pages for writing, without changing their contents
+void populate_pages(void*, size_t) noexcept;
 
 // Small allocator (with thread cache)
 void* alloc_small_category(unsigned) noexcept;
 void* alloc_small(size_t) noexcept;
 void free_small(void*) noexcept;
 void free_small(void*, size_t) noexcept;
+size_t alloc_small_batch(unsigned cat, size_t n, void** out) noexcept;
+// All pointers must be small blocks
+void free_small_batch(void** ptrs, size_t n) noexcept;
 unsigned small_allocated_category(void*) noexcept;
 size_t small_allocated_size(void*) noexcept;
 void small_trim(size_t) noexcept;
+void get_small_stats(Stats*) noexcept;
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+void get_thread_cache_stats(Stats*) noexcept;
+#endif
 
 // Large allocator
-void* alloc_large(size_t size, bool zero) noexcept;
+void* alloc_large(size_t size, bool zero, bool populate = false) noexcept;
 void free_large(void* ptr) noexcept;
 void free_large(void* ptr, size_t size) noexcept;
 void* realloc_large(void* ptr, size_t newsize) noexcept;
+// Allocates a large block aligned beyond kPageSize, in the handle if not null
+void* alloc_large_aligned(size_t size, size_t align, bool zero, bool populate,
+                          ArenaHandle* handle) noexcept;
+#ifdef CBU_ALLOC_HEAP_PROFILER
+void mark_large_block_sampled(void* ptr) noexcept;
+#endif
 size_t large_allocated_size(const void*) noexcept;
 void large_trim(size_t) noexcept;
+void large_decay(uint64_t now_ns) noexcept;
+void get_page_stats(Stats*) noexcept;
+void get_pressure_stats(Stats*) noexcept;
+void get_config_stats(Stats*) noexcept;
+
+// Arena handles (see create_arena_handle)
+// Set in Run::cat of runs belonging to handles
+inline constexpr unsigned kRunInArenaHandle = 0x100;
+// Whether any handle has ever been created, so that programs not using them
+// don't pay for the checks
+bool arena_handles_used() noexcept;
+ArenaHandle* arena_handle_of_page(const Page*) noexcept;
+void* alloc_small_in_handle(ArenaHandle*, unsigned cat) noexcept;
+void* alloc_large_in_handle(ArenaHandle*, size_t size, bool zero) noexcept;
+// Returns the handle owning a block, or nullptr if it's not in a handle
+ArenaHandle* small_arena_handle(void* ptr) noexcept;
+ArenaHandle* large_arena_handle(const void* ptr) noexcept;
 
 // Raw page allocation
 // No corresponding deallocation is provided.  Caller should either keep
@@ -132,15 +294,32 @@ void large_trim(size_t) noexcept;
 // This allocator guarantees returned pages are zero initialized
 class RawPageAllocator {
  public:
-  constexpr RawPageAllocator(bool use_brk, bool allow_thp) noexcept
-      : use_brk_(use_brk), allow_thp_(use_brk || allow_thp) {}
+  constexpr RawPageAllocator(bool use_brk, bool allow_thp,
+                             bool track_mappings = false) noexcept
+      : use_brk_(use_brk),
+        allow_thp_(use_brk || allow_thp),
+        track_mappings_(track_mappings) {}
 
   Page* allocate(size_t size) noexcept;
 
+  // With track_mappings (for arena handles), all mappings are remembered so
+  // that they can be unmapped at once.  Users must then never munmap part of
+  // a mapping, lest the hole be reused by someone else.
+  void unmap_all() noexcept;
+  constexpr bool can_unmap() const noexcept {
+    return !use_brk_ && !track_mappings_;
+  }
+
   static bool is_from_brk(void* ptr) noexcept;
 
+  // For statistics
+  size_t mapped_bytes() noexcept;
+  size_t cached_bytes() noexcept;
+
   constexpr bool use_brk() const noexcept { return use_brk_; }
   constexpr bool allow_thp() const noexcept { return allow_thp_; }
+  // Whether free pages should be trimmed on huge page boundaries
+  bool thp_aware() const noexcept { return allow_thp_ && !thp_disabled(); }
 
   static RawPageAllocator instance_brk;
   static RawPageAllocator instance_mmap;
@@ -148,11 +327,15 @@ class RawPageAllocator {
 
  private:
   struct CachedPage;
+  struct Mapping;
 
   CachedPage* cached_page_ = nullptr;
+  Mapping* mappings_ = nullptr;
+  size_t mapped_bytes_ = 0;
   [[no_unique_address]] LowLevelMutex lock_;
   bool use_brk_;
   bool allow_thp_;
+  bool track_mappings_;
 };
 
 inline constinit RawPageAllocator RawPageAllocator::instance_brk{true, true};
@@ -178,5 +361,48 @@ void store_release(T* ptr, std::type_identity_t<T> value) noexcept {
 #endif
 }
 
+// Statistics counters may be read by any thread at any time.
+// stat_add is for counters written by only one thread at a time (e.g. those
+// in thread caches), and is as cheap as a regular increment.
+// stat_add_shared is for counters written concurrently, and should only be
+// used on slow paths.
+template <typename T>
+void stat_add(T* ptr, std::type_identity_t<T> n) noexcept {
+#ifdef CBU_SINGLE_THREADED
+  *ptr += n;
+#else
+  std::atomic_ref ref(*ptr);
+  ref.store(ref.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+#endif
+}
+
+template <typename T>
+void stat_add_shared(T* ptr, std::type_identity_t<T> n) noexcept {
+#ifdef CBU_SINGLE_THREADED
+  *ptr += n;
+#else
+  std::atomic_ref(*ptr).fetch_add(n, std::memory_order_relaxed);
+#endif
+}
+
+template <typename T>
+void stat_store(T* ptr, std::type_identity_t<T> value) noexcept {
+#ifdef CBU_SINGLE_THREADED
+  *ptr = value;
+#else
+  std::atomic_ref(*ptr).store(value, std::memory_order_relaxed);
+#endif
+}
+
+template <typename T>
+T stat_load(T* ptr) noexcept {
+#ifdef CBU_SINGLE_THREADED
+  return *ptr;
+#else
+  return std::atomic_ref(*ptr).load(std::memory_order_relaxed);
+#endif
+}
+
 }  // namespace alloc
 }  // namespace cbu
@@ -0,0 +1,84 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "cbu/alloc/pagesize.h"
+
+namespace cbu::alloc {
+
+enum class ThpPolicy : uint8_t {
+  kDefault,  // Align to huge pages, and leave the rest to the system setting
+  kAlways,   // Also MADV_HUGEPAGE (for systems with THP in "madvise" mode)
+  kNever,    // MADV_NOHUGEPAGE everything
+};
+
+// Run time tunables, parsed once from the string in the weak symbol
+// cbu_malloc_conf, then environment variable CBU_MALLOC_CONF, e.g.
+//   CBU_MALLOC_CONF=small_cache_flush=128,max_trim_threshold=32M,thp=never
+// The defaults are the compile time choices.
+struct Config {
+  // A thread cache holding this many free blocks of a category flushes them
+  unsigned small_cache_flush = 256;
+  // Free pages of an arena are returned to the system when they exceed the
+  // bytes allocated by it, clamped to [min_trim_threshold, max_trim_threshold]
+  size_t min_trim_threshold = kTHPSize ? 3 * kTHPSize : kPageSize * 1536;
+  size_t max_trim_threshold = 128 * 1024 * 1024;
+  // Arenas take memory from the system at least this much (a power of 2)
+  // at a time
+  size_t initial_alloc_size = kTHPSize ? kTHPSize : kPageSize * 512;
+#ifndef CBU_NO_BRK
+  bool use_brk = true;
+#else
+  static constexpr bool use_brk = false;
+#endif
+  ThpPolicy thp = ThpPolicy::kDefault;
+};
+
+extern constinit Config g_conf;
+extern std::atomic<bool> g_conf_ready;
+
+void load_config_slow() noexcept;
+
+// Called before memory is first obtained from the system, so that the
+// configuration is in effect before anything depends on it
+inline void load_config() noexcept {
+  if (!g_conf_ready.load(std::memory_order_acquire)) [[unlikely]]
+    load_config_slow();
+}
+
+inline bool thp_disabled() noexcept {
+  return kTHPSize == 0 || g_conf.thp == ThpPolicy::kNever;
+}
+
+}  // namespace cbu::alloc
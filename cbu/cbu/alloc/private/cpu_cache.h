@@ -0,0 +1,67 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "cbu/alloc/pagesize.h"
+#include "cbu/alloc/private/small.h"
+#include "cbu/sys/low_level_mutex.h"
+
+namespace cbu::alloc {
+
+#if defined CBU_ALLOC_PER_CPU_CACHE && !defined CBU_SINGLE_THREADED
+
+// Per-CPU small object cache.
+// With many mostly idle threads, per-thread caches waste lots of memory:
+// every thread keeps its own free blocks of every category, and blocks cached
+// by a sleeping thread are stranded until it wakes up or exits.  Per-CPU caches
+// scale with the number of cores instead.
+// The current CPU is only a hint (see current_cpu), so each cache has a lock.
+// The lock is almost never contended.
+struct alignas(kCacheLineSize) CpuCache {
+  [[no_unique_address]] LowLevelMutex lock;
+  SmallCache small_cache;
+};
+
+// CPU numbers beyond this fall back to thread caches
+constexpr unsigned kMaxCpus = 4096;
+
+// Created on demand
+extern CpuCache* g_cpu_caches[kMaxCpus];
+
+// Returns the cache of the current CPU, or nullptr if the current CPU cannot
+// be determined, in which case the caller should fall back to the thread
+// cache.
+CpuCache* get_cpu_cache() noexcept;
+
+// Release everything in all CPU caches
+void clear_cpu_caches() noexcept;
+
+#endif
+
+}  // namespace cbu::alloc
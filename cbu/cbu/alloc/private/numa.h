@@ -0,0 +1,62 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "cbu/alloc/private/common.h"
+
+namespace cbu::alloc {
+
+#ifdef CBU_ALLOC_NUMA
+
+// Nodes and CPUs beyond these are treated as node 0
+inline constexpr unsigned kMaxNumaNodes = 64;
+inline constexpr unsigned kMaxNumaCpus = 4096;
+
+// The topology is read from /sys/devices/system/node on first use.
+// For testing, it can be overridden with environment variable
+// CBU_ALLOC_NUMA_TOPOLOGY, which lists CPUs of each node, separated by
+// semicolons, e.g. "0-3,8-11;4-7,12-15".  Pages are never bound to nodes
+// of an overridden topology.
+
+// Returns the node of the CPU the calling thread is running on.
+// Of course the thread may be migrated at any time, so this is only a hint.
+unsigned current_numa_node() noexcept;
+
+// Returns the number of nodes (at least 1)
+unsigned numa_node_count() noexcept;
+
+// Asks the kernel to preferably place pages in the range on the node.
+// Only effective for pages not yet faulted in.
+void numa_bind_preferred(void* ptr, size_t size, unsigned node) noexcept;
+
+#endif  // CBU_ALLOC_NUMA
+
+}  // namespace cbu::alloc
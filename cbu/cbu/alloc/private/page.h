@@ -28,10 +28,14 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <optional>
 
 #include "cbu/alloc/private/common.h"
 #include "cbu/alloc/private/rb.h"
+#include "cbu/alloc/private/small.h"
+#include "cbu/alloc/stats.h"
 
 namespace cbu::alloc {
 
@@ -84,6 +88,9 @@ class PageTreeAllocator {
 
   Page* allocate(size_t size) noexcept;
   bool reclaim(Page* page, size_t size, uint32_t option_bitmask) noexcept;
+  // Frees all descriptions without touching the pages.  The allocator can't
+  // be used afterwards.
+  void drop_all() noexcept;
   bool reclaim_nomerge(Page* page, size_t size) noexcept;
   bool extend_nomove(Page* ptr, size_t old, size_t grow) noexcept;
 
@@ -91,6 +98,8 @@ class PageTreeAllocator {
   // so that the caller may decide to free it.
   Description* get_deallocate_candidates(size_t threshold,
                                          bool thp_aware) noexcept;
+  // Likewise, but takes about the given number of bytes, largest runs first
+  Description* get_purge_candidates(size_t bytes, bool thp_aware) noexcept;
 
   // Just remove the page from the tree
   void remove_by_range(Page* page, size_t size) noexcept;
@@ -101,9 +110,13 @@ class PageTreeAllocator {
   // The list itself is not removed.
   void remove_by_list(const Description* list) noexcept;
 
+  size_t total_bytes() const noexcept { return total_bytes_; }
+
  private:
   Description* remove_from_szad(Description* desc) noexcept;
   Description* insert_to_szad(Description* desc) noexcept;
+  // Returns partial huge pages at both ends of p to the tree
+  void trim_to_thp(Description* p) noexcept;
 
   static constexpr unsigned small_size_to_idx(size_t size) noexcept {
     return (size >> kPageSizeBits) - 1;
@@ -119,12 +132,41 @@ class PageTreeAllocator {
   static constexpr size_t kSmallMaxSize = kSmallCount * kPageSize;
   Rb<DescriptionAdRbAccessor<&Description::rblink_2>> szad_small_[kSmallCount];
   Rb<DescriptionSzAdRbAccessor> szad_large_;
+
+  size_t total_bytes_ = 0;
 };
 
+// Time-based decay of free pages, modeled after jemalloc.
+// We don't remember when each run was freed.  Instead, we remember how many
+// bytes entered a state (dirty or lazy) in each of the last kEpochs epochs.
+// Bytes from recent epochs are allowed to remain in the state, with older
+// epochs getting smaller shares (smootherstep curve), and nothing older than
+// the decay time.
+class DecayState {
+ public:
+  static constexpr unsigned kEpochs = 200;
+
+  constexpr DecayState() noexcept = default;
+
+  // Returns the number of bytes allowed to remain in the state, given the
+  // number of bytes currently in it.  The caller should purge the excess.
+  size_t advance(uint64_t now_ns, uint64_t decay_ns, size_t current) noexcept;
+
+ private:
+  uint64_t epoch_start_ = 0;
+  size_t last_ = 0;    // Bytes in the state after the last call
+  unsigned head_ = 0;  // history_[head_] is the latest complete epoch
+  size_t history_[kEpochs] = {};
+};
+
+// Decay time in nanoseconds if the background purge thread is running;
+// otherwise 0.
+extern std::atomic<uint64_t> g_purge_decay_ns;
+
 class alignas(kCacheLineSize) Arena {
  public:
-  constexpr Arena(RawPageAllocator* allocator) noexcept
-      : raw_page_allocator_(allocator) {}
+  constexpr Arena(RawPageAllocator* allocator, unsigned shard = 0) noexcept
+      : raw_page_allocator_(allocator), shard_(shard) {}
 
   // Set option_bitmask with NOMERGE_LEFT/NOMERGE_RIGHT if we're sure it's not
   // mergeable.
@@ -150,39 +192,100 @@ class alignas(kCacheLineSize) Arena {
 
   void clear_description_list(Description*) noexcept;
 
+  // Purges pages according to decay time.  Called by the background thread
+  void decay(uint64_t now_ns, uint64_t decay_ns) noexcept;
+
+  void get_stats(ArenaStats* stats) noexcept;
+  uint64_t bytes_unmapped() noexcept { return stat_load(&bytes_unmapped_); }
+  unsigned shard() const noexcept { return shard_; }
+
+  // Frees all descriptions.  For arena handles only, whose pages are
+  // unmapped all at once.
+  void drop_all() noexcept;
+
   friend struct PageCategoryCache;
 
  private:
   RawPageAllocator* const raw_page_allocator_;
+  // Index in arena_brk or arena_mmap, or the owner ID of an arena handle
+  const unsigned shard_;
   [[no_unique_address]] LowLevelMutex lock_{};
 
   // Count it so that we can determine when to try to do munmap
   size_t reclaim_count_ = 0;
   size_t total_bytes_allocated_ = 0;
 
+  // Statistics.  bytes_reclaimed_ is protected by lock_; others are updated
+  // with stat_add_shared, possibly without holding lock_.
+  uint64_t bytes_reclaimed_ = 0;
+  uint64_t bytes_unmapped_ = 0;
+  uint64_t madvise_calls_ = 0;
+  uint64_t munmap_calls_ = 0;
+
   // tree_clean holds pages that we know are zero initialized
   PageTreeAllocator tree_clean_{};
   PageTreeAllocator tree_dirty_{};
+  // tree_lazy holds pages purged with MADV_FREE, which may or may not be zero
+  PageTreeAllocator tree_lazy_{};
   PageTreeAllocator tree_all_{};
 
-  static constexpr size_t kInitialAllocSize =
-      kTHPSize ? kTHPSize : kPageSize * 512;
+  // Only used in decay mode
+  DecayState dirty_decay_{};
+  DecayState lazy_decay_{};
+
+  // Memory is taken from the system g_conf.initial_alloc_size at a time at
+  // first, growing with the bytes allocated up to this
   static constexpr size_t kMaxAllocSize = 128 * 1024 * 1024;
 
-  // Make sure kMinTrimThreshold is > 2 * kTHPSize so that we always do
-  // trimming on THP boundary
-  static constexpr size_t kMinTrimThreshold =
-      kTHPSize ? 3 * kTHPSize : kPageSize * 1536;
-  static constexpr size_t kMaxTrimThreshold = 128 * 1024 * 1024;
-  static_assert(kMinTrimThreshold < kMaxTrimThreshold);
+  // Trimming is done on THP boundaries if g_conf.min_trim_threshold is
+  // > 2 * kTHPSize (the default)
+  static_assert(Config().min_trim_threshold > 2 * kTHPSize);
+
+  // In decay mode, freeing threads purge pages only if dirty pages exceed
+  // both this and the bytes in use
+  static size_t emergency_dirty_bytes() noexcept {
+    return 4 * g_conf.max_trim_threshold;
+  }
+
+  // Removes bytes exceeding limit from tree (and tree_all_)
+  Description* extract_over_limit_unlocked(PageTreeAllocator* tree,
+                                           size_t limit) noexcept;
+  // Purges pages with MADV_FREE and moves them to tree_lazy_.
+  // Returns the part of the list not purged, e.g. if MADV_FREE is unsupported.
+  Description* lazy_free_description_list(Description*) noexcept;
 };
 
+// arena_brk and arena_mmap are sharded, so that threads don't all contend for
+// the same lock.  Threads are assigned to shards round robin, and the owner
+// of each page is recorded in a trie.
+inline constexpr unsigned kArenaShards = CBU_ALLOC_ARENAS;
+static_assert(kArenaShards >= 1 && kArenaShards <= 64);
+
 #ifndef CBU_NO_BRK
-extern Arena arena_brk;
+extern std::array<Arena, kArenaShards> arena_brk;
 #endif
-extern Arena arena_mmap;
+extern std::array<Arena, kArenaShards> arena_mmap;
 extern Arena arena_mmap_no_thp;
 
+// Owner IDs of arena handles in the page owner trie (one byte per page)
+inline constexpr unsigned kArenaHandleOwnerBase = 128;
+inline constexpr unsigned kMaxArenaHandles = 128;
+static_assert(kArenaShards <= kArenaHandleOwnerBase);
+
+// The public ArenaHandle (see alloc.h).
+// Memory of the arena comes from its own RawPageAllocator, which remembers
+// all mappings, so that destroying the arena is just unmapping them.
+struct ArenaHandle {
+  explicit constexpr ArenaHandle(unsigned owner) noexcept
+      : arena(&raw_page_allocator, owner) {}
+
+  RawPageAllocator raw_page_allocator{false, true, true};
+  Arena arena;
+  // Free small blocks.  Runs are not returned to the arena.
+  [[no_unique_address]] LowLevelMutex lock{};
+  Block* small_free[kNumCategories] = {};
+};
+
 struct DescriptionCache {
   // Description cache
   Description* desc_list = nullptr;
@@ -198,6 +301,8 @@ struct PageCategoryCache {
   static constexpr unsigned kPageCategories = kPageMaxCategory + 1;
   static constexpr unsigned kPagePreferredCount = 4;
   Page* page_list[kPageCategories] = {};
+  // Also read by other threads looking for caches to scavenge, so always
+  // written with stat_store
   unsigned char page_count[kPageCategories] = {};
 
   static constexpr unsigned size_to_page_category(size_t size) {
@@ -207,7 +312,9 @@ struct PageCategoryCache {
     return (unsigned(kPageSize) * (cat + 1));
   }
 
-  void clear(Arena* arena) noexcept;
+  // arenas is either arena_brk, arena_mmap or &arena_mmap_no_thp,
+  // and shards is the number of arenas
+  void clear(Arena* arenas, unsigned shards) noexcept;
 };
 
 }//
@@ -61,11 +61,9 @@ class PermaAlloc {
   T* list_ = nullptr;
 
   static RawPageAllocator* raw_page_allocator() noexcept {
-#ifndef CBU_NO_BRK
-    return &RawPageAllocator::instance_brk;
-#else
-    return &RawPageAllocator::instance_mmap;
-#endif
+    load_config();
+    return g_conf.use_brk ? &RawPageAllocator::instance_brk
+                          : &RawPageAllocator::instance_mmap;
   }
 };
 
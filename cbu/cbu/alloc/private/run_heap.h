@@ -0,0 +1,55 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "cbu/alloc/private/common.h"
+
+namespace cbu::alloc {
+
+#ifdef CBU_ALLOC_HUGEPAGE_RUNS
+
+// Hugepage-aware heap of small-object runs.
+//
+// Runs (single pages) are packed into superblocks, each an aligned huge page.
+// A new run is always carved out of the fullest superblock that still has a
+// free page, so that sparsely used superblocks tend to drain completely.
+// Memory is only returned to the system a whole superblock at a time, so the
+// kernel never has to split the huge pages backing in-use runs.
+//
+// The first page of each superblock holds its header.
+
+Page* allocate_run_page() noexcept;
+void reclaim_run_page(Page*) noexcept;
+// Returns empty superblocks kept for reuse to the system
+void run_heap_trim() noexcept;
+void get_run_heap_stats(Stats*) noexcept;
+
+#endif  // CBU_ALLOC_HUGEPAGE_RUNS
+
+}  // namespace cbu::alloc
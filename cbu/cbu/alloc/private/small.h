@@ -39,13 +39,58 @@ struct Block {
 
 struct ThreadCategory {
   Block* free;
+  // Also read by get_small_stats, so always written with stat_store
   unsigned count_free;
+  // Statistics
+  uint64_t allocations;
+  uint64_t frees;
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+  // The cache is flushed when it holds small_cache_flush - flush_cut blocks.
+  // Always zero in CPU caches; thread caches start with a small limit, and
+  // raise it as the thread budget permits.
+  unsigned flush_cut;
+#endif
 };
 
+#ifdef CBU_ALLOC_REMOTE_FREE
+// Blocks freed by other threads to runs owned by a SmallCache.
+// Allocated permanently and recycled when the owning thread exits, so that
+// other threads can always safely push to it.
+struct alignas(kCacheLineSize) RemoteFreeList {
+  Block* head[kNumCategories];
+  RemoteFreeList* next_retired;
+};
+#endif
+
 struct SmallCache {
   ThreadCategory category[kNumCategories] = {};
+#ifdef CBU_ALLOC_REMOTE_FREE
+  // Recorded as the owner of runs allocated by this cache
+  RemoteFreeList* remote = nullptr;
+#endif
+
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+  // Bytes taken from the thread cache budget by raising flush limits
+  size_t budget_bytes = 0;
+#endif
 
   void clear() noexcept;
+
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+  // Lowers flush limits of a thread cache to the initial value, and returns
+  // the budget taken.  Blocks must have been cleared.
+  void reset_flush_limits() noexcept;
+#endif
+
+  // Called when the owning thread exits, so that get_small_stats still counts
+  // our allocations and frees.
+  void retire_stats() noexcept;
+
+#ifdef CBU_ALLOC_REMOTE_FREE
+  // Called when the owning thread exits.  Blocks freed to our runs afterwards
+  // are adopted by the next SmallCache reusing the RemoteFreeList.
+  void retire() noexcept;
+#endif
 };
 
 }  // namespace cbu::alloc
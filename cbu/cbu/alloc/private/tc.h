@@ -31,6 +31,8 @@
 #include <pthread.h>
 #include <sched.h>
 
+#include <atomic>
+#include <mutex>
 #include <type_traits>
 
 #include "cbu/alloc/pagesize.h"
@@ -61,7 +63,24 @@ struct ThreadCache {
 
   SmallCache small_cache;
 
+  // Index in arena_brk and arena_mmap
+  unsigned arena_shard = 0;
+
   TcStatus status = TcStatus::kInitial;
+
+  // Registry of live thread caches, for statistics
+  ThreadCache* registry_prev = nullptr;
+  ThreadCache* registry_next = nullptr;
+
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+  // Nesting depth of ThreadCacheUse.  Written only by the owning thread.
+  unsigned in_use = 0;
+  // Set by another thread deciding whether to scavenge this cache
+  bool scavenging = false;
+  // Allocations and frees counted by the last scavenging pass, to tell
+  // whether the thread has been idle since.  Protected by g_tc_registry_lock.
+  uint64_t activity_seen = 0;
+#endif
 };
 
 #ifdef CBU_SINGLE_THREADED
@@ -74,6 +93,68 @@ constexpr ThreadCache* get_thread_cache() noexcept { return nullptr; }
 ThreadCache* get_or_create_thread_cache() noexcept;
 ThreadCache* get_thread_cache() noexcept;
 
+extern LowLevelMutex g_tc_registry_lock;
+extern ThreadCache* g_tc_registry;
+
+// Calls fn for each live thread cache, with the registry locked.
+// Other threads may be using their caches, so fn may only read statistics.
+template <typename Fn>
+void for_each_thread_cache(Fn fn) noexcept {
+  std::lock_guard locker(g_tc_registry_lock);
+  for (ThreadCache* tc = g_tc_registry; tc; tc = tc->registry_next) fn(tc);
+}
+
+#endif
+
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+
+// Takes bytes from the process-wide thread cache budget.  If it's exhausted,
+// scavenges caches of idle threads (at most once in a while) and fails.
+bool charge_thread_cache_budget(size_t bytes) noexcept;
+void refund_thread_cache_budget(size_t bytes) noexcept;
+
+// Clears caches of threads that haven't allocated or freed small blocks since
+// the last pass.  Does nothing if the last pass was too recent.
+void scavenge_idle_thread_caches() noexcept;
+
+void wait_for_scavenger(ThreadCache* tc) noexcept;
+
+// Marks small and page caches of the current thread in use, so that other
+// threads don't scavenge them meanwhile.  May be nested.
+// This is the cheap side of an asymmetric Dekker handshake: the scavenger
+// sets tc->scavenging and issues membarrier(2) before checking tc->in_use,
+// so a compiler barrier suffices here.
+class ThreadCacheUse {
+ public:
+  [[gnu::always_inline]] explicit ThreadCacheUse(ThreadCache* tc) noexcept
+      : tc_(tc) {
+    if (tc == nullptr) return;
+    unsigned depth = tc->in_use;
+    std::atomic_ref(tc->in_use).store(depth + 1, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    if (depth == 0 && load_acquire(&tc->scavenging)) [[unlikely]]
+      wait_for_scavenger(tc);
+  }
+  [[gnu::always_inline]] ~ThreadCacheUse() {
+    if (tc_) store_release(&tc_->in_use, tc_->in_use - 1);
+  }
+
+  ThreadCacheUse(const ThreadCacheUse&) = delete;
+  ThreadCacheUse& operator=(const ThreadCacheUse&) = delete;
+
+ private:
+  ThreadCache* tc_;
+};
+
+#else
+
+class ThreadCacheUse {
+ public:
+  constexpr explicit ThreadCacheUse(ThreadCache*) noexcept {}
+  ThreadCacheUse(const ThreadCacheUse&) = delete;
+  ThreadCacheUse& operator=(const ThreadCacheUse&) = delete;
+};
+
 #endif
 
 }  // namespace alloc
@@ -0,0 +1,118 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/private/common.h"
+#include "cbu/alloc/private/page.h"
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu::alloc {
+
+#ifndef CBU_SINGLE_THREADED
+
+namespace {
+
+constexpr uint64_t kMinPurgeIntervalNs = 10'000'000;
+
+constinit std::atomic<bool> g_purge_thread_started{false};
+
+uint64_t now_ns() noexcept {
+  struct timespec ts;
+  fsys_clock_gettime_auto(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+void* purge_thread(void*) {
+  for (;;) {
+    uint64_t decay_ns = g_purge_decay_ns.load(std::memory_order_relaxed);
+    uint64_t interval =
+        std::max(decay_ns / DecayState::kEpochs, kMinPurgeIntervalNs);
+    struct timespec ts = {time_t(interval / 1'000'000'000),
+                          long(interval % 1'000'000'000)};
+    fsys_nanosleep(&ts, nullptr);
+    large_decay(now_ns());
+  }
+  return nullptr;
+}
+
+// The thread doesn't survive fork; the child falls back to inline purging
+void purge_atfork_child() {
+  g_purge_decay_ns.store(0, std::memory_order_relaxed);
+  g_purge_thread_started.store(false, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+bool start_background_purge(unsigned decay_ms) noexcept {
+  uint64_t decay_ns = std::max(decay_ms, 1u) * uint64_t(1'000'000);
+  if (g_purge_thread_started.exchange(true, std::memory_order_relaxed)) {
+    g_purge_decay_ns.store(decay_ns, std::memory_order_relaxed);
+    return true;
+  }
+
+  static constinit std::atomic<bool> atfork_registered{false};
+  if (!atfork_registered.exchange(true, std::memory_order_relaxed))
+    pthread_atfork(nullptr, nullptr, purge_atfork_child);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+
+  // The thread shouldn't receive any signal meant for the process
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int err = pthread_create(&thread, &attr, purge_thread, nullptr);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  pthread_attr_destroy(&attr);
+
+  if (err != 0) {
+    g_purge_thread_started.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  pthread_setname_np(thread, "cbu_purge");
+  g_purge_decay_ns.store(decay_ns, std::memory_order_relaxed);
+  return true;
+}
+
+#else  // CBU_SINGLE_THREADED
+
+bool start_background_purge(unsigned) noexcept { return false; }
+
+#endif
+
+}  // namespace cbu::alloc
@@ -58,7 +58,21 @@ inline void* linux_brk(void* ptr) {
 }
 #endif
 
+// Applies the THP policy to new memory
+void advise_thp(void* p, size_t size, bool allow_thp) noexcept {
+#if defined MADV_HUGEPAGE && defined MADV_NOHUGEPAGE
+  if constexpr (kTHPSize > 0) {
+    if (!allow_thp || g_conf.thp == ThpPolicy::kNever)
+      fsys_madvise(p, size, MADV_NOHUGEPAGE);
+    else if (g_conf.thp == ThpPolicy::kAlways)
+      fsys_madvise(p, size, MADV_HUGEPAGE);
+  }
+#endif
+}
+
 void* raw_brk_pages(size_t size, size_t* alloc_size) noexcept {
+  // Disabled by CBU_MALLOC_CONF; arena_brk falls back to mmap
+  if (!g_conf.use_brk) return nullptr;
   std::lock_guard locker(brk_mutex);
   if (brk_cur == nullptr)
     brk_initial = brk_cur = cbu::pow2_ceil(linux_brk(nullptr), kPageSize);
@@ -69,6 +83,7 @@ void* raw_brk_pages(size_t size, size_t* alloc_size) noexcept {
   *alloc_size = byte_distance(brk_cur, brk_target);
   void* brk_new = linux_brk(brk_target);
   if (brk_new != brk_target) return nullptr;
+  advise_thp(brk_cur, *alloc_size, true);
   return CBU_HINT_NONNULL(std::exchange(brk_cur, brk_new));
 }
 
@@ -78,9 +93,7 @@ void* raw_mmap_pages(size_t size, bool allow_thp) noexcept {
   if (false_no_fail(fsys_mmap_failed(p))) {
     p = nullptr;
   } else {
-#ifdef MADV_NOHUGEPAGE
-    if (kTHPSize && !allow_thp) fsys_madvise(p, size, MADV_NOHUGEPAGE);
-#endif
+    advise_thp(p, size, allow_thp);
   }
   return p;
 }
@@ -92,11 +105,18 @@ struct RawPageAllocator::CachedPage {
   unsigned size;
 };
 
+// Kept in an extra page at the end of each mapping if track_mappings_
+struct RawPageAllocator::Mapping {
+  Mapping* next;
+  size_t size;  // Including this page
+};
+
 Page* RawPageAllocator::allocate(size_t size) noexcept {
   // Let's just run the whole function while holding the lock, even when
   // we're calling mmap.
   // Memmory mapping is inherently not parallelizable, so this really is no
   // penalty.  It also significantly simplifies our handling of brk.
+  load_config();
   std::lock_guard locker(lock_);
 
   if (cached_page_) {
@@ -133,10 +153,21 @@ Page* RawPageAllocator::allocate(size_t size) noexcept {
     bool use_thp = kTHPSize && allow_thp_;
     alloc_size = cbu::pow2_ceil(size, kTHPSize ? kTHPSize : 32 * kPageSize);
 
-    np = raw_mmap_pages(alloc_size, use_thp);
-    if (false_no_fail(np == nullptr)) return nullptr;
+    if (track_mappings_) {
+      np = raw_mmap_pages(alloc_size + kPageSize, use_thp);
+      if (false_no_fail(np == nullptr)) return nullptr;
+      Mapping* mapping = static_cast<Mapping*>(byte_advance(np, alloc_size));
+      mapping->next = mappings_;
+      mapping->size = alloc_size + kPageSize;
+      mappings_ = mapping;
+    } else {
+      np = raw_mmap_pages(alloc_size, use_thp);
+      if (false_no_fail(np == nullptr)) return nullptr;
+    }
   }
 
+  mapped_bytes_ += alloc_size;
+
   if (alloc_size > size) {
     CachedPage* remaining = static_cast<CachedPage*>(byte_advance(np, size));
     remaining->next = cached_page_;
@@ -147,6 +178,35 @@ Page* RawPageAllocator::allocate(size_t size) noexcept {
   return static_cast<Page*>(np);
 }
 
+void RawPageAllocator::unmap_all() noexcept {
+  Mapping* mapping;
+  {
+    std::lock_guard locker(lock_);
+    mapping = std::exchange(mappings_, nullptr);
+    cached_page_ = nullptr;
+    mapped_bytes_ = 0;
+  }
+  while (mapping) {
+    Mapping* next = mapping->next;
+    size_t size = mapping->size;
+    void* base = byte_advance(mapping, -std::ptrdiff_t(size - kPageSize));
+    fsys_munmap(base, size);
+    mapping = next;
+  }
+}
+
+size_t RawPageAllocator::mapped_bytes() noexcept {
+  std::lock_guard locker(lock_);
+  return mapped_bytes_;
+}
+
+size_t RawPageAllocator::cached_bytes() noexcept {
+  std::lock_guard locker(lock_);
+  size_t res = 0;
+  for (CachedPage* cur = cached_page_; cur; cur = cur->next) res += cur->size;
+  return res;
+}
+
 bool RawPageAllocator::is_from_brk(void* ptr) noexcept {
 #ifdef CBU_NO_BRK
   return false;
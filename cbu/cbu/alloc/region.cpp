@@ -0,0 +1,118 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/alloc/region.h"
+
+#include <new>
+
+#include "cbu/alloc/private/common.h"
+
+namespace cbu {
+namespace alloc {
+
+Region::Chunk* Region::new_chunk(size_t size) noexcept {
+  Chunk* chunk = reinterpret_cast<Chunk*>(allocate_page(size, page_options_));
+  if (false_no_fail(chunk == nullptr)) return nullptr;
+  chunk->size = size;
+  bytes_reserved_ += size;
+  return chunk;
+}
+
+void Region::free_chunk(Chunk* chunk) noexcept {
+  bytes_reserved_ -= chunk->size;
+  reclaim_page(reinterpret_cast<Page*>(chunk), chunk->size, page_options_);
+}
+
+void* Region::allocate_slow(size_t size, size_t align) noexcept {
+  if (size > SIZE_MAX / 4 || align > SIZE_MAX / 4) return nomem();
+  // Bytes needed in a new chunk, in the worst case of alignment
+  size_t need = sizeof(Chunk) + align + size;
+  if (need > chunk_size_ / 4) {
+    // Oversized; give it a chunk of its own, and keep bumping in the current
+    // chunk
+    Chunk* chunk = new_chunk(pagesize_ceil(need));
+    if (false_no_fail(chunk == nullptr)) return nomem();
+    if (chunks_) {
+      chunk->next = chunks_->next;
+      chunks_->next = chunk;
+    } else {
+      chunk->next = nullptr;
+      chunks_ = chunk;
+    }
+    return pow2_ceil(reinterpret_cast<char*>(chunk + 1), align);
+  }
+
+  Chunk* chunk = new_chunk(chunk_size_);
+  if (false_no_fail(chunk == nullptr)) return nomem();
+  chunk->next = chunks_;
+  chunks_ = chunk;
+  char* p = pow2_ceil(reinterpret_cast<char*>(chunk + 1), align);
+  cur_ = p + size;
+  end_ = reinterpret_cast<char*>(chunk) + chunk_size_;
+  return p;
+}
+
+void Region::reset() noexcept {
+  // Keep one chunk of the regular size
+  Chunk* keep = nullptr;
+  Chunk* chunk = chunks_;
+  while (chunk) {
+    Chunk* next = chunk->next;
+    if (keep == nullptr && chunk->size == chunk_size_)
+      keep = chunk;
+    else
+      free_chunk(chunk);
+    chunk = next;
+  }
+  chunks_ = keep;
+  if (keep) {
+    keep->next = nullptr;
+    cur_ = reinterpret_cast<char*>(keep + 1);
+    end_ = reinterpret_cast<char*>(keep) + chunk_size_;
+  } else {
+    cur_ = end_ = nullptr;
+  }
+}
+
+void Region::release() noexcept {
+  Chunk* chunk = chunks_;
+  while (chunk) free_chunk(std::exchange(chunk, chunk->next));
+  chunks_ = nullptr;
+  cur_ = end_ = nullptr;
+}
+
+void* RegionResource::do_allocate(size_t bytes, size_t alignment) {
+  void* p = region_->allocate(bytes, alignment);
+#ifndef CBU_ASSUME_MEMORY_ALLOCATION_NEVER_FAILS
+  if (p == nullptr) throw std::bad_alloc();
+#endif
+  return p;
+}
+
+}  // namespace alloc
+}  // namespace cbu
@@ -0,0 +1,140 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <memory_resource>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/pagesize.h"
+#include "cbu/common/bit.h"
+
+namespace cbu {
+namespace alloc {
+
+// Region (bump) allocator, for many short-lived allocations that all die at
+// the same time, e.g., at the end of a request.
+//
+// Memory is carved from chunks obtained with allocate_page, and is only
+// released by reset or the destructor.  reset keeps one chunk for reuse, so
+// that a region reused for similar requests doesn't allocate any pages in
+// steady state (in which case reset is O(1)).
+// Allocations larger than a quarter of the chunk size get chunks of their own.
+//
+// With default page options, chunks of kTHPSize or larger are backed by
+// transparent huge pages where possible; force_mmap disables this.
+//
+// A Region is not thread-safe.
+class Region {
+ public:
+  static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+  explicit Region(size_t chunk_size = kDefaultChunkSize,
+                  AllocateOptions page_options = {}) noexcept
+      : chunk_size_(pagesize_ceil(chunk_size)),
+        page_options_(page_options.with_zero(false)) {}
+  Region(const Region&) = delete;
+  Region& operator=(const Region&) = delete;
+  ~Region() noexcept { release(); }
+
+  // align must be a power of 2
+  void* allocate(size_t size,
+                 size_t align = alignof(std::max_align_t)) noexcept {
+    char* p = pow2_ceil(cur_, align);
+    // Strict comparison, so that we never return nullptr from an empty region
+    if (p < end_ && size < size_t(end_ - p)) [[likely]] {
+      cur_ = p + size;
+      return p;
+    }
+    return allocate_slow(size, align);
+  }
+
+  template <typename T>
+  T* allocate_array(size_t n) noexcept {
+    if (n > SIZE_MAX / sizeof(T)) return static_cast<T*>(nomem());
+    return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+  }
+
+  // Frees all allocations, keeping one chunk
+  void reset() noexcept;
+  // Frees all allocations and all chunks
+  void release() noexcept;
+
+  // Bytes of chunks held, including those of oversized allocations
+  size_t bytes_reserved() const noexcept { return bytes_reserved_; }
+
+ private:
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+  };
+
+  static constexpr size_t pagesize_ceil(size_t size) noexcept {
+    return pow2_ceil(size, kPageSize);
+  }
+
+  [[gnu::noinline]] void* allocate_slow(size_t size, size_t align) noexcept;
+  Chunk* new_chunk(size_t size) noexcept;
+  void free_chunk(Chunk* chunk) noexcept;
+
+ private:
+  char* cur_ = nullptr;
+  char* end_ = nullptr;
+  // The first chunk is the one we bump in, unless it's an oversized one
+  Chunk* chunks_ = nullptr;
+  size_t chunk_size_;
+  size_t bytes_reserved_ = 0;
+  AllocateOptions page_options_;
+};
+
+// Adapter for std::pmr containers.  Deallocation is a no-op; memory is
+// released with the region.
+class RegionResource final : public std::pmr::memory_resource {
+ public:
+  explicit RegionResource(Region* region) noexcept : region_(region) {}
+
+  Region* region() const noexcept { return region_; }
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void*, size_t, size_t) noexcept override {}
+  bool do_is_equal(const std::pmr::memory_resource& other)
+      const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  Region* region_;
+};
+
+}  // namespace alloc
+}  // namespace cbu
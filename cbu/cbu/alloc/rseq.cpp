@@ -0,0 +1,119 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/alloc/private/rseq.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+
+#if __has_include(<sys/rseq.h>)
+#  include <sys/rseq.h>
+#elif __has_include(<linux/rseq.h>)
+#  include <linux/rseq.h>
+#endif
+
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu::alloc {
+namespace {
+
+#if defined __NR_rseq && defined RSEQ_CPU_ID_UNINITIALIZED && \
+    !defined CBU_SINGLE_THREADED
+
+#  ifndef RSEQ_SIG
+// Must be the same signature as everybody else in the process, though it
+// doesn't matter for us since we never define rseq critical sections.
+#    if defined __x86_64__ || defined __i386__
+#      define RSEQ_SIG 0x53053053
+#    elif defined __aarch64__
+#      define RSEQ_SIG 0xd428bc00
+#    endif
+#  endif
+
+enum class RseqStatus : unsigned char {
+  kInitial = 0,
+  kRegistered = 1,
+  kFailed = 2,
+};
+
+// Only used if glibc has not registered rseq for us
+constinit thread_local struct rseq t_rseq = {
+    .cpu_id_start = 0,
+    .cpu_id = uint32_t(RSEQ_CPU_ID_UNINITIALIZED),
+};
+constinit thread_local RseqStatus t_rseq_status = RseqStatus::kInitial;
+
+[[gnu::noinline]] int register_rseq_and_get_cpu() noexcept {
+#  ifdef RSEQ_SIG
+  if (t_rseq_status == RseqStatus::kInitial) {
+    long r = fsys_generic(__NR_rseq, long, 4, &t_rseq, sizeof(t_rseq), 0,
+                          RSEQ_SIG);
+    t_rseq_status =
+        fsys_failure(r) ? RseqStatus::kFailed : RseqStatus::kRegistered;
+  }
+  if (t_rseq_status == RseqStatus::kRegistered)
+    return int32_t(std::atomic_ref(t_rseq.cpu_id).load(
+        std::memory_order_relaxed));
+#  endif
+  return -1;
+}
+
+inline int own_rseq_cpu() noexcept {
+  if (t_rseq_status == RseqStatus::kRegistered) [[likely]]
+    return int32_t(
+        std::atomic_ref(t_rseq.cpu_id).load(std::memory_order_relaxed));
+  return register_rseq_and_get_cpu();
+}
+
+#endif
+
+}  // namespace
+
+int current_cpu() noexcept {
+#if defined __NR_rseq && defined RSEQ_CPU_ID_UNINITIALIZED && \
+    !defined CBU_SINGLE_THREADED
+#  if defined __GLIBC__ && __has_include(<sys/rseq.h>)
+  if (__rseq_size != 0) {
+    // Registered by glibc.  cpu_id is negative (RSEQ_CPU_ID_UNINITIALIZED or
+    // RSEQ_CPU_ID_REGISTRATION_FAILED) if unusable.
+    struct rseq* area = reinterpret_cast<struct rseq*>(
+        static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    return int32_t(
+        std::atomic_ref(area->cpu_id).load(std::memory_order_relaxed));
+  }
+#  endif
+  return own_rseq_cpu();
+#else
+  return -1;
+#endif
+}
+
+}  // namespace cbu::alloc
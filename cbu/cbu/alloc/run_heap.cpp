@@ -0,0 +1,217 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef CBU_ALLOC_HUGEPAGE_RUNS
+
+#include "cbu/alloc/private/run_heap.h"
+
+#include <sys/mman.h>
+
+#include <mutex>
+
+#include "cbu/alloc/stats.h"
+#include "cbu/common/bit.h"
+#include "cbu/common/procutil.h"
+#include "cbu/fsyscall/fsyscall.h"
+#include "cbu/sys/low_level_mutex.h"
+
+namespace cbu::alloc {
+namespace {
+
+static_assert(kTHPSize > 0,
+              "CBU_ALLOC_HUGEPAGE_RUNS requires transparent huge pages");
+
+constexpr size_t kSuperblockSize = kTHPSize;
+constexpr unsigned kSuperblockPages = kSuperblockSize / kPageSize;
+// The first page is the header
+constexpr unsigned kRunsPerSuperblock = kSuperblockPages - 1;
+constexpr unsigned kMapWords = kSuperblockPages / 64;
+static_assert(kSuperblockPages % 64 == 0);
+
+// Empty superblocks kept for reuse.  More are returned to the system.
+constexpr unsigned kMaxEmptySuperblocks = 2;
+
+struct Superblock {
+  Superblock* prev;
+  Superblock* next;
+  // Run pages in use
+  unsigned used;
+  // Bit i is set if page i is in use.  Bit 0 (the header) is always set.
+  uint64_t used_map[kMapWords];
+};
+
+static_assert(sizeof(Superblock) <= kPageSize);
+
+constinit LowLevelMutex g_lock{};
+// Partially used superblocks, bucketed by the number of pages in use.
+// Full superblocks are in no list; empty ones are in g_empty.
+constinit Superblock* g_partial[kRunsPerSuperblock] = {};
+// Bit i is set if g_partial[i] is not empty
+constinit uint64_t g_partial_map[kMapWords] = {};
+constinit Superblock* g_empty = nullptr;
+constinit unsigned g_empty_count = 0;
+
+// Statistics
+constinit uint64_t g_superblocks = 0;
+constinit uint64_t g_run_pages = 0;
+
+inline Superblock* page_to_superblock(Page* page) noexcept {
+  return reinterpret_cast<Superblock*>(uintptr_t(page) & -kSuperblockSize);
+}
+
+void partial_insert(Superblock* sb) noexcept {
+  unsigned k = sb->used;
+  Superblock* head = g_partial[k];
+  sb->prev = nullptr;
+  sb->next = head;
+  if (head) head->prev = sb;
+  g_partial[k] = sb;
+  g_partial_map[k / 64] |= uint64_t(1) << (k % 64);
+}
+
+void partial_remove(Superblock* sb) noexcept {
+  unsigned k = sb->used;
+  if (sb->next) sb->next->prev = sb->prev;
+  if (sb->prev) {
+    sb->prev->next = sb->next;
+  } else {
+    g_partial[k] = sb->next;
+    if (sb->next == nullptr)
+      g_partial_map[k / 64] &= ~(uint64_t(1) << (k % 64));
+  }
+}
+
+// Returns the fullest partially used superblock, or nullptr
+Superblock* fullest_partial() noexcept {
+  for (unsigned i = kMapWords; i-- > 0;) {
+    if (uint64_t w = g_partial_map[i]) return g_partial[i * 64 + 63 - clz(w)];
+  }
+  return nullptr;
+}
+
+Superblock* map_superblock() noexcept {
+  load_config();
+  // Map twice the size, and cut off the misaligned ends
+  void* p = fsys_mmap(nullptr, 2 * kSuperblockSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (false_no_fail(fsys_mmap_failed(p))) return nullptr;
+  char* lo = static_cast<char*>(p);
+  char* aligned = pow2_ceil(lo, kSuperblockSize);
+  if (aligned != lo) fsys_munmap(lo, aligned - lo);
+  fsys_munmap(aligned + kSuperblockSize, lo + kSuperblockSize - aligned);
+  if (g_conf.thp != ThpPolicy::kNever)
+    fsys_madvise(aligned, kSuperblockSize, MADV_HUGEPAGE);
+
+  Superblock* sb = reinterpret_cast<Superblock*>(aligned);
+  sb->used_map[0] = 1;
+  ++g_superblocks;
+  return sb;
+}
+
+void unmap_superblock(Superblock* sb) noexcept {
+  fsys_munmap(sb, kSuperblockSize);
+  --g_superblocks;
+}
+
+Page* take_page(Superblock* sb) noexcept {
+  for (unsigned i = 0; i < kMapWords; ++i) {
+    uint64_t w = sb->used_map[i];
+    if (~w) {
+      unsigned bit = ctz(~w);
+      sb->used_map[i] = w | (uint64_t(1) << bit);
+      ++sb->used;
+      ++g_run_pages;
+      return reinterpret_cast<Page*>(sb) + (i * 64 + bit);
+    }
+  }
+  fatal<"Memory corrupt: no free page in superblock">();
+}
+
+}  // namespace
+
+Page* allocate_run_page() noexcept {
+  std::lock_guard locker(g_lock);
+  Superblock* sb = fullest_partial();
+  if (sb) {
+    partial_remove(sb);
+  } else if (g_empty) {
+    sb = g_empty;
+    g_empty = sb->next;
+    --g_empty_count;
+  } else {
+    sb = map_superblock();
+    if (false_no_fail(sb == nullptr)) return nullptr;
+  }
+  Page* page = take_page(sb);
+  if (sb->used < kRunsPerSuperblock) partial_insert(sb);
+  return page;
+}
+
+void reclaim_run_page(Page* page) noexcept {
+  Superblock* sb = page_to_superblock(page);
+  unsigned idx = page - reinterpret_cast<Page*>(sb);
+  uint64_t mask = uint64_t(1) << (idx % 64);
+
+  std::lock_guard locker(g_lock);
+  if (idx == 0 || !(sb->used_map[idx / 64] & mask))
+    fatal<"Memory corrupt: invalid run page">();
+  if (sb->used < kRunsPerSuperblock) partial_remove(sb);
+  sb->used_map[idx / 64] &= ~mask;
+  --sb->used;
+  --g_run_pages;
+  if (sb->used) {
+    partial_insert(sb);
+  } else if (g_empty_count < kMaxEmptySuperblocks) {
+    sb->next = g_empty;
+    g_empty = sb;
+    ++g_empty_count;
+  } else {
+    unmap_superblock(sb);
+  }
+}
+
+void run_heap_trim() noexcept {
+  Superblock* list;
+  {
+    std::lock_guard locker(g_lock);
+    list = std::exchange(g_empty, nullptr);
+    g_superblocks -= std::exchange(g_empty_count, 0);
+  }
+  while (list) fsys_munmap(std::exchange(list, list->next), kSuperblockSize);
+}
+
+void get_run_heap_stats(Stats* stats) noexcept {
+  std::lock_guard locker(g_lock);
+  stats->superblocks = g_superblocks;
+  stats->superblocks_empty = g_empty_count;
+  stats->superblock_pages_in_use = g_run_pages;
+}
+
+}  // namespace cbu::alloc
+
+#endif  // CBU_ALLOC_HUGEPAGE_RUNS
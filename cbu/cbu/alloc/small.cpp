@@ -28,12 +28,19 @@
 
 #include "cbu/alloc/private/small.h"
 
+#include <algorithm>
 #include <atomic>
 #include <mutex>
+#include <new>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/private/common.h"
+#include "cbu/alloc/private/cpu_cache.h"
+#include "cbu/alloc/private/permanent.h"
+#include "cbu/alloc/private/rseq.h"
+#include "cbu/alloc/private/run_heap.h"
 #include "cbu/alloc/private/tc.h"
+#include "cbu/alloc/stats.h"
 #include "cbu/common/byte_size.h"
 #include "cbu/common/procutil.h"
 #include "cbu/sys/low_level_mutex.h"
@@ -46,6 +53,9 @@ namespace {
 struct Run {
   unsigned cat;
   unsigned allocated;
+#ifdef CBU_ALLOC_REMOTE_FREE
+  RemoteFreeList* owner;
+#endif
 };
 
 static_assert(sizeof(Block) <= category_to_size(0), "Block too large");
@@ -55,6 +65,13 @@ inline Run* block2run(Block* ptr) {
   return (Run*)pagesize_floor(static_cast<void*>(ptr));
 }
 
+// Statistics
+constinit uint64_t small_runs[kNumCategories] = {};
+constinit uint64_t small_runs_reclaimed[kNumCategories] = {};
+// Counters of exited threads
+constinit uint64_t retired_allocations[kNumCategories] = {};
+constinit uint64_t retired_frees[kNumCategories] = {};
+
 void free_small_list(Block* ptr) {
   while (ptr) {
     Block* p = std::exchange(ptr, ptr->next);
@@ -73,11 +90,188 @@ void free_small_list(Block* ptr) {
     if (remain <= 0) {
       if (remain < 0)
         fatal<"Memory corrupt: run->allocated < 0 at free_small">();
+      stat_add_shared(&small_runs_reclaimed[run->cat], 1);
+#ifdef CBU_ALLOC_HUGEPAGE_RUNS
+      reclaim_run_page((Page*)run);
+#else
       reclaim_page((Page*)run, kPageSize);
+#endif
+    }
+  }
+}
+
+// A thread cache holding this many free blocks of a category flushes them
+inline unsigned small_cache_flush() noexcept {
+  return g_conf.small_cache_flush;
+}
+
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+// Initial flush limit of thread caches.  Doubled on each flush, as long as the
+// thread cache budget permits, so that only threads freeing a lot hold many
+// free blocks.
+constexpr unsigned kSmallCacheMinFlush = 32;
+
+inline bool small_cache_full(const ThreadCategory* catp) noexcept {
+  return catp->count_free + catp->flush_cut >= small_cache_flush();
+}
+#else
+inline bool small_cache_full(const ThreadCategory* catp) noexcept {
+  return catp->count_free >= small_cache_flush();
+}
+#endif
+
+#ifndef CBU_SINGLE_THREADED
+
+// The transfer cache moves batches of free blocks between thread caches
+// (or CPU caches) without returning them to their runs.
+// Without it, in producer/consumer patterns, every batch flushed by the
+// consumer is returned to its runs, which are then reclaimed and allocated
+// again by the producer.
+//
+// Each category has a few shards, each holding a small ring of batches.
+// Batches are pushed to the shard of the current CPU, and popped from any
+// shard, preferring that of the current CPU.  When a shard is full, its oldest
+// batch is considered cold and returned to its runs.
+constexpr unsigned kTransferShards = 4;
+constexpr unsigned kTransferMaxSlots = 8;
+
+// Keep at most about 256 KiB per shard, but no fewer than 2 batches
+inline unsigned transfer_slots(unsigned cat) noexcept {
+  return std::clamp<size_t>(
+      64 * kPageSize / (small_cache_flush() * category_to_size(cat)), 2,
+      kTransferMaxSlots);
+}
+
+struct TransferBatch {
+  Block* head;
+  unsigned count;
+};
+
+struct alignas(kCacheLineSize) TransferShard {
+  [[no_unique_address]] LowLevelMutex lock;
+  unsigned start;  // Index of the oldest batch
+  unsigned size;
+  TransferBatch batches[kTransferMaxSlots];
+};
+
+constinit TransferShard transfer_cache[kNumCategories][kTransferShards] = {};
+
+inline unsigned transfer_shard_index() noexcept {
+  // Negative values (CPU unknown) all go to the same shard
+  return unsigned(current_cpu()) % kTransferShards;
+}
+
+void transfer_push(unsigned cat, Block* head, unsigned count) noexcept {
+  TransferShard* shard = &transfer_cache[cat][transfer_shard_index()];
+  unsigned slots = transfer_slots(cat);
+  Block* evicted = nullptr;
+  {
+    std::lock_guard locker(shard->lock);
+    if (shard->size == slots) {
+      evicted = shard->batches[shard->start].head;
+      shard->start = (shard->start + 1) % slots;
+      --shard->size;
+    }
+    shard->batches[(shard->start + shard->size) % slots] = {head, count};
+    ++shard->size;
+  }
+  free_small_list(evicted);
+}
+
+// Pops the most recently pushed batch (whose blocks are most likely still in
+// CPU caches) into *catp, which must be empty.
+bool transfer_pop(unsigned cat, ThreadCategory* catp) noexcept {
+  unsigned slots = transfer_slots(cat);
+  unsigned idx = transfer_shard_index();
+  for (unsigned i = 0; i < kTransferShards; ++i) {
+    TransferShard* shard = &transfer_cache[cat][(idx + i) % kTransferShards];
+    std::lock_guard locker(shard->lock);
+    if (shard->size) {
+      --shard->size;
+      const TransferBatch& batch =
+          shard->batches[(shard->start + shard->size) % slots];
+      catp->free = batch.head;
+      stat_store(&catp->count_free, batch.count);
+      return true;
+    }
+  }
+  return false;
+}
+
+void transfer_cache_clear() noexcept {
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    unsigned slots = transfer_slots(cat);
+    for (TransferShard& shard : transfer_cache[cat]) {
+      TransferBatch batches[kTransferMaxSlots];
+      unsigned n;
+      {
+        std::lock_guard locker(shard.lock);
+        n = std::exchange(shard.size, 0);
+        for (unsigned i = 0; i < n; ++i)
+          batches[i] = shard.batches[(shard.start + i) % slots];
+      }
+      for (unsigned i = 0; i < n; ++i) free_small_list(batches[i].head);
+    }
+  }
+}
+
+#endif  // !CBU_SINGLE_THREADED
+
+#ifdef CBU_ALLOC_REMOTE_FREE
+
+// In this mode, each run records the SmallCache that allocated it, and blocks
+// freed by other threads are pushed to a lock-free list of the owner, instead
+// of the cache of the freeing thread.  This keeps memory from drifting from
+// producer threads to consumer threads.
+// The owner takes the whole list on its next allocation miss.
+
+constinit SimplePermaAlloc<RemoteFreeList> remote_free_list_allocator;
+constinit LowLevelMutex retired_remote_free_lock{};
+constinit RemoteFreeList* retired_remote_free_lists = nullptr;
+
+RemoteFreeList* acquire_remote_free_list() noexcept {
+  {
+    std::lock_guard locker(retired_remote_free_lock);
+    if (RemoteFreeList* remote = retired_remote_free_lists) {
+      retired_remote_free_lists = remote->next_retired;
+      return remote;
     }
   }
+  void* mem = remote_free_list_allocator.alloc();
+  if (false_no_fail(mem == nullptr)) return nullptr;
+  return new (mem) RemoteFreeList{};
+}
+
+void push_remote_free(RemoteFreeList* remote, unsigned cat, Block* p) noexcept {
+  std::atomic_ref head(remote->head[cat]);
+  p->count = 1;
+  p->next = head.load(std::memory_order_relaxed);
+  while (!head.compare_exchange_weak(p->next, p, std::memory_order_release,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+// Takes blocks freed by other threads into *catp, which must be empty
+bool pop_remote_free(RemoteFreeList* remote, unsigned cat,
+                     ThreadCategory* catp) noexcept {
+  std::atomic_ref head(remote->head[cat]);
+  if (head.load(std::memory_order_relaxed) == nullptr) return false;
+  Block* list = head.exchange(nullptr, std::memory_order_acquire);
+  unsigned count = 0;
+  for (Block* p = list; p; p = p->next) ++count;
+  catp->free = list;
+  stat_store(&catp->count_free, count);
+  return true;
+}
+
+void clear_remote_free(RemoteFreeList* remote) noexcept {
+  for (Block*& head : remote->head)
+    free_small_list(
+        std::atomic_ref(head).exchange(nullptr, std::memory_order_acquire));
 }
 
+#endif  // CBU_ALLOC_REMOTE_FREE
+
 // Use fallback_cache when thread_cache is unusable
 constinit SmallCache fallback_cache{};
 #ifndef CBU_SINGLE_THREADED
@@ -86,89 +280,325 @@ constinit LowLevelMutex fallback_cache_lock{};
 
 void* alloc_small_category_with_cache(SmallCache* cache, unsigned cat) {
   ThreadCategory* catp = &cache->category[cat];
-  if (Block* free = catp->free) {
-    catp->count_free--;
+  Block* free = catp->free;
+#ifdef CBU_ALLOC_REMOTE_FREE
+  if (free == nullptr && cache->remote &&
+      pop_remote_free(cache->remote, cat, catp))
+    free = catp->free;
+#endif
+#ifndef CBU_SINGLE_THREADED
+  if (free == nullptr && transfer_pop(cat, catp)) free = catp->free;
+#endif
+  if (free) {
+    stat_store(&catp->count_free, catp->count_free - 1);
+    stat_add(&catp->allocations, 1);
     unsigned remaining = --(free->count);
     Block* p = byte_advance(free, multiply_by_category_size(remaining, cat));
     if (remaining == 0) catp->free = free->next;
     return p;
   }
 
+#ifdef CBU_ALLOC_HUGEPAGE_RUNS
+  Run* run = (Run*)allocate_run_page();
+#else
   Run* run = (Run*)allocate_page(kPageSize);
+#endif
   if (false_no_fail(run == nullptr)) return nullptr;
   unsigned cap = divide_by_category_size(kPageSize, cat) - 1;
   run->cat = cat;
   run->allocated = cap;
+#ifdef CBU_ALLOC_REMOTE_FREE
+  if (cache->remote == nullptr) cache->remote = acquire_remote_free_list();
+  run->owner = cache->remote;
+#endif
 
   Block* p = byte_advance((Block*)run, category_to_size(cat));
   Block* np = byte_advance(p, category_to_size(cat));
   np->next = nullptr;
   np->count = cap - 1;
   catp->free = np;
-  catp->count_free = cap - 1;
+  stat_store(&catp->count_free, cap - 1);
+  stat_add(&catp->allocations, 1);
+  stat_add_shared(&small_runs[cat], 1);
   return p;
 }
 
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+[[gnu::noinline]] void raise_flush_limit(SmallCache* cache,
+                                         ThreadCategory* catp,
+                                         unsigned cat) noexcept {
+  unsigned grow =
+      std::min(small_cache_flush() - catp->flush_cut, catp->flush_cut);
+  size_t bytes = multiply_by_category_size(grow, cat);
+  if (!charge_thread_cache_budget(bytes)) return;
+  stat_store(&cache->budget_bytes, cache->budget_bytes + bytes);
+  catp->flush_cut -= grow;
+}
+#endif
+
+// Blocks in arena handles bypass all caches
+void free_small_in_handle(Run* run, Block* p) noexcept {
+  unsigned cat = run->cat & ~kRunInArenaHandle;
+  if (cat > kMaxCategory)
+    fatal<"Memory corrupt: category invalid at free_small">();
+  size_t offset = uintptr_t(p) % kPageSize;
+  if (offset != multiply_by_category_size(
+                    divide_by_category_size(offset, cat), cat))
+    fatal<"Memory corrupt: alignment invalid at free_small">();
+
+  ArenaHandle* handle = arena_handle_of_page(reinterpret_cast<Page*>(run));
+  std::lock_guard locker(handle->lock);
+  p->count = 1;
+  p->next = handle->small_free[cat];
+  handle->small_free[cat] = p;
+}
+
 void free_small_with_cache(SmallCache* cache, void* ptr) {
   Block* p = static_cast<Block*>(ptr);
 
-  unsigned cat = block2run(p)->cat;
-  if (cat > kMaxCategory)
+  Run* run = block2run(p);
+  unsigned cat = run->cat;
+  if (cat > kMaxCategory) {
+    if (cat & kRunInArenaHandle) return free_small_in_handle(run, p);
     fatal<"Memory corrupt: category invalid at free_small">();
+  }
 
-  if (uintptr_t(p) & (category_to_size(cat) - 1))
+  size_t offset = uintptr_t(p) % kPageSize;
+  if (offset != multiply_by_category_size(
+                    divide_by_category_size(offset, cat), cat))
     fatal<"Memory corrupt: alignment invalid at free_small">();
 
   ThreadCategory* catp = &cache->category[cat];
+  stat_add(&catp->frees, 1);
+
+#ifdef CBU_ALLOC_REMOTE_FREE
+  if (RemoteFreeList* owner = run->owner; owner && owner != cache->remote) {
+    push_remote_free(owner, cat, p);
+    return;
+  }
+#endif
+
   p->count = 1;
-  if (catp->count_free >= 256) {
+  if (small_cache_full(catp)) {
     p->next = nullptr;
-    catp->count_free = 1;
-    free_small_list(std::exchange(catp->free, p));
+    unsigned count = catp->count_free;
+    stat_store(&catp->count_free, 1);
+    Block* batch = std::exchange(catp->free, p);
+#ifdef CBU_SINGLE_THREADED
+    (void)count;
+    free_small_list(batch);
+#else
+    transfer_push(cat, batch, count);
+#endif
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+    if (catp->flush_cut) raise_flush_limit(cache, catp, cat);
+#endif
   } else {
     p->next = catp->free;
     catp->free = p;
-    catp->count_free++;
+    stat_store(&catp->count_free, catp->count_free + 1);
+  }
+}
+
+// Takes n blocks into out, returning the number actually allocated (less than
+// n only if memory is exhausted).
+// Blocks are taken a whole free list node at a time, and a new run is handed
+// out in one piece, so run->allocated is only written once per run.
+size_t alloc_small_batch_with_cache(SmallCache* cache, unsigned cat, size_t n,
+                                    void** out) {
+  ThreadCategory* catp = &cache->category[cat];
+  size_t size = category_to_size(cat);
+  size_t done = 0;
+  while (done < n) {
+    Block* free = catp->free;
+#ifdef CBU_ALLOC_REMOTE_FREE
+    if (free == nullptr && cache->remote &&
+        pop_remote_free(cache->remote, cat, catp))
+      free = catp->free;
+#endif
+#ifndef CBU_SINGLE_THREADED
+    if (free == nullptr && transfer_pop(cat, catp)) free = catp->free;
+#endif
+    if (free == nullptr) {
+#ifdef CBU_ALLOC_HUGEPAGE_RUNS
+      Run* run = (Run*)allocate_run_page();
+#else
+      Run* run = (Run*)allocate_page(kPageSize);
+#endif
+      if (false_no_fail(run == nullptr)) break;
+      unsigned cap = divide_by_category_size(kPageSize, cat) - 1;
+      run->cat = cat;
+      run->allocated = cap;
+#ifdef CBU_ALLOC_REMOTE_FREE
+      if (cache->remote == nullptr) cache->remote = acquire_remote_free_list();
+      run->owner = cache->remote;
+#endif
+      stat_add_shared(&small_runs[cat], 1);
+      // Make the whole run a free list node, and take from it below
+      free = byte_advance((Block*)run, size);
+      free->next = nullptr;
+      free->count = cap;
+      catp->free = free;
+      stat_store(&catp->count_free, cap);
+    }
+
+    unsigned count = free->count;
+    unsigned take = std::min<size_t>(count, n - done);
+    for (unsigned i = count - take; i < count; ++i)
+      out[done++] = byte_advance(free, multiply_by_category_size(i, cat));
+    free->count = count - take;
+    if (count == take) catp->free = free->next;
+    stat_store(&catp->count_free, catp->count_free - take);
   }
+  stat_add(&catp->allocations, done);
+  return done;
+}
+
+// Frees small blocks.  The thread cache is filled up to its flush limit;
+// the rest are returned to their runs directly, with one update of
+// run->allocated per group of consecutive blocks of the same run.
+void free_small_batch_with_cache(SmallCache* cache, void** ptrs, size_t n) {
+  Block* to_runs = nullptr;
+  Run* last_run = nullptr;
+  for (size_t i = 0; i < n; ++i) {
+    Block* p = static_cast<Block*>(ptrs[i]);
+    Run* run = block2run(p);
+    unsigned cat = run->cat;
+    if (cat > kMaxCategory) {
+      if (cat & kRunInArenaHandle) {
+        free_small_in_handle(run, p);
+        continue;
+      }
+      fatal<"Memory corrupt: category invalid at free_small">();
+    }
+    size_t offset = uintptr_t(p) % kPageSize;
+    if (offset != multiply_by_category_size(
+                      divide_by_category_size(offset, cat), cat))
+      fatal<"Memory corrupt: alignment invalid at free_small">();
+
+    ThreadCategory* catp = &cache->category[cat];
+    stat_add(&catp->frees, 1);
+
+    if (run == last_run) {
+      ++to_runs->count;
+      continue;
+    }
+    if (!small_cache_full(catp)
+#ifdef CBU_ALLOC_REMOTE_FREE
+        && run->owner == cache->remote
+#endif
+    ) {
+      p->count = 1;
+      p->next = catp->free;
+      catp->free = p;
+      stat_store(&catp->count_free, catp->count_free + 1);
+      continue;
+    }
+    // A node counting blocks of the same run; free_small_list doesn't care
+    // whether they're contiguous
+    p->count = 1;
+    p->next = to_runs;
+    to_runs = p;
+    last_run = run;
+  }
+  free_small_list(to_runs);
 }
 
 }  // namespace
 
 void SmallCache::clear() noexcept {
   for (ThreadCategory& catg : category) {
-    catg.count_free = 0;
+    stat_store(&catg.count_free, 0);
     free_small_list(std::exchange(catg.free, nullptr));
   }
+#ifdef CBU_ALLOC_REMOTE_FREE
+  if (remote) clear_remote_free(remote);
+#endif
 }
 
-void* alloc_small_category(unsigned cat) noexcept {
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+void SmallCache::reset_flush_limits() noexcept {
+  for (ThreadCategory& catg : category)
+    catg.flush_cut = small_cache_flush() -
+                     std::min(small_cache_flush(), kSmallCacheMinFlush);
+  if (size_t bytes = budget_bytes) {
+    stat_store(&budget_bytes, 0);
+    refund_thread_cache_budget(bytes);
+  }
+}
+#endif
+
+void SmallCache::retire_stats() noexcept {
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    stat_add_shared(&retired_allocations[cat],
+                    std::exchange(category[cat].allocations, 0));
+    stat_add_shared(&retired_frees[cat], std::exchange(category[cat].frees, 0));
+  }
+}
+
+#ifdef CBU_ALLOC_REMOTE_FREE
+void SmallCache::retire() noexcept {
+  if (RemoteFreeList* r = std::exchange(remote, nullptr)) {
+    clear_remote_free(r);
+    std::lock_guard locker(retired_remote_free_lock);
+    r->next_retired = retired_remote_free_lists;
+    retired_remote_free_lists = r;
+  }
+}
+#endif
+
+namespace {
+
+// Calls fn with the small cache of the current CPU or thread, holding its
+// lock if it has one
+template <typename Fn>
+[[gnu::always_inline]] inline auto with_small_cache(Fn fn) {
 #ifdef CBU_SINGLE_THREADED
-  return alloc_small_category_with_cache(&fallback_cache, cat);
+  return fn(&fallback_cache);
 #else
+#  ifdef CBU_ALLOC_PER_CPU_CACHE
+  if (CpuCache* cc = get_cpu_cache()) {
+    std::lock_guard locker(cc->lock);
+    return fn(&cc->small_cache);
+  }
+#  endif
   if (ThreadCache* tc = get_or_create_thread_cache()) {
-    return alloc_small_category_with_cache(&tc->small_cache, cat);
+    ThreadCacheUse use(tc);
+    return fn(&tc->small_cache);
   } else {
     std::lock_guard locker(fallback_cache_lock);
-    return alloc_small_category_with_cache(&fallback_cache, cat);
+    return fn(&fallback_cache);
   }
 #endif
 }
 
+}  // namespace
+
+void* alloc_small_category(unsigned cat) noexcept {
+  return with_small_cache([cat](SmallCache* cache) {
+    return alloc_small_category_with_cache(cache, cat);
+  });
+}
+
 void* alloc_small(size_t size) noexcept {
   return alloc_small_category(size_to_category(size));
 }
 
 void free_small(void* ptr) noexcept {
-#ifdef CBU_SINGLE_THREADED
-  free_small_with_cache(&fallback_cache, ptr);
-#else
-  if (ThreadCache* tc = get_or_create_thread_cache()) {
-    free_small_with_cache(&tc->small_cache, ptr);
-  } else {
-    std::lock_guard locker(fallback_cache_lock);
-    free_small_with_cache(&fallback_cache, ptr);
-  }
-#endif
+  with_small_cache(
+      [ptr](SmallCache* cache) { free_small_with_cache(cache, ptr); });
+}
+
+size_t alloc_small_batch(unsigned cat, size_t n, void** out) noexcept {
+  return with_small_cache([=](SmallCache* cache) {
+    return alloc_small_batch_with_cache(cache, cat, n, out);
+  });
+}
+
+void free_small_batch(void** ptrs, size_t n) noexcept {
+  with_small_cache([=](SmallCache* cache) {
+    free_small_batch_with_cache(cache, ptrs, n);
+  });
 }
 
 void free_small(void* ptr, size_t size) noexcept {
@@ -180,22 +610,112 @@ void free_small(void* ptr, size_t size) noexcept {
 unsigned small_allocated_category(void* ptr) noexcept {
   Block* p = static_cast<Block*>(ptr);
   Run* run = block2run(p);
-  return run->cat;
+  return run->cat & ~kRunInArenaHandle;
+}
+
+ArenaHandle* small_arena_handle(void* ptr) noexcept {
+  Run* run = block2run(static_cast<Block*>(ptr));
+  if (run->cat & kRunInArenaHandle) [[unlikely]]
+    return arena_handle_of_page(reinterpret_cast<Page*>(run));
+  return nullptr;
+}
+
+void* alloc_small_in_handle(ArenaHandle* handle, unsigned cat) noexcept {
+  std::lock_guard locker(handle->lock);
+  Block* free = handle->small_free[cat];
+  if (free == nullptr) {
+    Run* run = (Run*)handle->arena.allocate(kPageSize, false);
+    if (false_no_fail(run == nullptr)) return nullptr;
+    run->cat = cat | kRunInArenaHandle;
+    // Not maintained, since runs aren't returned to the arena
+    run->allocated = 0;
+#ifdef CBU_ALLOC_REMOTE_FREE
+    run->owner = nullptr;
+#endif
+    free = byte_advance((Block*)run, category_to_size(cat));
+    free->next = nullptr;
+    free->count = divide_by_category_size(kPageSize, cat) - 1;
+    handle->small_free[cat] = free;
+  }
+  unsigned remaining = --(free->count);
+  if (remaining == 0) handle->small_free[cat] = free->next;
+  return byte_advance(free, multiply_by_category_size(remaining, cat));
 }
 
 size_t small_allocated_size(void* ptr) noexcept {
   return category_to_size(small_allocated_category(ptr));
 }
 
+void get_small_stats(Stats* stats) noexcept {
+  static_assert(kNumCategories <= Stats::kMaxSmallCategories);
+  stats->small_category_count = kNumCategories;
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    SmallCategoryStats* s = &stats->small[cat];
+    s->block_size = category_to_size(cat);
+    s->allocations = stat_load(&retired_allocations[cat]);
+    s->frees = stat_load(&retired_frees[cat]);
+    s->runs = stat_load(&small_runs[cat]);
+    s->runs_reclaimed = stat_load(&small_runs_reclaimed[cat]);
+  }
+
+  auto add_cache = [stats](SmallCache* cache) {
+    for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+      ThreadCategory* catp = &cache->category[cat];
+      SmallCategoryStats* s = &stats->small[cat];
+      s->allocations += stat_load(&catp->allocations);
+      s->frees += stat_load(&catp->frees);
+      s->cached_blocks += stat_load(&catp->count_free);
+    }
+  };
+
+  add_cache(&fallback_cache);
+#ifndef CBU_SINGLE_THREADED
+  for_each_thread_cache([&](ThreadCache* tc) {
+    ++stats->thread_caches;
+    add_cache(&tc->small_cache);
+  });
+#  ifdef CBU_ALLOC_PER_CPU_CACHE
+  for (CpuCache*& slot : g_cpu_caches)
+    if (CpuCache* cc = load_acquire(&slot)) add_cache(&cc->small_cache);
+#  endif
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    for (TransferShard& shard : transfer_cache[cat]) {
+      std::lock_guard locker(shard.lock);
+      unsigned slots = transfer_slots(cat);
+      for (unsigned i = 0; i < shard.size; ++i)
+        stats->small[cat].cached_blocks +=
+            shard.batches[(shard.start + i) % slots].count;
+    }
+  }
+#endif
+}
+
 void small_trim(size_t) noexcept {
 #ifdef CBU_SINGLE_THREADED
   fallback_cache.clear();
 #else
-  if (ThreadCache* tc = get_thread_cache()) tc->small_cache.clear();
+#  ifdef CBU_ALLOC_PER_CPU_CACHE
+  clear_cpu_caches();
+#  endif
+  if (ThreadCache* tc = get_thread_cache()) {
+    ThreadCacheUse use(tc);
+    tc->small_cache.clear();
+  }
   {
     std::lock_guard locker(fallback_cache_lock);
     fallback_cache.clear();
   }
+  transfer_cache_clear();
+#  ifdef CBU_ALLOC_REMOTE_FREE
+  {
+    std::lock_guard locker(retired_remote_free_lock);
+    for (RemoteFreeList* r = retired_remote_free_lists; r; r = r->next_retired)
+      clear_remote_free(r);
+  }
+#  endif
+#endif
+#ifdef CBU_ALLOC_HUGEPAGE_RUNS
+  run_heap_trim();
 #endif
 }
 
@@ -0,0 +1,111 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cbu {
+namespace alloc {
+
+struct SmallCategoryStats {
+  size_t block_size;
+  // Cumulative counts of blocks allocated and freed
+  uint64_t allocations;
+  uint64_t frees;
+  // Cumulative counts of runs (single pages) allocated for this category and
+  // returned to the page allocator
+  uint64_t runs;
+  uint64_t runs_reclaimed;
+  // Free blocks held in thread, CPU and transfer caches
+  uint64_t cached_blocks;
+};
+
+struct ArenaStats {
+  const char* name;
+  // Bytes allocated from the arena, including pages cached by threads
+  uint64_t bytes_in_use;
+  // Free bytes known to be zero
+  uint64_t bytes_clean;
+  // Free bytes that may not be zero
+  uint64_t bytes_dirty;
+  // Free bytes purged with MADV_FREE, which the kernel may take back any time
+  uint64_t bytes_lazy;
+  // Bytes obtained from the system and not returned, including metadata
+  uint64_t bytes_mapped;
+  // Bytes obtained from the system but not yet used by anyone
+  uint64_t bytes_raw_cached;
+  // Cumulative count of bytes reclaimed to the arena
+  uint64_t bytes_reclaimed;
+  uint64_t madvise_calls;
+  uint64_t munmap_calls;
+};
+
+struct Stats {
+  static constexpr unsigned kMaxSmallCategories = 32;
+  static constexpr unsigned kMaxArenas = 4;
+
+  unsigned small_category_count;
+  unsigned arena_count;
+  unsigned thread_caches;  // Live thread caches
+  // Large blocks with mappings of their own
+  uint64_t direct_blocks;
+  uint64_t direct_bytes;
+  // Huge page superblocks holding small runs (CBU_ALLOC_HUGEPAGE_RUNS),
+  // how many of them are empty, and run pages in use in them
+  uint64_t superblocks;
+  uint64_t superblocks_empty;
+  uint64_t superblock_pages_in_use;
+  // Thread cache budget (CBU_ALLOC_THREAD_CACHE_BUDGET), bytes of it taken by
+  // raised flush limits, and idle thread caches scavenged by other threads
+  uint64_t thread_cache_budget;
+  uint64_t thread_cache_budget_used;
+  uint64_t thread_caches_scavenged;
+  // Times the pressure monitor trimmed memory
+  uint64_t pressure_trims;
+  // Tunables in effect (see CBU_MALLOC_CONF)
+  unsigned small_cache_flush;
+  uint64_t min_trim_threshold;
+  uint64_t max_trim_threshold;
+  uint64_t initial_alloc_size;
+  bool use_brk;
+  const char* thp;  // "default", "always" or "never"
+  SmallCategoryStats small[kMaxSmallCategories];
+  ArenaStats arenas[kMaxArenas];
+};
+
+// Takes a snapshot of allocator statistics.
+// Thread counters are read with relaxed atomic loads, without stopping other
+// threads, so the snapshot is not necessarily consistent.  Still, this is
+// cheap enough to be called every few seconds.
+// This function doesn't allocate memory.
+void get_stats(Stats* stats) noexcept;
+
+}  // namespace alloc
+}  // namespace cbu
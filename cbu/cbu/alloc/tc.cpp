@@ -31,34 +31,136 @@
 #include "cbu/alloc/private/tc.h"
 
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <atomic>
+#include <mutex>
 
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+#  include <linux/membarrier.h>
+#endif
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/stats.h"
 #include "cbu/common/procutil.h"
+#include "cbu/fsyscall/fsyscall.h"
 
 namespace cbu::alloc {
+
+constinit LowLevelMutex g_tc_registry_lock{};
+constinit ThreadCache* g_tc_registry = nullptr;
+
 namespace {
 
 std::atomic<TcStatus> g_tc_status{TcStatus::kInitial};
+constinit std::atomic<unsigned> g_next_arena_shard{0};
 pthread_key_t g_tc_key;
 constinit thread_local ThreadCache t_tc;
 
 static_assert(std::is_trivially_destructible_v<ThreadCache>);
 
-void TcDestroy(void* arg) {
-  ThreadCache* tc = static_cast<ThreadCache*>(arg);
-  if (!tc || tc->status != TcStatus::kReady) return;
-
+// Returns cached small blocks and pages, called by the owning thread or a
+// scavenger
+void clear_thread_caches(ThreadCache* tc) noexcept {
   tc->small_cache.clear();
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+  tc->small_cache.reset_flush_limits();
+#endif
+
+#ifndef CBU_NO_BRK
+  tc->page_category_cache_brk.clear(arena_brk.data(), kArenaShards);
+#endif
+  tc->page_category_cache.clear(arena_mmap.data(), kArenaShards);
+  if constexpr (kTHPSize > 0)
+    tc->page_category_cache_no_thp.clear(&arena_mmap_no_thp, 1);
+}
+
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+
+// Caches of threads idle for this long may be scavenged
+constexpr uint64_t kScavengeIntervalNs = 10'000'000;
 
+constinit std::atomic<size_t> g_tc_budget{
+    size_t(CBU_ALLOC_THREAD_CACHE_BUDGET) << 20};
+constinit std::atomic<size_t> g_tc_budget_used{0};
+constinit std::atomic<uint64_t> g_last_scavenge_ns{0};
+// Protected by g_tc_registry_lock
+constinit uint64_t g_tc_scavenged = 0;
+
+enum class MembarrierStatus : unsigned char {
+  kInitial = 0,
+  kRegistered = 1,
+  kFailed = 2,
+};
+
+// Protected by g_tc_registry_lock
+constinit MembarrierStatus g_membarrier_status = MembarrierStatus::kInitial;
+
+uint64_t now_ns() noexcept {
+  struct timespec ts;
+  fsys_clock_gettime_auto(CLOCK_MONOTONIC_COARSE, &ts);
+  return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+bool membarrier_ready() noexcept {
+  if (g_membarrier_status == MembarrierStatus::kInitial) {
+    long r = fsys_generic(__NR_membarrier, long, 3,
+                          MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0);
+    g_membarrier_status = fsys_failure(r) ? MembarrierStatus::kFailed
+                                          : MembarrierStatus::kRegistered;
+  }
+  return g_membarrier_status == MembarrierStatus::kRegistered;
+}
+
+uint64_t thread_activity(ThreadCache* tc) noexcept {
+  uint64_t n = 0;
+  for (ThreadCategory& catg : tc->small_cache.category)
+    n += stat_load(&catg.allocations) + stat_load(&catg.frees);
+  return n;
+}
+
+bool holds_cache(ThreadCache* tc) noexcept {
+  if (stat_load(&tc->small_cache.budget_bytes)) return true;
+  for (ThreadCategory& catg : tc->small_cache.category)
+    if (stat_load(&catg.count_free)) return true;
+  auto holds_pages = [](PageCategoryCache* cache) {
+    for (unsigned char& count : cache->page_count)
+      if (stat_load(&count)) return true;
+    return false;
+  };
 #ifndef CBU_NO_BRK
-  tc->page_category_cache_brk.clear(&arena_brk);
+  if (holds_pages(&tc->page_category_cache_brk)) return true;
 #endif
-  tc->page_category_cache.clear(&arena_mmap);
+  if (holds_pages(&tc->page_category_cache)) return true;
   if constexpr (kTHPSize > 0)
-    tc->page_category_cache_no_thp.clear(&arena_mmap_no_thp);
+    if (holds_pages(&tc->page_category_cache_no_thp)) return true;
+  return false;
+}
+
+#endif  // CBU_ALLOC_THREAD_CACHE_BUDGET
+
+void TcDestroy(void* arg) {
+  ThreadCache* tc = static_cast<ThreadCache*>(arg);
+  if (!tc || tc->status != TcStatus::kReady) return;
+
+  {
+    ThreadCacheUse use(tc);
+    clear_thread_caches(tc);
+#ifdef CBU_ALLOC_REMOTE_FREE
+    tc->small_cache.retire();
+#endif
+  }
 
   tc->description_cache.clear();
+
+  std::lock_guard locker(g_tc_registry_lock);
+  tc->small_cache.retire_stats();
+  if (tc->registry_prev)
+    tc->registry_prev->registry_next = tc->registry_next;
+  else
+    g_tc_registry = tc->registry_next;
+  if (tc->registry_next) tc->registry_next->registry_prev = tc->registry_prev;
 }
 
 bool TcSetUp() {
@@ -96,9 +198,24 @@ ThreadCache* get_or_create_thread_cache() noexcept {
     case TcStatus::kInitial: {
       if (!TcSetUp()) return nullptr;
       tc->status = TcStatus::kSettingUp;
+      // Flush limits depend on it
+      load_config();
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+      tc->small_cache.reset_flush_limits();
+#endif
+      if constexpr (kArenaShards > 1)
+        tc->arena_shard =
+            g_next_arena_shard.fetch_add(1, std::memory_order_relaxed) %
+            kArenaShards;
       int ret = pthread_setspecific(g_tc_key, tc);
       if (ret != 0) [[unlikely]]
         cbu::fatal<"pthread_setspecific failed">();
+      {
+        std::lock_guard locker(g_tc_registry_lock);
+        tc->registry_next = g_tc_registry;
+        if (g_tc_registry) g_tc_registry->registry_prev = tc;
+        g_tc_registry = tc;
+      }
       tc->status = TcStatus::kReady;
       break;
       }
@@ -118,6 +235,92 @@ ThreadCache* get_thread_cache() noexcept {
   return tc;
 }
 
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+
+// Candidates are flagged first, then a single membarrier makes sure that each
+// of them either sees the flag before using its caches again, or is already
+// seen using them (see ThreadCacheUse).
+void scavenge_idle_thread_caches() noexcept {
+  uint64_t now = now_ns();
+  uint64_t last = g_last_scavenge_ns.load(std::memory_order_relaxed);
+  if (now - last < kScavengeIntervalNs ||
+      !g_last_scavenge_ns.compare_exchange_strong(last, now,
+                                                  std::memory_order_relaxed))
+    return;
+
+  // Created beforehand, since clearing caches may need our own, and creating
+  // it takes g_tc_registry_lock
+  ThreadCache* self = get_or_create_thread_cache();
+  std::lock_guard locker(g_tc_registry_lock);
+  if (!membarrier_ready()) return;
+
+  bool any = false;
+  for (ThreadCache* tc = g_tc_registry; tc; tc = tc->registry_next) {
+    if (tc == self) continue;
+    uint64_t activity = thread_activity(tc);
+    if (std::exchange(tc->activity_seen, activity) != activity) continue;
+    if (!holds_cache(tc)) continue;
+    stat_store(&tc->scavenging, true);
+    any = true;
+  }
+  if (!any) return;
+
+  fsys_generic(__NR_membarrier, long, 3, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0,
+               0);
+
+  for (ThreadCache* tc = g_tc_registry; tc; tc = tc->registry_next) {
+    if (!tc->scavenging) continue;
+    if (load_acquire(&tc->in_use) == 0) {
+      clear_thread_caches(tc);
+      ++g_tc_scavenged;
+    }
+    store_release(&tc->scavenging, false);
+  }
+}
+
+bool charge_thread_cache_budget(size_t bytes) noexcept {
+  size_t budget = g_tc_budget.load(std::memory_order_relaxed);
+  size_t used =
+      g_tc_budget_used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  if (used <= budget) return true;
+  g_tc_budget_used.fetch_sub(bytes, std::memory_order_relaxed);
+  scavenge_idle_thread_caches();
+  return false;
+}
+
+void refund_thread_cache_budget(size_t bytes) noexcept {
+  g_tc_budget_used.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// The scavenger may be clearing our caches, which takes a while
+void wait_for_scavenger(ThreadCache* tc) noexcept {
+  while (load_acquire(&tc->scavenging)) fsys_sched_yield();
+}
+
+void get_thread_cache_stats(Stats* stats) noexcept {
+  stats->thread_cache_budget = g_tc_budget.load(std::memory_order_relaxed);
+  stats->thread_cache_budget_used =
+      g_tc_budget_used.load(std::memory_order_relaxed);
+  std::lock_guard locker(g_tc_registry_lock);
+  stats->thread_caches_scavenged = g_tc_scavenged;
+}
+
+#endif  // CBU_ALLOC_THREAD_CACHE_BUDGET
+
 }  // namespace cbu::alloc
 
 #endif  // !CBU_SINGLE_THREADED
+
+namespace cbu::alloc {
+
+bool set_thread_cache_budget(size_t bytes) noexcept {
+#ifdef CBU_ALLOC_THREAD_CACHE_BUDGET
+  g_tc_budget.store(bytes, std::memory_order_relaxed);
+  return true;
+#else
+  (void)bytes;
+  return false;
+#endif
+}
+
+}  // namespace cbu::alloc
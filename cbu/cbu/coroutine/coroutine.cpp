@@ -30,6 +30,7 @@
 
 #include "coroutine.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -40,24 +41,52 @@
 #include <utility>
 
 #include "cbu/common/byte_size.h"
+#include "cbu/common/heapq.h"
+#include "cbu/coroutine/runtime.h"
 #include "cbu/coroutine/syscall_hook.h"
+#include "cbu/fsyscall/fsyscall.h"
 
 namespace cbu {
 namespace coroutine {
+namespace {
+
+// Max number of events we fetch with one epoll_wait
+constexpr int kEpollBatch = 256;
+
+int timeout_until(std::chrono::steady_clock::time_point expire_time,
+                  std::chrono::steady_clock::time_point now) {
+  if (expire_time == IoWaitInfo::kNoExpireTime)
+    return -1;
+  if (now >= expire_time)
+    return 0;
+  // Plus 999999 nanoseconds so that we round up
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      expire_time - now + std::chrono::nanoseconds(999999)).count();
+}
+
+} // namespace
 
 __thread CoContainer* active_container = nullptr;
 
+// Never inlined, so that the thread pointer is loaded afresh on each call
+[[gnu::noinline]] CoContainer* CurrentContainer() noexcept {
+  return active_container;
+}
+
 void Stack::Allocate(size_t sentinel_size, size_t stack_size) {
   size_t total_size = sentinel_size + stack_size;
 
   // Don't use MAP_GROWSDOWN - that actually allows almost unlimited stack size
-  sentinel_ = mmap(
+  // Pages are committed only when touched, so don't reserve swap for them.
+  void* p = mmap(
       nullptr, total_size,
-      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE,
       -1, 0);
-  if (sentinel_ == nullptr) {
+  if (p == MAP_FAILED) {
     throw std::bad_alloc();
   }
+  sentinel_ = p;
   if (sentinel_size) {
     mprotect(sentinel_, sentinel_size, PROT_NONE);
   }
@@ -74,7 +103,18 @@ void Stack::Deallocate() noexcept {
   }
 }
 
+void Stack::Discard() noexcept {
+  if (lo_ != nullptr)
+    madvise(lo_, byte_distance(lo_, hi_), MADV_DONTNEED);
+}
+
 CoContainer::CoContainer(Attr attr) : attr_(attr) {
+  attr_.stack_pool_high_water = std::min(attr_.stack_pool_high_water,
+                                         attr_.stack_pool_size);
+  stack_pool_.reserve(attr_.stack_pool_high_water);
+  stack_pool_cold_.reserve(attr_.stack_pool_size -
+                           attr_.stack_pool_high_water);
+
   // Push scheduler as the 0-th coroutine
   std::unique_ptr<CoRoutine> scheduler(new CoRoutine);
   scheduler->status = Status::RUNNING;
@@ -82,6 +122,10 @@ CoContainer::CoContainer(Attr attr) : attr_(attr) {
 }
 
 CoId CoContainer::Register(CoFunc func) {
+  if (runtime_ != nullptr) {
+    runtime_->Spawn(std::move(func));
+    return 0;
+  }
   size_t id = co_list_.size();
   co_list_.push_back(MakeCoRoutine(id, std::move(func)));
   ready_list_.push(id);
@@ -92,76 +136,179 @@ void CoContainer::Run() {
   if (co_list_.size() <= 1)
     return;
 
-  active_container = this;
+  StartIo();
+
+  // Number of coroutines left to run in this round
+  size_t round_left = 0;
 
   for (;;) {
     size_t run_idx = 0;
 
+    if (round_left == 0 && !ready_list_.empty()) {
+      // Start of a new round.  Submit io_uring requests queued in the last
+      // round with one io_uring_enter, and pick up completions.
+      FlushUring();
+      round_left = ready_list_.size();
+    }
+
     if (!ready_list_.empty()) {
       run_idx = ready_list_.front();
       ready_list_.pop();
-    } else if (!io_wait_list_.empty()) {
+      --round_left;
+    } else if (!io_wait_list_.empty() || io_wait_count_ != 0 ||
+               uring_.inflight() != 0) {
       DoPoll();
       // When DoPoll returns, ready_list_ should not be empty
       run_idx = ready_list_.front();
       ready_list_.pop();
+      round_left = ready_list_.size();
     }
 
     if (run_idx == 0)
       break;
 
-    CoRoutine* coroutine = co_list_[run_idx].get();
-    coroutine->status = Status::RUNNING;
-    current_id_ = run_idx;
-    SwitchContext(co_list_[0].get(), coroutine);
+    Resume(run_idx);
+  }
 
-    // Clean up finished coroutines
-    if (coroutine->status == Status::DONE) {
-      for (CoId id: coroutine->waited_by) {
-        co_list_[id]->status = Status::READY;
-        ready_list_.push(id);
-      }
-      co_list_[run_idx].reset();
-    }
+  StopIo();
+  co_list_.resize(1);
+}
+
+void CoContainer::StartIo() {
+  active_container = this;
+
+  if (attr_.io_backend == IoBackend::EPOLL) {
+    int fd = fsys_epoll_create1(EPOLL_CLOEXEC);
+    // If epoll isn't available, we silently fall back to poll
+    if (!fsys_failure(fd))
+      epfd_ = fd;
+  }
+
+  if (attr_.io_uring_entries != 0 && uring_.Init(attr_.io_uring_entries) &&
+      epfd_ >= 0) {
+    // The ring fd becomes readable when there are completions
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = uring_.fd();
+    fsys_epoll_ctl(epfd_, EPOLL_CTL_ADD, uring_.fd(), &event);
+  }
+
+  if (wake_fd_ >= 0 && epfd_ >= 0) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd_;
+    fsys_epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &event);
   }
+}
 
+void CoContainer::StopIo() {
   active_container = nullptr;
 
-  co_list_.resize(1);
+  uring_.Destroy();
+  if (epfd_ >= 0) {
+    fsys_close(epfd_);
+    epfd_ = -1;
+  }
+  fd_waiters_.clear();
 }
 
-// Poll all io-waiting coroutines, and move io-ready ones to ready list
+void CoContainer::Resume(CoId id) {
+  CoRoutine* coroutine = co_list_[id].get();
+  coroutine->status = Status::RUNNING;
+  current_id_ = id;
+  SwitchContext(co_list_[0].get(), coroutine);
+
+  // Clean up finished coroutines
+  if (coroutine->status == Status::DONE) {
+    for (CoId waiter: coroutine->waited_by) {
+      co_list_[waiter]->status = Status::READY;
+      ready_list_.push(waiter);
+    }
+    ReleaseStack(std::move(coroutine->stack));
+    co_list_[id].reset();
+    if (runtime_ != nullptr) {
+      free_ids_.push_back(id);
+      runtime_->Finished();
+    }
+  }
+}
+
+CoRoutine* CoContainer::Detach(CoId id) {
+  free_ids_.push_back(id);
+  return co_list_[id].release();
+}
+
+CoId CoContainer::Attach(CoRoutine* coroutine) {
+  CoId id;
+  if (!free_ids_.empty()) {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+    co_list_[id].reset(coroutine);
+  } else {
+    id = co_list_.size();
+    co_list_.emplace_back(coroutine);
+  }
+  coroutine->id = id;
+  return id;
+}
+
+// Wait for IO or timeout, and move io-ready coroutines to ready list
 void CoContainer::DoPoll() {
+  if (uring_.inflight() != 0) {
+    // Submit queued requests.  If nothing else can wake us up, also wait for
+    // a completion, all with a single io_uring_enter.
+    bool others = !io_wait_list_.empty() || io_wait_count_ != 0 ||
+        wake_fd_ >= 0;
+    for (;;) {
+      int r = uring_.Enter(others ? 0 : 1);
+      if (fsys_failure(r) && !fsys_errno(r, EINTR) && !fsys_errno(r, EBUSY) &&
+          !fsys_errno(r, EAGAIN)) {
+        fprintf(stderr, "io_uring_enter failed: %d\n", fsys_errno_val(r));
+        std::terminate();
+      }
+      ReapUring();
+      if (!ready_list_.empty())
+        return;
+      if (others)
+        break;
+    }
+  }
+
+  if (epfd_ >= 0)
+    DoEpoll();
+  else
+    DoSysPoll();
+}
+
+// Poll all io-waiting coroutines, and move io-ready ones to ready list
+void CoContainer::DoSysPoll() {
   for (;;) {
-    std::vector<pollfd> poll_fds;
+    auto now = std::chrono::steady_clock::now();
+    ExpireTimers(now);
+    if (!ready_list_.empty())
+      return;
 
-    std::chrono::steady_clock::time_point expire_time = \
-        IoWaitInfo::kNoExpireTime;
+    std::vector<pollfd> poll_fds;
     for (CoId id: io_wait_list_) {
-      auto* coroutine = co_list_[id].get();
-      auto& io_wait_info = coroutine->io_wait_info;
-      expire_time = std::min(expire_time, io_wait_info.expire_time);
+      auto& io_wait_info = co_list_[id]->io_wait_info;
       poll_fds.insert(poll_fds.end(),
                       io_wait_info.fds,
                       io_wait_info.fds + io_wait_info.nfds);
     }
-
-    int timeout_ms = -1;
-    if (expire_time < IoWaitInfo::kNoExpireTime) {
-      auto now = std::chrono::steady_clock::now();
-      if (now >= expire_time) {
-        timeout_ms = 0;
-      } else {
-        // Plus 999999 nanoseconds so that we round up
-        timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            expire_time - now + std::chrono::nanoseconds(999999)).count();
-      }
-    }
-    int ret = sys_poll(poll_fds.data(), poll_fds.size(), timeout_ms);
+    size_t uring_k = poll_fds.size();
+    if (uring_.inflight() != 0)
+      poll_fds.push_back({uring_.fd(), POLLIN, 0});
+    size_t wake_k = poll_fds.size();
+    if (wake_fd_ >= 0)
+      poll_fds.push_back({wake_fd_, POLLIN, 0});
+
+    int ret = sys_poll(poll_fds.data(), poll_fds.size(),
+                       timeout_until(next_expire_time(), now));
     if (ret < 0) {
       // This is not likely, but we need to handle them.
       for (CoId id: io_wait_list_) {
         auto* coroutine = co_list_[id].get();
+        RemoveTimer(coroutine);
         coroutine->status = Status::READY;
         coroutine->io_wait_info.ret = ret;
         ready_list_.push(id);
@@ -170,6 +317,11 @@ void CoContainer::DoPoll() {
       return;
     }
 
+    if (uring_.inflight() != 0 && poll_fds[uring_k].revents != 0)
+      ReapUring();
+    if (wake_fd_ >= 0 && poll_fds[wake_k].revents != 0)
+      DrainWakeFd();
+
     // Collect returned fd status
     std::map<int, uint16_t> revents_map;
     for (auto& item: poll_fds) {
@@ -197,17 +349,9 @@ void CoContainer::DoPoll() {
         }
       }
 
-      bool done = false;
       if (ready_count != 0) {
+        RemoveTimer(coroutine);
         io_wait_info.ret = ready_count;
-        done = true;
-      } else if (io_wait_info.expire_time < io_wait_info.kNoExpireTime &&
-                 std::chrono::steady_clock::now() >= io_wait_info.expire_time) {
-        io_wait_info.ret = 0;
-        done = true;
-      }
-
-      if (done) {
         coroutine->status = Status::READY;
         ready_list_.push(id);
         it = io_wait_list_.erase(it);
@@ -215,11 +359,300 @@ void CoContainer::DoPoll() {
         ++it;
       }
     }
+    if (!ready_list_.empty() || wakeup_)
+      return;
+  }
+}
+
+// Wait on the persistent epoll set.  Each ready event is mapped directly to
+// its waiters, so the cost is proportional to the number of ready events,
+// not to all io-waiting coroutines.
+void CoContainer::DoEpoll() {
+  epoll_event events[kEpollBatch];
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    ExpireTimers(now);
+    FinishWoken();
     if (!ready_list_.empty())
       return;
+
+    int n = fsys_epoll_wait(epfd_, events, kEpollBatch,
+                            timeout_until(next_expire_time(), now));
+    if (fsys_failure(n)) {
+      if (fsys_errno(n, EINTR))
+        continue;
+      fprintf(stderr, "epoll_wait failed: %d\n", fsys_errno_val(n));
+      std::terminate();
+    }
+
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == uring_.fd())
+        ReapUring();
+      else if (fd == wake_fd_)
+        DrainWakeFd();
+      else
+        EpollEvent(fd, events[i].events);
+    }
+    FinishWoken();
+
+    if (!ready_list_.empty() || wakeup_)
+      return;
   }
 }
 
+void CoContainer::EpollEvent(int fd, uint32_t events) {
+  auto& fw = fd_waiters_[fd];
+  bool wanted = false;
+  for (CoId id: fw.waiters) {
+    auto* coroutine = co_list_[id].get();
+    auto& io_wait_info = coroutine->io_wait_info;
+    for (size_t k = 0, m = io_wait_info.nfds; k < m; ++k) {
+      auto& item = io_wait_info.fds[k];
+      if (item.fd == fd) {
+        item.revents |= events & (item.events | POLLERR | POLLHUP | POLLNVAL);
+        if (item.revents != 0) {
+          wanted = true;
+          if (coroutine->status == Status::WAITING_IO)
+            MarkIoReady(coroutine);
+        }
+      }
+    }
+  }
+  if (wanted)
+    return;
+
+  // Nobody is waiting for this event any more.  Narrow the interest down to
+  // what current waiters need, or we'd be woken up again and again.
+  uint32_t interest = 0;
+  for (CoId id: fw.waiters) {
+    auto& io_wait_info = co_list_[id]->io_wait_info;
+    for (size_t k = 0, m = io_wait_info.nfds; k < m; ++k) {
+      if (io_wait_info.fds[k].fd == fd)
+        interest |= uint16_t(io_wait_info.fds[k].events);
+    }
+  }
+  if (fw.waiters.empty()) {
+    fsys_epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    fw.registered = false;
+    fw.events = 0;
+  } else if (interest != fw.events) {
+    epoll_event event;
+    event.events = interest;
+    event.data.fd = fd;
+    fsys_epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &event);
+    fw.events = interest;
+  }
+}
+
+// Make sure fd is in the epoll set with (at least) events, and record id as
+// a waiter.  Interest is left in place after the wait is over, so that
+// waiting on the same fd again is a MOD rather than a DEL and an ADD.
+//
+// The syscall is issued on every wait, even if our record says the interest
+// is there: fd may have been closed without our knowledge (fclose, dup2,
+// raw close syscalls), and its number reused for a file not in the set.
+bool CoContainer::EpollWatch(int fd, uint32_t events, CoId id) {
+  if (size_t(fd) >= fd_waiters_.size())
+    fd_waiters_.resize(fd + 1);
+  if (runtime_ != nullptr)
+    runtime_->NoteFd(worker_index_, fd);
+  auto& fw = fd_waiters_[fd];
+  uint32_t interest = fw.events | events;
+  epoll_event event;
+  event.events = interest;
+  event.data.fd = fd;
+  int op = fw.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  int r = fsys_epoll_ctl(epfd_, op, fd, &event);
+  // Our record is stale if fd was closed without our knowledge
+  if (fsys_errno(r, ENOENT))
+    r = fsys_epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event);
+  else if (fsys_errno(r, EEXIST))
+    r = fsys_epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &event);
+  if (fsys_failure(r)) {
+    errno = fsys_errno_val(r);
+    return false;
+  }
+  fw.registered = true;
+  fw.events = interest;
+  fw.waiters.push_back(id);
+  return true;
+}
+
+void CoContainer::EpollUnwatch(const pollfd* fds, nfds_t nfds,
+                               CoId id) noexcept {
+  for (nfds_t k = 0; k < nfds; ++k) {
+    int fd = fds[k].fd;
+    if (fd < 0 || size_t(fd) >= fd_waiters_.size())
+      continue;
+    auto& waiters = fd_waiters_[fd].waiters;
+    auto it = std::find(waiters.begin(), waiters.end(), id);
+    if (it != waiters.end()) {
+      *it = waiters.back();
+      waiters.pop_back();
+    }
+  }
+}
+
+// The coroutine is removed from fd_waiters_ and timers_ by FinishWoken at
+// the end of the batch, so that multiple events on it are merged.
+void CoContainer::MarkIoReady(CoRoutine* coroutine) {
+  coroutine->status = Status::READY;
+  ready_list_.push(coroutine->id);
+  woken_.push_back(coroutine);
+  --io_wait_count_;
+}
+
+// This is not left to the coroutine itself when it resumes, because with
+// CoRuntime it may resume in another container.
+void CoContainer::FinishWoken() noexcept {
+  for (CoRoutine* coroutine: woken_) {
+    auto& io_wait_info = coroutine->io_wait_info;
+    EpollUnwatch(io_wait_info.fds, io_wait_info.nfds, coroutine->id);
+    RemoveTimer(coroutine);
+    int ready_count = 0;
+    for (nfds_t k = 0; k < io_wait_info.nfds; ++k) {
+      if (io_wait_info.fds[k].revents != 0)
+        ++ready_count;
+    }
+    io_wait_info.ret = ready_count;
+  }
+  woken_.clear();
+}
+
+void CoContainer::DrainWakeFd() noexcept {
+  uint64_t value;
+  fsys_read(wake_fd_, &value, sizeof(value));
+  wakeup_ = true;
+}
+
+void CoContainer::AddTimer(CoRoutine* coroutine,
+                           std::chrono::steady_clock::time_point expire_time) {
+  coroutine->io_wait_info.timer_index = timers_.size();
+  timers_.push_back({expire_time, coroutine});
+  heapq_adjust_tail(timers_, TimerLess(), TimerPositioner());
+}
+
+void CoContainer::RemoveTimer(CoRoutine* coroutine) noexcept {
+  size_t k = std::exchange(coroutine->io_wait_info.timer_index,
+                           IoWaitInfo::kNoTimer);
+  if (k != IoWaitInfo::kNoTimer)
+    heapq_remove(timers_, k, TimerLess(), TimerPositioner());
+}
+
+// Wake up io-waiting coroutines whose timeouts have expired
+void CoContainer::ExpireTimers(std::chrono::steady_clock::time_point now) {
+  while (!timers_.empty() && timers_[0].expire_time <= now) {
+    CoRoutine* coroutine = timers_[0].coroutine;
+    coroutine->io_wait_info.timer_index = IoWaitInfo::kNoTimer;
+    heapq_pop(timers_, TimerLess(), TimerPositioner());
+    if (epfd_ >= 0) {
+      MarkIoReady(coroutine);
+    } else {
+      coroutine->io_wait_info.ret = 0;
+      io_wait_list_.erase(coroutine->id);
+      coroutine->status = Status::READY;
+      ready_list_.push(coroutine->id);
+    }
+  }
+}
+
+void CoContainer::FlushUring() {
+  if (uring_.inflight() != 0) {
+    uring_.Enter(0);
+    ReapUring();
+  }
+}
+
+// Returns an SQE even if the SQ ring is full.  GetSqe has tried to submit
+// what's queued; if the kernel took nothing, completions are backed up
+// (EBUSY), so reap them and try again.
+io_uring_sqe* CoContainer::GetSqeNoFail() {
+  for (;;) {
+    if (io_uring_sqe* sqe = uring_.GetSqe())
+      return sqe;
+    ReapUring();
+  }
+}
+
+void CoContainer::ReapUring() {
+  uring_.Reap([this](uint64_t id, int res) {
+    auto* coroutine = co_list_[id].get();
+    int fd = coroutine->io_wait_info.uring_fd;
+    auto& waiters = fd_waiters_[fd].uring_waiters;
+    auto it = std::find(waiters.begin(), waiters.end(), CoId(id));
+    *it = waiters.back();
+    waiters.pop_back();
+    coroutine->io_wait_info.ret = res;
+    coroutine->status = Status::READY;
+    ready_list_.push(id);
+  });
+}
+
+io_uring_sqe* CoContainer::GetSqe() {
+  if (current_id_ == 0 || !uring_.available())
+    return nullptr;
+  return uring_.GetSqe();
+}
+
+int CoContainer::WaitSqe(io_uring_sqe* sqe) {
+  auto* coroutine = co_list_[current_id_].get();
+  int fd = sqe->fd;
+  if (size_t(fd) >= fd_waiters_.size())
+    fd_waiters_.resize(fd + 1);
+  if (runtime_ != nullptr)
+    runtime_->NoteFd(worker_index_, fd);
+  fd_waiters_[fd].uring_waiters.push_back(current_id_);
+  coroutine->io_wait_info.uring_fd = fd;
+  sqe->user_data = current_id_;
+  SwitchToScheduler(Status::WAITING_URING);
+  return coroutine->io_wait_info.ret;
+}
+
+void CoContainer::ForgetFd(int fd) {
+  ForgetFdLocally(fd);
+  // Coroutines in other workers may be waiting on fd, too
+  if (runtime_ != nullptr && fd >= 0 && current_id_ != 0)
+    runtime_->ForgetFd(*this, fd);
+}
+
+void CoContainer::ForgetFdLocally(int fd) {
+  if (fd < 0 || size_t(fd) >= fd_waiters_.size())
+    return;
+  auto& fw = fd_waiters_[fd];
+  if (!fw.uring_waiters.empty()) {
+    // Requests on fd hold a reference to the file, so cancel them before it's
+    // closed.  They complete with -ECANCELED.  We cancel them one by one by
+    // user_data; IORING_ASYNC_CANCEL_FD needs Linux 5.19.
+    // Copy the ids: GetSqeNoFail may reap completions, which modifies
+    // uring_waiters.
+    std::vector<CoId> ids = fw.uring_waiters;
+    for (CoId id: ids) {
+      io_uring_sqe* sqe = GetSqeNoFail();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = id;
+    }
+    uring_.Enter(0);
+  }
+  if (fw.registered)
+    fsys_epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+  // Like poll, report POLLNVAL to coroutines still waiting on it
+  for (CoId id: fw.waiters) {
+    auto* coroutine = co_list_[id].get();
+    auto& io_wait_info = coroutine->io_wait_info;
+    for (size_t k = 0, m = io_wait_info.nfds; k < m; ++k) {
+      if (io_wait_info.fds[k].fd == fd)
+        io_wait_info.fds[k].revents |= POLLNVAL;
+    }
+    if (coroutine->status == Status::WAITING_IO)
+      MarkIoReady(coroutine);
+  }
+  fw.waiters.clear();
+  fw.registered = false;
+  fw.events = 0;
+  FinishWoken();
+}
+
 void CoContainer::Yield() {
   SwitchToScheduler(Status::READY);
 }
@@ -241,24 +674,58 @@ int CoContainer::Poll(pollfd* fds, nfds_t nfds, int timeout_ms) {
       return ret;
   }
 
-  // Push coroutine to io-waiting list
+  auto expire_time = IoWaitInfo::kNoExpireTime;
+  if (timeout_ms >= 0) {
+    expire_time = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+  }
+  return WaitIo(fds, nfds, expire_time);
+}
+
+void CoContainer::SleepFor(std::chrono::steady_clock::duration duration) {
+  if (duration > duration.zero())
+    WaitIo(nullptr, 0, std::chrono::steady_clock::now() + duration);
+}
+
+void CoContainer::SleepUntil(std::chrono::steady_clock::time_point time) {
+  if (time > std::chrono::steady_clock::now())
+    WaitIo(nullptr, 0, time);
+}
+
+// Push coroutine to io-waiting list, with a timer if expire_time is given
+int CoContainer::WaitIo(pollfd* fds, nfds_t nfds,
+                        std::chrono::steady_clock::time_point expire_time) {
   auto* coroutine = co_list_[current_id_].get();
-  coroutine->io_wait_info.fds = fds;
-  coroutine->io_wait_info.nfds = nfds;
+  auto& io_wait_info = coroutine->io_wait_info;
+  io_wait_info.fds = fds;
+  io_wait_info.nfds = nfds;
+
+  if (epfd_ < 0) {
+    if (expire_time != IoWaitInfo::kNoExpireTime)
+      AddTimer(coroutine, expire_time);
+    SwitchToScheduler(Status::WAITING_IO);
+    return io_wait_info.ret;
+  }
 
-  if (timeout_ms < 0) {
-    coroutine->io_wait_info.expire_time = IoWaitInfo::kNoExpireTime;
-  } else {
-    coroutine->io_wait_info.expire_time = std::chrono::steady_clock::now() +
-      std::chrono::milliseconds(timeout_ms);
+  // The non-waiting poll above has cleared all revents
+  CoId id = coroutine->id;
+  for (nfds_t k = 0; k < nfds; ++k) {
+    if (fds[k].fd >= 0 &&
+        !EpollWatch(fds[k].fd, uint16_t(fds[k].events), id)) {
+      EpollUnwatch(fds, k, id);
+      return -1;
+    }
   }
+  if (expire_time != IoWaitInfo::kNoExpireTime)
+    AddTimer(coroutine, expire_time);
+  ++io_wait_count_;
 
   SwitchToScheduler(Status::WAITING_IO);
-  return coroutine->io_wait_info.ret;
+  return io_wait_info.ret;
 }
 
 bool CoContainer::WaitFor(CoId other_id) {
-  if (current_id_ == 0)
+  if (current_id_ == 0 || runtime_ != nullptr)
     return false;
   if (other_id == 0 || other_id >= co_list_.size() || other_id == current_id_)
     return false;
@@ -288,7 +755,8 @@ void CoContainer::SwitchToScheduler(Status new_status) {
       ready_list_.push(current_id);
       break;
     case Status::WAITING_IO:
-      io_wait_list_.insert(current_id);
+      if (epfd_ < 0)
+        io_wait_list_.insert(current_id);
       break;
     default:
       break;
@@ -308,7 +776,7 @@ void CoContainer::CoRoutineWrapper(CoFunc& func) {
     fprintf(stderr, "Coroutine throws unknown exception\n");
     std::terminate();
   }
-  active_container->SwitchToScheduler(Status::DONE);
+  CurrentContainer()->SwitchToScheduler(Status::DONE);
   __builtin_trap();
 }
 
@@ -317,7 +785,7 @@ std::unique_ptr<CoRoutine> CoContainer::MakeCoRoutine(
   std::unique_ptr<CoRoutine> coroutine(new CoRoutine);
   coroutine->id = id;
   coroutine->func = std::move(func);
-  coroutine->stack.Allocate(attr_.stack_sentinel_size, attr_.stack_size);
+  coroutine->stack = AcquireStack();
 
   // x86-64 ABI expects stack to be aligned to 16 bytes *before* calling
   // a function, so we subtract by 8.
@@ -329,6 +797,33 @@ std::unique_ptr<CoRoutine> CoContainer::MakeCoRoutine(
   return coroutine;
 }
 
+// Reuse a pooled stack if possible, which costs no syscall if it's hot
+Stack CoContainer::AcquireStack() {
+  Stack stack;
+  if (!stack_pool_.empty()) {
+    stack = std::move(stack_pool_.back());
+    stack_pool_.pop_back();
+  } else if (!stack_pool_cold_.empty()) {
+    stack = std::move(stack_pool_cold_.back());
+    stack_pool_cold_.pop_back();
+  } else {
+    stack.Allocate(attr_.stack_sentinel_size, attr_.stack_size);
+  }
+  return stack;
+}
+
+// Both pools have reserved capacity, so push_back doesn't throw
+void CoContainer::ReleaseStack(Stack&& stack) noexcept {
+  if (stack_pool_.size() < attr_.stack_pool_high_water) {
+    stack_pool_.push_back(std::move(stack));
+  } else if (stack_pool_cold_.size() <
+             attr_.stack_pool_size - attr_.stack_pool_high_water) {
+    stack.Discard();
+    stack_pool_cold_.push_back(std::move(stack));
+  }
+  // Otherwise, stack is unmapped on destruction
+}
+
 } // namespace coroutine
 } // namespace cbu
 
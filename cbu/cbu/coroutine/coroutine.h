@@ -39,6 +39,8 @@
 #include <set>
 #include <vector>
 
+#include "cbu/coroutine/uring.h"
+
 namespace cbu {
 namespace coroutine {
 
@@ -58,7 +60,9 @@ enum struct Status: unsigned char {
   READY,  // Ready to continue running
   RUNNING,  // Currently running
   WAITING_IO,  // Waiting for IO
+  WAITING_URING,  // Waiting for an io_uring request to complete
   WAITING_OTHER,  // Waiting for another coroutine to finish
+  WAITING_WORKERS,  // Waiting for other workers of CoRuntime
   DONE,  // Exited
 };
 
@@ -71,12 +75,23 @@ using CoFunc = std::function<void()>;
 class Stack {
  public:
   Stack() = default;
-  Stack(const Stack&) = delete;
-  Stack& operator=(const Stack&) = delete;
+  Stack(Stack&& other) noexcept { swap(other); }
+  Stack& operator=(Stack&& other) noexcept {
+    swap(other);
+    return *this;
+  }
   ~Stack() { Deallocate(); }
 
   void Allocate(size_t sentinel_size, size_t stack_size);
   void Deallocate() noexcept;
+  // Give back physical memory, but keep the mapping
+  void Discard() noexcept;
+
+  void swap(Stack& other) noexcept {
+    std::swap(sentinel_, other.sentinel_);
+    std::swap(lo_, other.lo_);
+    std::swap(hi_, other.hi_);
+  }
 
   void* sentinel() const noexcept { return sentinel_; }
   void* lo() const noexcept { return lo_; }
@@ -91,11 +106,13 @@ class Stack {
 struct IoWaitInfo {
   static constexpr auto kNoExpireTime = \
       std::chrono::steady_clock::time_point::max();
-  std::chrono::steady_clock::time_point expire_time = kNoExpireTime;
+  static constexpr size_t kNoTimer = size_t(-1);
+  size_t timer_index = kNoTimer;  // Index in CoContainer::timers_
 
   pollfd* fds = nullptr;
   nfds_t nfds = 0;
-  int ret = -1;  // Return value of poll
+  int ret = -1;  // Return value of poll, or result of io_uring request
+  int uring_fd = -1;  // Only useful if status == Status::WAITING_URING
 };
 
 struct CoRoutine {
@@ -110,15 +127,39 @@ struct CoRoutine {
   std::vector<CoId> waited_by;  // Who's waiting for me?
 };
 
+enum struct IoBackend: unsigned char {
+  POLL,  // Rebuild a poll set from all waiters on each scheduling round
+  EPOLL,  // Persistent epoll interest; falls back to POLL if unavailable
+};
+
 struct Attr {
   size_t stack_size = 64 * 1024;
   size_t stack_sentinel_size = 8192;
+  // Stacks of finished coroutines are kept for reuse, up to this number
+  size_t stack_pool_size = 1024;
+  // Pooled stacks beyond this number are released with MADV_DONTNEED
+  size_t stack_pool_high_water = 128;
+  IoBackend io_backend = IoBackend::EPOLL;
+  // If nonzero, hooked read/write/recv/send on blocking fds are executed
+  // on an io_uring of this size (if the kernel supports it)
+  unsigned io_uring_entries = 0;
+};
+
+// Per-fd state of the epoll backend and io_uring
+struct FdWaiters {
+  uint32_t events = 0;  // Events currently registered in the epoll set
+  bool registered = false;
+  std::vector<CoId> uring_waiters;  // With io_uring requests on this fd
+  std::vector<CoId> waiters;  // Coroutines polling this fd
 };
 
+class CoRuntime;
+
 class CoContainer {
  public:
   explicit CoContainer(Attr attr = {});
 
+  // In a worker of CoRuntime, this spawns func on the runtime and returns 0
   CoId Register(CoFunc func);
 
   void Run();
@@ -128,12 +169,56 @@ class CoContainer {
   // The following cannot be called from the main coroutine
   void Yield();
   int Poll(pollfd* fds, nfds_t nfds, int timeout_ms = -1);
-  bool WaitFor(CoId other_id);
+  void SleepFor(std::chrono::steady_clock::duration duration);
+  void SleepUntil(std::chrono::steady_clock::time_point time);
+  bool WaitFor(CoId other_id);  // Not supported in CoRuntime
+
+  // Called before fd is closed, so that the epoll backend forgets it
+  void ForgetFd(int fd);
+
+  // Returns a zeroed SQE for the current coroutine, or nullptr if io_uring
+  // isn't in use or is at capacity (then fall back to Poll).
+  io_uring_sqe* GetSqe();
+  // Park the current coroutine until the request completes, and return the
+  // result (-errno on failure).  The SQE is submitted in batch.
+  int WaitSqe(io_uring_sqe* sqe);
 
  private:
+  friend class CoRuntime;
+
+  void ForgetFdLocally(int fd);
+  void StartIo();
+  void StopIo();
+  void Resume(CoId id);
   void DoPoll();
+  int WaitIo(pollfd* fds, nfds_t nfds,
+             std::chrono::steady_clock::time_point expire_time);
+  void AddTimer(CoRoutine* coroutine,
+                std::chrono::steady_clock::time_point expire_time);
+  void RemoveTimer(CoRoutine* coroutine) noexcept;
+  void ExpireTimers(std::chrono::steady_clock::time_point now);
+  std::chrono::steady_clock::time_point next_expire_time() const noexcept {
+    return timers_.empty() ? IoWaitInfo::kNoExpireTime :
+        timers_[0].expire_time;
+  }
+  void DoSysPoll();
+  void DoEpoll();
+  bool EpollWatch(int fd, uint32_t events, CoId id);
+  void EpollUnwatch(const pollfd* fds, nfds_t nfds, CoId id) noexcept;
+  void EpollEvent(int fd, uint32_t events);
+  void MarkIoReady(CoRoutine* coroutine);
+  void FinishWoken() noexcept;
+  void DrainWakeFd() noexcept;
+  void FlushUring();
+  io_uring_sqe* GetSqeNoFail();
+  void ReapUring();
   std::unique_ptr<CoRoutine> MakeCoRoutine(CoId id, CoFunc func);
+  Stack AcquireStack();
+  void ReleaseStack(Stack&& stack) noexcept;
   void SwitchToScheduler(Status new_status);
+  // Move a ready coroutine out of or into co_list_ (CoRuntime only)
+  CoRoutine* Detach(CoId id);
+  CoId Attach(CoRoutine* coroutine);
 
   [[noreturn]] static void CoRoutineWrapper(CoFunc& func);
 
@@ -142,25 +227,76 @@ class CoContainer {
   CoId current_id_ = 0;
   std::vector<std::unique_ptr<CoRoutine>> co_list_;
   std::queue<CoId> ready_list_;
-  std::set<CoId> io_wait_list_;
+  std::set<CoId> io_wait_list_;  // POLL backend only
+
+  // Stacks for reuse.  Those in stack_pool_ are still committed; those in
+  // stack_pool_cold_ have been discarded.
+  std::vector<Stack> stack_pool_;
+  std::vector<Stack> stack_pool_cold_;
+
+  // EPOLL backend only
+  int epfd_ = -1;
+  size_t io_wait_count_ = 0;
+  // Woken up in the current batch, but still in fd_waiters_ and timers_
+  std::vector<CoRoutine*> woken_;
+
+  // Min-heap of timeouts of io-waiting coroutines
+  struct Timer {
+    std::chrono::steady_clock::time_point expire_time;
+    CoRoutine* coroutine;
+  };
+  struct TimerLess {
+    bool operator()(const Timer& a, const Timer& b) const noexcept {
+      return a.expire_time < b.expire_time;
+    }
+  };
+  struct TimerPositioner {
+    void operator()(Timer& timer, size_t k) const noexcept {
+      timer.coroutine->io_wait_info.timer_index = k;
+    }
+  };
+  std::vector<Timer> timers_;
+
+  Uring uring_;
+  std::vector<FdWaiters> fd_waiters_;  // Indexed by fd
+
+  // Only for workers of CoRuntime
+  CoRuntime* runtime_ = nullptr;
+  unsigned worker_index_ = 0;
+  int wake_fd_ = -1;  // eventfd written by other workers to wake us up
+  bool wakeup_ = false;  // Set when DoPoll is interrupted through wake_fd_
+  std::vector<CoId> free_ids_;  // Detached ids are reused
 };
 
 // thread_local generates longer code in non-LTO builds
 extern __thread CoContainer* active_container;
 
+// Coroutines of CoRuntime may resume on another thread after any switch,
+// but the compiler may reuse the thread pointer it loaded before.  Code that
+// may run after a switch must find its container with this function.
+CoContainer* CurrentContainer() noexcept;
+
 void SwitchContext(CoRoutine* from, const CoRoutine* to) noexcept
   asm("cbu_coroutine_switch_context");
 
 inline void Yield() {
-  active_container->Yield();
+  CurrentContainer()->Yield();
 }
 
 inline CoId Self() {
-  return active_container->Self();
+  return CurrentContainer()->Self();
+}
+
+inline void SleepFor(std::chrono::steady_clock::duration duration) {
+  CurrentContainer()->SleepFor(duration);
+}
+
+inline void SleepUntil(std::chrono::steady_clock::time_point time) {
+  CurrentContainer()->SleepUntil(time);
 }
 
 inline bool WaitFor(CoId other_id) {
-  return active_container->WaitFor(other_id);
+  return CurrentContainer()->WaitFor(other_id);
 }
 
 } // namespace coroutine
@@ -0,0 +1,169 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Scheduling cost with many idle connections: kIdle coroutines block reading
+// socketpairs that never become ready, while kActive pairs of coroutines
+// ping-pong one byte kRounds times.  With the poll backend, every wakeup
+// rebuilds and scans a poll set of all waiters; with epoll, it costs
+// O(ready events).  With io_uring, each read/write is submitted in batch
+// instead of a readiness wait followed by the syscall.
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <vector>
+
+#include "cbu/coroutine/coroutine.h"
+
+namespace cbu {
+namespace coroutine {
+namespace {
+
+constexpr unsigned kIdle = 10000;
+constexpr unsigned kActive = 100;
+constexpr unsigned kRounds = 1000;
+
+struct SocketPair {
+  int fds[2];
+};
+
+std::vector<SocketPair> make_pairs(unsigned n) {
+  std::vector<SocketPair> res(n);
+  for (auto& pair: res) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair.fds) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+  }
+  return res;
+}
+
+double run(IoBackend backend, unsigned io_uring_entries, unsigned idle_count) {
+  std::vector<SocketPair> idle = make_pairs(idle_count);
+  std::vector<SocketPair> active = make_pairs(kActive);
+
+  Attr attr;
+  attr.stack_size = 16 * 1024;
+  attr.stack_sentinel_size = 4096;
+  attr.io_backend = backend;
+  attr.io_uring_entries = io_uring_entries;
+  CoContainer cont(attr);
+
+  for (auto& pair: idle) {
+    cont.Register([&pair] {
+      char c;
+      // Returns 0 once the other end is closed
+      while (read(pair.fds[0], &c, 1) > 0) {
+      }
+    });
+  }
+
+  std::vector<CoId> clients;
+  for (auto& pair: active) {
+    cont.Register([&pair] {
+      char c;
+      for (unsigned i = 0; i < kRounds; ++i) {
+        if (read(pair.fds[1], &c, 1) != 1 || write(pair.fds[1], &c, 1) != 1)
+          break;
+      }
+    });
+    clients.push_back(cont.Register([&pair] {
+      char c = 'x';
+      for (unsigned i = 0; i < kRounds; ++i) {
+        if (write(pair.fds[0], &c, 1) != 1 || read(pair.fds[0], &c, 1) != 1)
+          break;
+      }
+    }));
+  }
+
+  double seconds = 0;
+  cont.Register([&] {
+    auto start = std::chrono::steady_clock::now();
+    for (CoId id: clients)
+      WaitFor(id);
+    seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    // Release the idle readers
+    for (auto& pair: idle)
+      close(pair.fds[1]);
+  });
+
+  cont.Run();
+
+  for (auto& pair: idle)
+    close(pair.fds[0]);
+  for (auto& pair: active) {
+    close(pair.fds[0]);
+    close(pair.fds[1]);
+  }
+  return seconds;
+}
+
+} // namespace
+} // namespace coroutine
+} // namespace cbu
+
+int main() {
+  using namespace cbu::coroutine;
+
+  // Use fewer idle connections if we can't have enough fds
+  unsigned idle_count = kIdle;
+  rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (kIdle + kActive) * 2 + 64)
+      idle_count = (rl.rlim_cur - kActive * 2 - 64) / 2;
+  }
+
+  double t_epoll = run(IoBackend::EPOLL, 0, idle_count);
+  double t_uring = run(IoBackend::EPOLL, 16384, idle_count);
+  double t_poll = run(IoBackend::POLL, 0, idle_count);
+  constexpr double kRoundTrips = double(kActive) * kRounds;
+  printf("%u idle + %u active socketpairs, %u round trips each\n",
+         idle_count, kActive, kRounds);
+  printf("%10s %10s %14s\n", "", "seconds", "round trips/s");
+  printf("%10s %10.3f %14.0f\n", "epoll:", t_epoll, kRoundTrips / t_epoll);
+  printf("%10s %10.3f %14.0f\n", "io_uring:", t_uring, kRoundTrips / t_uring);
+  printf("%10s %10.3f %14.0f\n", "poll:", t_poll, kRoundTrips / t_poll);
+  return 0;
+}
+
+#else
+
+int main() {
+  return 0;
+}
+
+#endif
@@ -28,13 +28,21 @@
 
 #if defined __x86_64__ && !defined __LP64__
 
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <vector>
 #include "coroutine.h"
+#include "runtime.h"
 
 namespace cbu {
 namespace coroutine {
@@ -94,6 +102,99 @@ TEST(CoRoutineTest, Sleep_Multiple) {
   EXPECT_GT(0.7, seconds);
 }
 
+TEST(CoRoutineTest, Timers) {
+  for (IoBackend backend: {IoBackend::EPOLL, IoBackend::POLL}) {
+    int pipefds[2];
+    ASSERT_EQ(0, pipe(pipefds));
+    std::vector<int> order;
+    int poll_ret = -1;
+
+    Attr attr;
+    attr.io_backend = backend;
+    CoContainer cont(attr);
+
+    // Wake up in order of expire time, not of registration
+    for (int i = 0; i < 20; ++i) {
+      int ms = (i * 7) % 20 * 5 + 10;
+      cont.Register([&order, ms] {
+        SleepFor(std::chrono::milliseconds(ms));
+        order.push_back(ms);
+      });
+    }
+    cont.Register([&] {
+      SleepUntil(std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(120));
+      order.push_back(120);
+    });
+    // IO completes before the timeout, which is then cancelled
+    cont.Register([&] {
+      pollfd fds[] = {{pipefds[0], POLLIN, 0}};
+      poll_ret = poll(fds, 1, 10000);
+    });
+    cont.Register([&] {
+      usleep(50000);
+      char c = 0;
+      ssize_t discard = write(pipefds[1], &c, 1);
+      (void)discard;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    cont.Run();
+    auto end = std::chrono::steady_clock::now();
+    auto seconds = std::chrono::duration<double>(end - start).count();
+    EXPECT_LE(0.12, seconds);
+    EXPECT_GT(0.3, seconds);
+
+    close(pipefds[0]);
+    close(pipefds[1]);
+    EXPECT_EQ(1, poll_ret);
+    ASSERT_EQ(21u, order.size());
+    EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+  }
+}
+
+TEST(CoRoutineTest, StackPool) {
+  constexpr uintptr_t kPageMask = ~uintptr_t(4095);
+  uintptr_t frames[4] = {};
+
+  Attr attr;
+  attr.stack_pool_size = 2;
+  attr.stack_pool_high_water = 1;
+  CoContainer cont(attr);
+  // All three are alive at the same time, and finish in order
+  for (int i = 0; i < 3; ++i) {
+    cont.Register([&, i] {
+      frames[i] = uintptr_t(__builtin_frame_address(0));
+      Yield();
+    });
+  }
+  cont.Run();
+
+  // The first stack is kept as is, the second one discarded, and the third
+  // one unmapped since the pool is full
+  auto mapped = [](uintptr_t page) {
+    return msync(reinterpret_cast<void*>(page), 4096, MS_ASYNC) == 0;
+  };
+  auto resident = [](uintptr_t page) {
+    unsigned char vec = 0;
+    return mincore(reinterpret_cast<void*>(page), 4096, &vec) == 0 &&
+        (vec & 1);
+  };
+  EXPECT_TRUE(mapped(frames[0] & kPageMask));
+  EXPECT_TRUE(resident(frames[0] & kPageMask));
+  EXPECT_TRUE(mapped(frames[1] & kPageMask));
+  EXPECT_FALSE(resident(frames[1] & kPageMask));
+  EXPECT_FALSE(mapped(frames[2] & kPageMask));
+
+  // A new coroutine gets the hot stack first
+  cont.Register([&] {
+    frames[3] = uintptr_t(__builtin_frame_address(0));
+    Yield();
+  });
+  cont.Run();
+  EXPECT_EQ(frames[0], frames[3]);
+}
+
 TEST(CoRoutineTest, PipeTest) {
   int pipefds[2];
   ASSERT_EQ(0, pipe(pipefds));
@@ -179,6 +280,233 @@ TEST(CoRoutineTest, EpollTest) {
   EXPECT_EQ(2554, res);
 }
 
+TEST(CoRoutineTest, PollBackend) {
+  int pipefds[2];
+  ASSERT_EQ(0, pipe(pipefds));
+  int res = 0;
+  int discard;
+
+  Attr attr;
+  attr.io_backend = IoBackend::POLL;
+  CoContainer cont(attr);
+
+  cont.Register([&]{
+    discard = read(pipefds[0], &res, sizeof(res));
+  });
+  cont.Register([&] {
+    usleep(100000);
+    int r = 2554;
+    discard = write(pipefds[1], &r, sizeof(r));
+  });
+  cont.Run();
+
+  close(pipefds[0]);
+  close(pipefds[1]);
+  EXPECT_EQ(2554, res);
+}
+
+TEST(CoRoutineTest, CloseWhileWaiting) {
+  int pipefds[2];
+  ASSERT_EQ(0, pipe(pipefds));
+  int ret = -1;
+  short revents = 0;
+
+  CoContainer cont;
+  cont.Register([&]{
+    pollfd fds[] = {{pipefds[0], POLLIN, 0}};
+    ret = poll(fds, 1, 1000);
+    revents = fds[0].revents;
+  });
+  cont.Register([&] {
+    usleep(50000);
+    close(pipefds[0]);
+  });
+  cont.Run();
+
+  close(pipefds[1]);
+  EXPECT_EQ(1, ret);
+  EXPECT_EQ(POLLNVAL, revents);
+}
+
+// fd is closed without the hook knowing, and its number is reused for
+// another pipe with the same interest
+TEST(CoRoutineTest, ReuseFdAfterUnhookedClose) {
+  int pipefds[2];
+  ASSERT_EQ(0, pipe(pipefds));
+  int old_fd = pipefds[0];
+  int ret1 = -1;
+  int ret2 = -1;
+
+  CoContainer cont;
+  cont.Register([&]{
+    pollfd fds[] = {{pipefds[0], POLLIN, 0}};
+    ret1 = poll(fds, 1, 1000);
+    char c;
+    ASSERT_EQ(1, read(pipefds[0], &c, 1));
+
+    syscall(SYS_close, pipefds[0]);
+    close(pipefds[1]);
+    ASSERT_EQ(0, pipe(pipefds));
+    ASSERT_EQ(old_fd, pipefds[0]);
+
+    fds[0] = {pipefds[0], POLLIN, 0};
+    ret2 = poll(fds, 1, 1000);
+  });
+  cont.Register([&] {
+    usleep(10000);
+    ASSERT_EQ(1, write(pipefds[1], "x", 1));
+    // Wait for the other coroutine to switch to the new pipe
+    usleep(10000);
+    ASSERT_EQ(1, write(pipefds[1], "y", 1));
+  });
+  cont.Run();
+
+  close(pipefds[0]);
+  close(pipefds[1]);
+  EXPECT_EQ(1, ret1);
+  EXPECT_EQ(1, ret2);
+}
+
+TEST(CoRoutineTest, IoUring) {
+  int sockfds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockfds));
+  char tmpname[] = "/tmp/coroutine_test.XXXXXX";
+  int filefd = mkstemp(tmpname);
+  ASSERT_LE(0, filefd);
+  unlink(tmpname);
+  int res = 0;
+  int file_res = 0;
+  ssize_t eof = -1;
+
+  Attr attr;
+  attr.io_uring_entries = 16;
+  CoContainer cont(attr);
+
+  cont.Register([&]{
+    if (read(sockfds[0], &res, sizeof(res)) == sizeof(res)) {
+      int r = res + 1;
+      ssize_t discard = write(filefd, &r, sizeof(r));
+      (void)discard;
+    }
+    char c;
+    eof = recv(sockfds[0], &c, 1, 0);
+  });
+  cont.Register([&] {
+    usleep(100000);
+    int r = 2554;
+    ssize_t discard = send(sockfds[1], &r, sizeof(r), 0);
+    (void)discard;
+    usleep(10000);
+    discard = pread(filefd, &file_res, sizeof(file_res), 0);
+    close(sockfds[1]);
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  cont.Run();
+  auto end = std::chrono::steady_clock::now();
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  EXPECT_LE(0.1, seconds);
+  EXPECT_GT(0.2, seconds);
+
+  close(sockfds[0]);
+  close(filefd);
+  EXPECT_EQ(2554, res);
+  EXPECT_EQ(2555, file_res);
+  EXPECT_EQ(0, eof);
+}
+
+// A blocking write or send more than the socket buffer holds still writes
+// everything, though io_uring completes them short
+TEST(CoRoutineTest, IoUringLongWrite) {
+  constexpr size_t kSize = 1024 * 1024;
+  int sockfds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockfds));
+  std::vector<char> out(kSize);
+  for (size_t i = 0; i < kSize; ++i)
+    out[i] = char(i * 7 + i / 4096);
+  std::vector<char> in;
+  ssize_t written = 0;
+  ssize_t sent = 0;
+
+  Attr attr;
+  attr.io_uring_entries = 16;
+  CoContainer cont(attr);
+  cont.Register([&]{
+    written = write(sockfds[1], out.data(), kSize);
+    sent = send(sockfds[1], out.data(), kSize, 0);
+    close(sockfds[1]);
+  });
+  cont.Register([&] {
+    // Let the writer fill the buffer first
+    usleep(10000);
+    char buffer[4096];
+    ssize_t r;
+    while ((r = read(sockfds[0], buffer, sizeof(buffer))) > 0)
+      in.insert(in.end(), buffer, buffer + r);
+  });
+  cont.Run();
+
+  close(sockfds[0]);
+  EXPECT_EQ(ssize_t(kSize), written);
+  EXPECT_EQ(ssize_t(kSize), sent);
+  ASSERT_EQ(kSize * 2, in.size());
+  EXPECT_TRUE(std::equal(out.begin(), out.end(), in.begin()));
+  EXPECT_TRUE(std::equal(out.begin(), out.end(), in.begin() + kSize));
+}
+
+TEST(CoRoutineTest, IoUringCloseWhileReading) {
+  int pipefds[2];
+  ASSERT_EQ(0, pipe(pipefds));
+  ssize_t ret = 0;
+  int err = 0;
+
+  Attr attr;
+  attr.io_uring_entries = 16;
+  CoContainer cont(attr);
+  cont.Register([&]{
+    char c;
+    ret = read(pipefds[0], &c, 1);
+    err = errno;
+  });
+  cont.Register([&] {
+    usleep(50000);
+    close(pipefds[0]);
+  });
+  cont.Run();
+
+  close(pipefds[1]);
+  EXPECT_EQ(-1, ret);
+  EXPECT_EQ(EBADF, err);
+}
+
+// More requests to cancel than the SQ ring holds
+TEST(CoRoutineTest, IoUringCloseWhileManyReading) {
+  constexpr int kReaders = 4;
+  int pipefds[2];
+  ASSERT_EQ(0, pipe(pipefds));
+  int errs[kReaders] = {};
+
+  Attr attr;
+  attr.io_uring_entries = 2;
+  CoContainer cont(attr);
+  for (int i = 0; i < kReaders; ++i) {
+    cont.Register([&, i]{
+      char c;
+      if (read(pipefds[0], &c, 1) == -1)
+        errs[i] = errno;
+    });
+  }
+  cont.Register([&] {
+    usleep(50000);
+    close(pipefds[0]);
+  });
+  cont.Run();
+
+  close(pipefds[1]);
+  for (int i = 0; i < kReaders; ++i)
+    EXPECT_EQ(EBADF, errs[i]);
+}
+
 TEST(CoRoutineTest, WaitingTest) {
   int pipefds[2];
   ASSERT_EQ(0, pipe(pipefds));
@@ -238,6 +566,199 @@ TEST(CoRoutineTest, WaitingTest) {
   EXPECT_EQ(133, d);
 }
 
+TEST(CoRuntimeTest, YieldAndSpawn) {
+  constexpr unsigned kParents = 50;
+  constexpr unsigned kChildren = 20;
+  constexpr unsigned kYields = 10;
+
+  std::atomic<unsigned> done{0};
+
+  // All coroutines are spawned in one worker; the others have to steal
+  CoRuntime runtime(4);
+  runtime.Spawn([&] {
+    for (unsigned i = 0; i < kParents; ++i) {
+      runtime.Spawn([&] {
+        for (unsigned j = 0; j < kChildren; ++j) {
+          // Register is the same as Spawn in a worker
+          CurrentContainer()->Register([&] {
+            for (unsigned k = 0; k < kYields; ++k)
+              Yield();
+            ++done;
+          });
+          Yield();
+        }
+        EXPECT_FALSE(WaitFor(1));
+        ++done;
+      });
+    }
+  });
+  runtime.Run();
+
+  EXPECT_EQ(kParents * (kChildren + 1), done);
+}
+
+TEST(CoRuntimeTest, PingPong) {
+  constexpr unsigned kPairs = 16;
+  constexpr unsigned kRounds = 200;
+
+  std::vector<int> fds(kPairs * 2);
+  for (unsigned i = 0; i < kPairs; ++i)
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[i * 2]));
+
+  std::atomic<unsigned> rounds{0};
+  std::atomic<unsigned> slept{0};
+
+  CoRuntime runtime(4);
+  for (unsigned i = 0; i < kPairs; ++i) {
+    int server = fds[i * 2];
+    int client = fds[i * 2 + 1];
+    runtime.Spawn([server] {
+      char c;
+      while (read(server, &c, 1) == 1 && write(server, &c, 1) == 1) {
+      }
+    });
+    runtime.Spawn([&, client] {
+      for (unsigned j = 0; j < kRounds; ++j) {
+        char c = char(j);
+        char r = 0;
+        ASSERT_EQ(1, write(client, &c, 1));
+        ASSERT_EQ(1, read(client, &r, 1));
+        ASSERT_EQ(c, r);
+        ++rounds;
+      }
+      auto start = std::chrono::steady_clock::now();
+      SleepFor(std::chrono::milliseconds(10));
+      if (std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(10))
+        ++slept;
+      // The server sees EOF and quits
+      shutdown(client, SHUT_WR);
+    });
+  }
+  runtime.Run();
+
+  for (int fd: fds)
+    close(fd);
+  EXPECT_EQ(kPairs * kRounds, rounds);
+  EXPECT_EQ(kPairs, slept);
+}
+
+// A coroutine waits on fd in one worker, and another worker closes it and
+// reuses its number
+void CloseOnAnotherWorker(Attr attr) {
+  constexpr unsigned kClosers = 4;
+
+  int old_pipe[2];
+  ASSERT_EQ(0, pipe(old_pipe));
+  int new_pipe[2] = {-1, -1};
+  std::atomic<CoContainer*> waiter_cont{nullptr};
+  std::atomic<bool> closed{false};
+  std::atomic<bool> reopened{false};
+  int wait_ret = 0;
+  int wait_err = 0;
+  short wait_revents = 0;
+  int reuse_ret = 0;
+
+  CoRuntime runtime(2, attr);
+  runtime.Spawn([&] {
+    waiter_cont = CurrentContainer();
+    if (attr.io_uring_entries) {
+      char c;
+      wait_ret = read(old_pipe[0], &c, 1);
+      wait_err = errno;
+    } else {
+      pollfd fds[] = {{old_pipe[0], POLLIN, 0}};
+      wait_ret = poll(fds, 1, 2000);
+      wait_revents = fds[0].revents;
+    }
+    while (!reopened)
+      Yield();
+    pollfd fds[] = {{new_pipe[0], POLLIN, 0}};
+    reuse_ret = poll(fds, 1, 2000);
+  });
+  for (unsigned i = 0; i < kClosers; ++i) {
+    runtime.Spawn([&] {
+      // Closers are stolen by the other worker sooner or later
+      for (;;) {
+        if (closed)
+          return;
+        CoContainer* cont = waiter_cont;
+        if (cont != nullptr && cont != CurrentContainer())
+          break;
+        Yield();
+      }
+      if (closed.exchange(true))
+        return;
+      int fd = old_pipe[0];
+      close(fd);
+      ASSERT_EQ(0, pipe(new_pipe));
+      EXPECT_EQ(fd, new_pipe[0]);
+      reopened = true;
+      usleep(20000);
+      EXPECT_EQ(1, write(new_pipe[1], "x", 1));
+      // Without the forget, a pending read would see EOF, not EBADF
+      close(old_pipe[1]);
+    });
+  }
+  runtime.Run();
+
+  close(new_pipe[0]);
+  close(new_pipe[1]);
+  if (attr.io_uring_entries) {
+    EXPECT_EQ(-1, wait_ret);
+    EXPECT_EQ(EBADF, wait_err);
+  } else {
+    EXPECT_EQ(1, wait_ret);
+    EXPECT_EQ(POLLNVAL, wait_revents);
+  }
+  EXPECT_EQ(1, reuse_ret);
+}
+
+TEST(CoRuntimeTest, CloseOnAnotherWorker) {
+  CloseOnAnotherWorker({});
+}
+
+// Closing an fd no other worker has used doesn't wait for them
+TEST(CoRuntimeTest, CloseLocalFd) {
+  std::atomic<bool> spinning{false};
+  std::atomic<bool> closed{false};
+  double seconds = -1;
+
+  // Each worker takes one of them, and the spinner never yields
+  CoRuntime runtime(2);
+  runtime.Spawn([&] {
+    spinning = true;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (!closed && std::chrono::steady_clock::now() < deadline) {
+    }
+    spinning = false;
+  });
+  runtime.Spawn([&] {
+    while (!spinning)
+      Yield();
+    int pipefds[2];
+    ASSERT_EQ(0, pipe(pipefds));
+    pollfd fds[] = {{pipefds[0], POLLIN, 0}};
+    EXPECT_EQ(0, poll(fds, 1, 10));
+    auto start = std::chrono::steady_clock::now();
+    close(pipefds[0]);
+    close(pipefds[1]);
+    auto end = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(end - start).count();
+    closed = true;
+  });
+  runtime.Run();
+
+  EXPECT_LE(0, seconds);
+  EXPECT_GT(0.5, seconds);
+}
+
+TEST(CoRuntimeTest, IoUringCloseOnAnotherWorker) {
+  Attr attr;
+  attr.io_uring_entries = 16;
+  CloseOnAnotherWorker(attr);
+}
+
 } // namespace coroutine
 } // namespace cbu
 
@@ -0,0 +1,355 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include "runtime.h"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu {
+namespace coroutine {
+namespace {
+
+// Beyond this, fds are assumed to be used by all workers
+constexpr rlim_t kMaxTrackedFds = rlim_t(1) << 24;
+
+} // namespace
+
+CoRuntime::CoRuntime(unsigned workers, Attr attr) {
+  if (workers == 0)
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  workers_.reserve(workers);
+  for (unsigned i = 0; i < workers; ++i) {
+    int fd = fsys_eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fsys_failure(fd))
+      throw std::system_error(fsys_errno_val(fd), std::generic_category(),
+                              "eventfd");
+    auto& w = workers_.emplace_back(new Worker(attr));
+    w->container.runtime_ = this;
+    w->container.worker_index_ = i;
+    w->container.wake_fd_ = fd;
+  }
+
+  rlimit lim;
+  if (workers > 1 && getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    size_t size = std::min<rlim_t>(lim.rlim_cur, kMaxTrackedFds);
+    void* p = fsys_mmap(nullptr, size * sizeof(*fd_workers_),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!fsys_mmap_failed(p)) {
+      fd_workers_ = static_cast<std::atomic<uint64_t>*>(p);
+      fd_workers_size_ = size;
+    }
+  }
+}
+
+CoRuntime::~CoRuntime() {
+  for (auto& w: workers_)
+    fsys_close(w->container.wake_fd_);
+  if (fd_workers_)
+    fsys_munmap(fd_workers_, fd_workers_size_ * sizeof(*fd_workers_));
+}
+
+void CoRuntime::Spawn(CoFunc func) {
+  live_.fetch_add(1, std::memory_order_relaxed);
+  CoContainer* cont = CurrentContainer();
+  if (cont != nullptr && cont->runtime_ == this) {
+    // Shared with others at the start of the worker's next round
+    CoId id = cont->Attach(cont->MakeCoRoutine(0, std::move(func)).release());
+    cont->ready_list_.push(id);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(inject_mutex_);
+    injected_.push_back(std::move(func));
+    injected_size_.store(injected_.size(), std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  Notify();
+}
+
+void CoRuntime::Run() {
+  if (live_.load(std::memory_order_relaxed) == 0)
+    return;
+  stop_.store(false, std::memory_order_relaxed);
+
+  std::vector<std::thread> threads;
+  threads.reserve(workers_.size() - 1);
+  for (size_t i = 1; i < workers_.size(); ++i)
+    threads.emplace_back([this, i] { RunWorker(*workers_[i]); });
+  RunWorker(*workers_[0]);
+  for (auto& thread: threads)
+    thread.join();
+}
+
+// Like CoContainer::Run, but looks for work elsewhere when out of ready
+// coroutines, and only quits when all coroutines of the runtime are done.
+void CoRuntime::RunWorker(Worker& w) {
+  CoContainer& cont = w.container;
+  cont.StartIo();
+
+  // Number of coroutines left to run in this round
+  size_t round_left = 0;
+
+  for (;;) {
+    if (w.has_forget.load(std::memory_order_acquire))
+      HandleForget(w);
+
+    if (round_left == 0 && !cont.ready_list_.empty()) {
+      cont.FlushUring();
+      Share(w);
+      round_left = cont.ready_list_.size();
+    }
+
+    if (!cont.ready_list_.empty()) {
+      CoId run_idx = cont.ready_list_.front();
+      cont.ready_list_.pop();
+      --round_left;
+      cont.Resume(run_idx);
+      if (ForgetRequest* req = std::exchange(w.parking, nullptr)) {
+        // Parked in ForgetFd.  Whichever worker is the last to forget the fd
+        // resumes it.
+        cont.Detach(run_idx);
+        ReleaseForget(w, req);
+      }
+    } else if (FindWork(w)) {
+      round_left = 0;
+    } else if (stop_.load(std::memory_order_acquire)) {
+      break;
+    } else {
+      Idle(w);
+      round_left = 0;
+    }
+  }
+
+  cont.StopIo();
+  cont.co_list_.resize(1);
+  cont.free_ids_.clear();
+}
+
+// Offer the older half of our ready queue if anybody is looking for work.
+// Coroutines in ready_list_ are no longer in fd_waiters_ or timers_ (see
+// FinishWoken), so they're free to move.
+void CoRuntime::Share(Worker& w) {
+  CoContainer& cont = w.container;
+  if (cont.ready_list_.size() < 2 ||
+      idle_.load(std::memory_order_relaxed) == 0 || !w.deque.empty())
+    return;
+  for (size_t k = cont.ready_list_.size() / 2; k; --k) {
+    w.deque.Push(cont.Detach(cont.ready_list_.front()));
+    cont.ready_list_.pop();
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  Notify();
+}
+
+// Move some ready coroutine into our ready_list_: first what we've offered
+// but nobody has taken, then coroutines spawned from outside, and finally
+// steal from others
+bool CoRuntime::FindWork(Worker& w) {
+  CoContainer& cont = w.container;
+  CoRoutine* coroutine;
+  if (w.deque.Pop(&coroutine)) {
+    cont.ready_list_.push(cont.Attach(coroutine));
+    return true;
+  }
+
+  if (injected_size_.load(std::memory_order_relaxed) != 0 && TakeInjected(w))
+    return true;
+
+  size_t n = workers_.size();
+  for (size_t k = 1; k < n; ++k) {
+    Worker& victim = *workers_[(cont.worker_index_ + k) % n];
+    while (!victim.deque.empty()) {
+      if (victim.deque.Steal(&coroutine)) {
+        cont.ready_list_.push(cont.Attach(coroutine));
+        // Let another idle worker have a go at the rest
+        if (!victim.deque.empty())
+          Notify();
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Create coroutines spawned from outside.  Take only our share, so that
+// they're spread across workers from the start.
+bool CoRuntime::TakeInjected(Worker& w) {
+  std::vector<CoFunc> funcs;
+  bool more;
+  {
+    std::lock_guard<std::mutex> lock(inject_mutex_);
+    size_t n = injected_.size();
+    size_t take = (n + workers_.size() - 1) / workers_.size();
+    funcs.reserve(take);
+    for (size_t k = 0; k < take; ++k) {
+      funcs.push_back(std::move(injected_.front()));
+      injected_.pop_front();
+    }
+    more = !injected_.empty();
+    injected_size_.store(injected_.size(), std::memory_order_relaxed);
+  }
+  if (more)
+    Notify();
+
+  CoContainer& cont = w.container;
+  for (auto& func: funcs)
+    cont.ready_list_.push(
+        cont.Attach(cont.MakeCoRoutine(0, std::move(func)).release()));
+  return !funcs.empty();
+}
+
+// Wait for our own IO and timers, or until another worker wakes us up.
+//
+// We set sleeping, and then check for work; others make work available,
+// and then check sleeping.  Each side has a full fence in between, so at
+// least one of us sees the other.
+void CoRuntime::Idle(Worker& w) {
+  CoContainer& cont = w.container;
+  idle_.fetch_add(1, std::memory_order_relaxed);
+  w.sleeping.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!HasWork() && !stop_.load(std::memory_order_relaxed))
+    cont.DoPoll();
+  w.sleeping.store(false, std::memory_order_relaxed);
+  idle_.fetch_sub(1, std::memory_order_relaxed);
+  cont.wakeup_ = false;
+}
+
+bool CoRuntime::HasWork() const noexcept {
+  if (injected_size_.load(std::memory_order_relaxed) != 0)
+    return true;
+  for (auto& w: workers_) {
+    if (!w->deque.empty())
+      return true;
+  }
+  return false;
+}
+
+// Wake up one sleeping worker, if any
+void CoRuntime::Notify() noexcept {
+  if (idle_.load(std::memory_order_relaxed) == 0)
+    return;
+  for (auto& w: workers_) {
+    if (w->sleeping.load(std::memory_order_relaxed) &&
+        w->sleeping.exchange(false, std::memory_order_relaxed)) {
+      Wake(*w);
+      return;
+    }
+  }
+}
+
+void CoRuntime::Wake(Worker& w) noexcept {
+  uint64_t value = 1;
+  fsys_write(w.container.wake_fd_, &value, sizeof(value));
+}
+
+// Called by a worker when one of its coroutines is done
+void CoRuntime::Finished() noexcept {
+  if (live_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  stop_.store(true, std::memory_order_release);
+  for (auto& w: workers_)
+    Wake(*w);
+}
+
+// Called by a coroutine closing fd.  Other workers may have coroutines
+// waiting on it, or io_uring requests holding a reference to the file, which
+// only they can cancel.  So ask those that have used fd (see NoteFd), and
+// park until they have done it.
+void CoRuntime::ForgetFd(CoContainer& cont, int fd) {
+  if (workers_.size() == 1)
+    return;
+  uint64_t mask = ~uint64_t(0);
+  if (size_t(fd) < fd_workers_size_) {
+    if (fd_workers_[fd].load(std::memory_order_relaxed) == 0)
+      return;
+    mask = fd_workers_[fd].exchange(0, std::memory_order_acquire);
+  }
+  Worker& w = *workers_[cont.worker_index_];
+  auto is_target = [&](const std::unique_ptr<Worker>& other) {
+    return other.get() != &w &&
+           (mask >> (other->container.worker_index_ % 64) & 1);
+  };
+  size_t n = std::count_if(workers_.begin(), workers_.end(), is_target);
+  if (n == 0)
+    return;
+
+  ForgetRequest req{fd, cont.co_list_[cont.current_id_].get(), n + 1};
+  for (auto& other: workers_) {
+    if (!is_target(other))
+      continue;
+    {
+      std::lock_guard<std::mutex> lock(other->forget_mutex);
+      other->forget_requests.push_back(&req);
+      other->has_forget.store(true, std::memory_order_release);
+    }
+    Wake(*other);
+  }
+  w.parking = &req;
+  cont.SwitchToScheduler(Status::WAITING_WORKERS);
+}
+
+void CoRuntime::HandleForget(Worker& w) {
+  std::vector<ForgetRequest*> requests;
+  {
+    std::lock_guard<std::mutex> lock(w.forget_mutex);
+    requests.swap(w.forget_requests);
+    w.has_forget.store(false, std::memory_order_relaxed);
+  }
+  for (ForgetRequest* req: requests) {
+    w.container.ForgetFdLocally(req->fd);
+    ReleaseForget(w, req);
+  }
+}
+
+// req lives on the parked coroutine's stack.  Only the last one to release
+// it may touch it afterwards.
+void CoRuntime::ReleaseForget(Worker& w, ForgetRequest* req) {
+  if (req->pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  CoRoutine* coroutine = req->coroutine;
+  coroutine->status = Status::READY;
+  w.container.ready_list_.push(w.container.Attach(coroutine));
+}
+
+} // namespace coroutine
+} // namespace cbu
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "cbu/coroutine/coroutine.h"
+#include "cbu/coroutine/work_stealing_deque.h"
+
+namespace cbu {
+namespace coroutine {
+
+// Runs coroutines on multiple threads.
+//
+// Each worker thread runs a CoContainer of its own, with its own ready
+// queue, IO backend, timers and stacks.  A coroutine stays in one worker
+// while it's running or waiting for IO, but may move to another one when
+// it's ready: when some workers are idle, busy ones offer half of their
+// ready queues on work-stealing deques, from which idle ones steal.
+//
+// A coroutine may therefore resume on another thread after any Yield,
+// IO, sleep or close, and must not keep thread-local state across them.
+// WaitFor isn't supported, and Self is only unique within a worker.
+class CoRuntime {
+ public:
+  // workers == 0 means one for each CPU
+  explicit CoRuntime(unsigned workers = 0, Attr attr = {});
+  CoRuntime(const CoRuntime&) = delete;
+  CoRuntime& operator=(const CoRuntime&) = delete;
+  ~CoRuntime();
+
+  // Can be called from any thread, or from coroutines of this runtime
+  void Spawn(CoFunc func);
+
+  // Runs workers on the calling thread and workers() - 1 new threads,
+  // until all coroutines (including those spawned by them) have finished
+  void Run();
+
+  unsigned workers() const noexcept { return workers_.size(); }
+
+ private:
+  friend class CoContainer;
+
+  // A coroutine closing fd waits until all workers have forgotten it
+  struct ForgetRequest {
+    int fd;
+    CoRoutine* coroutine;
+    std::atomic<size_t> pending;  // Other workers + the closing one
+  };
+
+  struct alignas(64) Worker {
+    explicit Worker(Attr attr) : container(attr) {}
+
+    CoContainer container;
+    WorkStealingDeque<CoRoutine*> deque;  // Ready coroutines up for stealing
+    std::atomic<bool> sleeping{false};  // Set before waiting in DoPoll
+    ForgetRequest* parking = nullptr;  // Set by the coroutine before parking
+
+    // Requests from other workers
+    std::atomic<bool> has_forget{false};
+    std::mutex forget_mutex;
+    std::vector<ForgetRequest*> forget_requests;
+  };
+
+  void RunWorker(Worker& w);
+  void Share(Worker& w);
+  bool FindWork(Worker& w);
+  bool TakeInjected(Worker& w);
+  void Idle(Worker& w);
+  bool HasWork() const noexcept;
+  void Notify() noexcept;
+  void Wake(Worker& w) noexcept;
+  void Finished() noexcept;
+  // Remember that the worker has epoll or io_uring state for fd, which must
+  // be dropped when fd is closed
+  void NoteFd(unsigned worker, int fd) noexcept {
+    if (size_t(fd) >= fd_workers_size_)
+      return;
+    uint64_t bit = uint64_t(1) << (worker % 64);
+    std::atomic<uint64_t>& mask = fd_workers_[fd];
+    if (!(mask.load(std::memory_order_relaxed) & bit))
+      mask.fetch_or(bit, std::memory_order_relaxed);
+  }
+  void ForgetFd(CoContainer& cont, int fd);
+  void HandleForget(Worker& w);
+  void ReleaseForget(Worker& w, ForgetRequest* req);
+
+ private:
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> live_{0};  // Spawned but not finished
+  std::atomic<unsigned> idle_{0};  // Workers out of local work
+  std::atomic<bool> stop_{false};
+
+  // Indexed by fd, workers that may have state for it (bit k for workers
+  // k, k + 64, ...).  Lazily committed; fds beyond it go to all workers.
+  std::atomic<uint64_t>* fd_workers_ = nullptr;
+  size_t fd_workers_size_ = 0;
+
+  // Coroutines spawned from outside of workers haven't got stacks yet
+  std::mutex inject_mutex_;
+  std::deque<CoFunc> injected_;
+  std::atomic<size_t> injected_size_{0};
+};
+
+} // namespace coroutine
+} // namespace cbu
+
+#endif
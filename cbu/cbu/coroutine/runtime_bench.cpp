@@ -0,0 +1,208 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Scaling of CoRuntime with the number of workers, on two workloads:
+//  compute:   kTasks coroutines each run kSlices slices of CPU work,
+//             yielding in between
+//  ping-pong: kPairs pairs of coroutines exchange one byte kRounds times
+//             over blocking socketpairs, so they keep moving between
+//             ready and waiting
+//  churn:     kConns coroutines each open a socketpair, spawn a peer to
+//             send one byte, wait for it and close, kChurns times, as on
+//             short-lived connections
+// Workers go from 1 to the number of CPUs (or argv[1]) in powers of 2.
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "cbu/coroutine/runtime.h"
+
+namespace cbu {
+namespace coroutine {
+namespace {
+
+constexpr unsigned kTasks = 1000;
+constexpr unsigned kSlices = 100;
+constexpr unsigned kSliceWork = 10000;
+constexpr unsigned kPairs = 100;
+constexpr unsigned kRounds = 1000;
+constexpr unsigned kConns = 100;
+constexpr unsigned kChurns = 200;
+
+unsigned work(unsigned x) {
+  for (unsigned i = 0; i < kSliceWork; ++i) {
+    x = x * 1103515245 + 12345;
+    asm volatile("" : "+r"(x));
+  }
+  return x;
+}
+
+template <typename Setup>
+double timed_run(unsigned workers, Setup setup) {
+  CoRuntime runtime(workers);
+  setup(runtime);
+  auto start = std::chrono::steady_clock::now();
+  runtime.Run();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+double compute(unsigned workers) {
+  std::vector<unsigned> results(kTasks);
+  return timed_run(workers, [&](CoRuntime& runtime) {
+    for (unsigned i = 0; i < kTasks; ++i) {
+      runtime.Spawn([&results, i] {
+        unsigned x = i;
+        for (unsigned j = 0; j < kSlices; ++j) {
+          x = work(x);
+          Yield();
+        }
+        results[i] = x;
+      });
+    }
+  });
+}
+
+double ping_pong(unsigned workers) {
+  std::vector<int> fds(kPairs * 2);
+  for (unsigned i = 0; i < kPairs; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, &fds[i * 2]) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+  }
+  double seconds = timed_run(workers, [&](CoRuntime& runtime) {
+    for (unsigned i = 0; i < kPairs; ++i) {
+      int server = fds[i * 2];
+      int client = fds[i * 2 + 1];
+      runtime.Spawn([server] {
+        char c;
+        for (unsigned j = 0; j < kRounds; ++j) {
+          if (read(server, &c, 1) != 1 || write(server, &c, 1) != 1)
+            break;
+        }
+      });
+      runtime.Spawn([client] {
+        char c = 'x';
+        for (unsigned j = 0; j < kRounds; ++j) {
+          if (write(client, &c, 1) != 1 || read(client, &c, 1) != 1)
+            break;
+        }
+      });
+    }
+  });
+  for (int fd: fds)
+    close(fd);
+  return seconds;
+}
+
+double churn(unsigned workers) {
+  return timed_run(workers, [&](CoRuntime& runtime) {
+    for (unsigned i = 0; i < kConns; ++i) {
+      runtime.Spawn([&runtime] {
+        for (unsigned j = 0; j < kChurns; ++j) {
+          int fds[2];
+          if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            perror("socketpair");
+            exit(1);
+          }
+          int peer = fds[1];
+          runtime.Spawn([peer] {
+            char c = 'x';
+            if (write(peer, &c, 1) != 1)
+              exit(1);
+            close(peer);
+          });
+          char c;
+          if (read(fds[0], &c, 1) != 1)
+            exit(1);
+          close(fds[0]);
+        }
+      });
+    }
+  });
+}
+
+} // namespace
+} // namespace coroutine
+} // namespace cbu
+
+int main(int argc, char** argv) {
+  using namespace cbu::coroutine;
+
+  unsigned max_workers = std::max(1u, std::thread::hardware_concurrency());
+  if (argc > 1)
+    max_workers = std::max(1, atoi(argv[1]));
+
+  printf("compute: %u coroutines x %u slices; "
+         "ping-pong: %u pairs x %u round trips; "
+         "churn: %u coroutines x %u socketpairs\n",
+         kTasks, kSlices, kPairs, kRounds, kConns, kChurns);
+  printf("%8s %10s %8s %10s %8s %10s %8s\n",
+         "workers", "compute", "speedup", "ping-pong", "speedup",
+         "churn", "speedup");
+  double base_compute = 0;
+  double base_ping_pong = 0;
+  double base_churn = 0;
+  for (unsigned workers = 1; ; workers *= 2) {
+    if (workers > max_workers)
+      workers = max_workers;
+    double t_compute = compute(workers);
+    double t_ping_pong = ping_pong(workers);
+    double t_churn = churn(workers);
+    if (workers == 1) {
+      base_compute = t_compute;
+      base_ping_pong = t_ping_pong;
+      base_churn = t_churn;
+    }
+    printf("%8u %9.3fs %7.2fx %9.3fs %7.2fx %9.3fs %7.2fx\n", workers,
+           t_compute, base_compute / t_compute,
+           t_ping_pong, base_ping_pong / t_ping_pong,
+           t_churn, base_churn / t_churn);
+    if (workers == max_workers)
+      break;
+  }
+  return 0;
+}
+
+#else
+
+int main() {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Throughput of spawning short-lived coroutines: a parent registers kBatch
+// children at a time, each of which does nearly nothing and exits, then
+// yields to let them run.  Compares pooled stacks with a fresh
+// mmap/mprotect/munmap per coroutine.
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include "cbu/coroutine/coroutine.h"
+
+namespace cbu {
+namespace coroutine {
+namespace {
+
+constexpr unsigned kSpawns = 1000000;
+constexpr unsigned kBatch = 64;
+
+// Returns nanoseconds per spawn + exit
+double run(size_t stack_pool_size) {
+  Attr attr;
+  attr.stack_pool_size = stack_pool_size;
+  CoContainer cont(attr);
+
+  unsigned finished = 0;
+  cont.Register([&] {
+    for (unsigned i = 0; i < kSpawns; i += kBatch) {
+      for (unsigned j = 0; j < kBatch; ++j)
+        cont.Register([&] { ++finished; });
+      Yield();
+    }
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  cont.Run();
+  auto end = std::chrono::steady_clock::now();
+  if (finished != kSpawns)
+    fprintf(stderr, "Only %u of %u coroutines finished\n", finished, kSpawns);
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+      kSpawns;
+}
+
+} // namespace
+} // namespace coroutine
+} // namespace cbu
+
+int main() {
+  using namespace cbu::coroutine;
+
+  double pooled = run(Attr().stack_pool_size);
+  double unpooled = run(0);
+  printf("%u coroutines spawned in batches of %u\n", kSpawns, kBatch);
+  printf("%10s %16s\n", "", "ns/spawn+exit");
+  printf("%10s %16.1f\n", "pooled:", pooled);
+  printf("%10s %16.1f\n", "no pool:", unpooled);
+  return 0;
+}
+
+#else
+
+int main() {
+  return 0;
+}
+
+#endif
@@ -29,10 +29,15 @@
 #if defined __x86_64__ && !defined __LP64__
 
 #include "syscall_hook.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <chrono>
 #include "coroutine.h"
 
 #if defined __GNUC__ && !defined __clang__
@@ -55,6 +60,86 @@ void single_poll(int fd, short events, int timeout = -1) {
   active_container->Poll(fds, 1, timeout);
 }
 
+// Returns an SQE for fd if the active container runs IO on io_uring
+io_uring_sqe* get_sqe(uint8_t opcode, int fd) {
+  io_uring_sqe* sqe = active_container->GetSqe();
+  if (sqe) {
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+  }
+  return sqe;
+}
+
+inline uint32_t rw_len(size_t n) {
+  // MAX_RW_COUNT in the kernel.  Short reads/writes are always allowed.
+  return std::min<size_t>(n, 0x7ffff000);
+}
+
+ssize_t wait_sqe(CoContainer* cont, io_uring_sqe* sqe) {
+  int res = cont->WaitSqe(sqe);
+  if (res >= 0)
+    return res;
+  // We cancel requests only when their fd is being closed
+  errno = (res == -ECANCELED) ? EBADF : -res;
+  return -1;
+}
+
+ssize_t wait_sqe(io_uring_sqe* sqe) {
+  return wait_sqe(active_container, sqe);
+}
+
+ssize_t wait_msg_sqe(io_uring_sqe* sqe, void* buffer, size_t n, int flags,
+                     const sockaddr* addr, socklen_t* addrlen) {
+  iovec iov = {buffer, n};
+  msghdr msg = {};
+  msg.msg_name = const_cast<sockaddr*>(addr);
+  msg.msg_namelen = *addrlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+  ssize_t r = wait_sqe(sqe);
+  *addrlen = msg.msg_namelen;
+  return r;
+}
+
+// Blocking writes and sends only return early on error, but io_uring
+// completes them short if the pipe or socket buffer is partly full.  So
+// resubmit the rest (as IORING_OP_WRITE or IORING_OP_SEND) until all n bytes
+// are written.  r is the result of the first request.
+ssize_t finish_write(ssize_t r, uint8_t opcode, int fd, const void* buffer,
+                     size_t n, int flags) {
+  if (flags & MSG_DONTWAIT)
+    return r;
+  size_t done = 0;
+  while (r > 0 && (done += r) < n) {
+    const char* rest = static_cast<const char*>(buffer) + done;
+    // We may be in another worker of CoRuntime now
+    CoContainer* cont = CurrentContainer();
+    io_uring_sqe* sqe = cont->GetSqe();
+    if (sqe == nullptr) {
+      pollfd fds[] = {{fd, POLLOUT, 0}};
+      cont->Poll(fds, 1);
+      r = (opcode == IORING_OP_WRITE) ? sys_write(fd, rest, n - done) :
+          sys_sendto(fd, rest, n - done, flags, nullptr, 0);
+      if (r > 0)
+        done += r;
+      break;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(rest);
+    sqe->len = rw_len(n - done);
+    if (opcode == IORING_OP_WRITE)
+      sqe->off = uint64_t(-1);  // Current file position
+    else
+      sqe->msg_flags = flags;
+    r = wait_sqe(cont, sqe);
+  }
+  return done ? ssize_t(done) : r;
+}
+
 } // namespace
 
 extern "C" {
@@ -70,6 +155,12 @@ VISIBLE ssize_t hook_read(int fd, void* buffer, size_t n) asm("read");
 ssize_t hook_read(int fd, void* buffer, size_t n) {
   if (active_container == nullptr || is_non_blocking(fd))
     return sys_read(fd, buffer, n);
+  if (io_uring_sqe* sqe = get_sqe(IORING_OP_READ, fd)) {
+    sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+    sqe->len = rw_len(n);
+    sqe->off = uint64_t(-1);  // Current file position
+    return wait_sqe(sqe);
+  }
   single_poll(fd, POLLIN);
   return sys_read(fd, buffer, n);
 }
@@ -78,6 +169,12 @@ VISIBLE ssize_t hook_write(int fd, const void* buffer, size_t n) asm("write");
 ssize_t hook_write(int fd, const void* buffer, size_t n) {
   if (active_container == nullptr || is_non_blocking(fd))
     return sys_write(fd, buffer, n);
+  if (io_uring_sqe* sqe = get_sqe(IORING_OP_WRITE, fd)) {
+    sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+    sqe->len = rw_len(n);
+    sqe->off = uint64_t(-1);  // Current file position
+    return finish_write(wait_sqe(sqe), IORING_OP_WRITE, fd, buffer, n, 0);
+  }
   single_poll(fd, POLLOUT);
   return sys_write(fd, buffer, n);
 }
@@ -95,6 +192,20 @@ ssize_t hook_sendto(int fd, const void* buffer, size_t n, int flags,
                     const sockaddr* addr, socklen_t addrlen) {
   if (active_container == nullptr || is_non_blocking(fd))
     return sys_sendto(fd, buffer, n, flags, addr, addrlen);
+  if (addr == nullptr) {
+    if (io_uring_sqe* sqe = get_sqe(IORING_OP_SEND, fd)) {
+      sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+      sqe->len = rw_len(n);
+      sqe->msg_flags = flags;
+      return finish_write(wait_sqe(sqe), IORING_OP_SEND, fd, buffer, n,
+                          flags);
+    }
+  } else if (io_uring_sqe* sqe = get_sqe(IORING_OP_SENDMSG, fd)) {
+    // Only stream sockets (which ignore addr) may be written short
+    ssize_t r = wait_msg_sqe(sqe, const_cast<void*>(buffer), n, flags, addr,
+                             &addrlen);
+    return finish_write(r, IORING_OP_SEND, fd, buffer, n, flags);
+  }
   single_poll(fd, POLLOUT);
   return sys_sendto(fd, buffer, n, flags, addr, addrlen);
 }
@@ -106,30 +217,50 @@ ssize_t hook_recv(int fd, void* buffer, size_t n, int flags) {
 }
 
 VISIBLE ssize_t hook_recvfrom(int fd, void* buffer, size_t n, int flags,
-                              sockaddr* addr, socklen_t addrlen)
+                              sockaddr* addr, socklen_t* addrlen)
   asm("recvfrom");
 ssize_t hook_recvfrom(int fd, void* buffer, size_t n, int flags,
-                      sockaddr* addr, socklen_t addrlen) {
+                      sockaddr* addr, socklen_t* addrlen) {
   if (active_container == nullptr || is_non_blocking(fd))
     return sys_recvfrom(fd, buffer, n, flags, addr, addrlen);
+  if (addr == nullptr) {
+    if (io_uring_sqe* sqe = get_sqe(IORING_OP_RECV, fd)) {
+      sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+      sqe->len = rw_len(n);
+      sqe->msg_flags = flags;
+      return wait_sqe(sqe);
+    }
+  } else if (io_uring_sqe* sqe = get_sqe(IORING_OP_RECVMSG, fd)) {
+    return wait_msg_sqe(sqe, buffer, n, flags, addr, addrlen);
+  }
   single_poll(fd, POLLIN);
   return sys_recvfrom(fd, buffer, n, flags, addr, addrlen);
 }
 
 VISIBLE unsigned int hook_sleep(unsigned int seconds) asm("sleep");
 unsigned int hook_sleep(unsigned int seconds) {
-  poll(nullptr, 0, seconds * 1000);
+  if (active_container == nullptr)
+    poll(nullptr, 0, seconds * 1000);
+  else
+    active_container->SleepFor(std::chrono::seconds(seconds));
   return 0;
 }
 
-VISIBLE int hook_usleep(useconds_t seconds) asm("usleep");
-int hook_usleep(useconds_t seconds) {
-  poll(nullptr, 0, seconds / 1000);
-  if (auto remain = seconds % 1000)
-    sys_usleep(remain);
+VISIBLE int hook_usleep(useconds_t usec) asm("usleep");
+int hook_usleep(useconds_t usec) {
+  if (active_container == nullptr)
+    return sys_usleep(usec);
+  active_container->SleepFor(std::chrono::microseconds(usec));
   return 0;
 }
 
+VISIBLE int hook_close(int fd) asm("close");
+int hook_close(int fd) {
+  if (active_container != nullptr)
+    active_container->ForgetFd(fd);
+  return sys_close(fd);
+}
+
 VISIBLE int hook_epoll_wait(int epfd, epoll_event* events, int maxevents,
                             int timeout) asm("epoll_wait");
 int hook_epoll_wait(int epfd, epoll_event* events, int maxevents,
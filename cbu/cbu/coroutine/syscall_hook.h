@@ -35,7 +35,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#include "cbu/common/fixed_string.h"
+#include "cbu/strings/fixed_string.h"
 
 namespace cbu {
 namespace coroutine {
@@ -84,8 +84,9 @@ inline auto& sys_recv =
     RawFuncAccessor<"recv", ssize_t(int, void*, size_t, int)>::instance;
 inline auto& sys_recvfrom =
     RawFuncAccessor<"recvfrom", ssize_t(int, void*, size_t, int, sockaddr*,
-                                        socklen_t)>::instance;
+                                        socklen_t*)>::instance;
 inline auto& sys_usleep = RawFuncAccessor<"usleep", int(useconds_t)>::instance;
+inline auto& sys_close = RawFuncAccessor<"close", int(int)>::instance;
 inline auto& sys_epoll_wait =
     RawFuncAccessor<"epoll_wait", int(int, epoll_event*, int, int)>::instance;
 
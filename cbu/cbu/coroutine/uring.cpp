@@ -0,0 +1,163 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include "uring.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "cbu/common/byte_size.h"
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu {
+namespace coroutine {
+
+bool Uring::Init(unsigned entries) noexcept {
+  io_uring_params p = {};
+  int fd = fsys_io_uring_setup(entries, &p);
+  if (fsys_failure(fd))
+    return false;
+  fd_ = fd;
+
+  // We rely on the kernel never dropping CQEs, and on offset -1 meaning the
+  // current file position (both are 5.6+)
+  constexpr unsigned kFeatures = IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+  if ((p.features & kFeatures) != kFeatures) {
+    Destroy();
+    return false;
+  }
+
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+  void* sq_ring = fsys_mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (fsys_mmap_failed(sq_ring)) {
+    Destroy();
+    return false;
+  }
+  sq_ring_ = sq_ring;
+
+  void* cq_ring = sq_ring;
+  if (!single_mmap) {
+    cq_ring = fsys_mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (fsys_mmap_failed(cq_ring)) {
+      Destroy();
+      return false;
+    }
+  }
+  cq_ring_ = cq_ring;
+
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = fsys_mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (fsys_mmap_failed(sqes)) {
+    sqes_size_ = 0;
+    Destroy();
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_entries_ = p.sq_entries;
+  cq_entries_ = p.cq_entries;
+  sq_head_ = static_cast<unsigned*>(byte_advance(sq_ring, p.sq_off.head));
+  sq_tail_ = static_cast<unsigned*>(byte_advance(sq_ring, p.sq_off.tail));
+  sq_flags_ = static_cast<unsigned*>(byte_advance(sq_ring, p.sq_off.flags));
+  sq_mask_ = *static_cast<unsigned*>(byte_advance(sq_ring, p.sq_off.ring_mask));
+  cq_head_ = static_cast<unsigned*>(byte_advance(cq_ring, p.cq_off.head));
+  cq_tail_ = static_cast<unsigned*>(byte_advance(cq_ring, p.cq_off.tail));
+  cq_mask_ = *static_cast<unsigned*>(byte_advance(cq_ring, p.cq_off.ring_mask));
+  cqes_ = static_cast<io_uring_cqe*>(byte_advance(cq_ring, p.cq_off.cqes));
+  sqe_tail_ = *sq_tail_;
+
+  // SQ index array is the identity mapping; SQEs are used in ring order
+  unsigned* sq_array = static_cast<unsigned*>(
+      byte_advance(sq_ring, p.sq_off.array));
+  for (unsigned i = 0; i < sq_entries_; ++i)
+    sq_array[i] = i;
+  return true;
+}
+
+void Uring::Destroy() noexcept {
+  if (sqes_size_ != 0)
+    fsys_munmap(sqes_, sqes_size_);
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+    fsys_munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != nullptr)
+    fsys_munmap(sq_ring_, sq_ring_size_);
+  if (fd_ >= 0)
+    fsys_close(fd_);
+  fd_ = -1;
+  sq_entries_ = cq_entries_ = 0;
+  sqe_tail_ = pending_ = inflight_ = 0;
+  sq_ring_ = cq_ring_ = nullptr;
+  sqes_ = nullptr;
+  sq_ring_size_ = cq_ring_size_ = sqes_size_ = 0;
+}
+
+io_uring_sqe* Uring::GetSqe() noexcept {
+  if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    Enter(0);
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return nullptr;
+  }
+  io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  ++sqe_tail_;
+  ++pending_;
+  ++inflight_;
+  return sqe;
+}
+
+int Uring::Enter(unsigned min_complete) noexcept {
+  if (pending_ == 0 && min_complete == 0)
+    return 0;
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+  int r = fsys_io_uring_enter(fd_, pending_, min_complete,
+                              min_complete ? IORING_ENTER_GETEVENTS : 0);
+  if (!fsys_failure(r))
+    pending_ -= r;
+  return r;
+}
+
+bool Uring::FlushOverflow() noexcept {
+  return !fsys_failure(fsys_io_uring_enter(fd_, 0, 0, IORING_ENTER_GETEVENTS));
+}
+
+} // namespace coroutine
+} // namespace cbu
+
+#endif
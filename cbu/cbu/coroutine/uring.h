@@ -0,0 +1,124 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+namespace cbu {
+namespace coroutine {
+
+// A minimal io_uring, driven directly by io_uring_setup and io_uring_enter.
+// SQEs are only queued by GetSqe, and are submitted in batch by Enter.
+class Uring {
+ public:
+  Uring() = default;
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+  ~Uring() { Destroy(); }
+
+  // Returns false if io_uring is unavailable or lacks features we need
+  bool Init(unsigned entries) noexcept;
+  void Destroy() noexcept;
+
+  int fd() const noexcept { return fd_; }
+  // Number of requests whose completions haven't been reaped
+  unsigned inflight() const noexcept { return inflight_; }
+  // Whether another request fits in the CQ ring
+  bool available() const noexcept {
+    return fd_ >= 0 && inflight_ < cq_entries_;
+  }
+
+  // Returns a zeroed SQE, or nullptr if the SQ ring is full even after
+  // submitting what's queued
+  io_uring_sqe* GetSqe() noexcept;
+
+  // Submit all queued SQEs, and wait for at least min_complete completions.
+  // Returns the number of SQEs submitted, or a negative errno.
+  int Enter(unsigned min_complete) noexcept;
+
+  // Call fn(user_data, res) for each completion.  Completions with
+  // user_data == 0 are silently dropped.
+  template <typename Fn>
+  void Reap(Fn fn) {
+    for (;;) {
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        uint64_t user_data = cqe.user_data;
+        int res = cqe.res;
+        __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+        --inflight_;
+        if (user_data != 0)
+          fn(user_data, res);
+      }
+      // Completions that didn't fit in the CQ ring are kept by the kernel
+      // (IORING_FEAT_NODROP), and are moved to the ring only by
+      // io_uring_enter
+      if (!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW) || !FlushOverflow())
+        break;
+    }
+  }
+
+ private:
+  bool FlushOverflow() noexcept;
+
+  int fd_ = -1;
+  unsigned sq_entries_ = 0;
+  unsigned cq_entries_ = 0;
+  unsigned sqe_tail_ = 0;  // Our copy of SQ tail, including unsubmitted
+  unsigned pending_ = 0;  // Queued but not yet submitted
+  unsigned inflight_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_flags_ = nullptr;
+  unsigned sq_mask_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+};
+
+} // namespace coroutine
+} // namespace cbu
+
+#endif
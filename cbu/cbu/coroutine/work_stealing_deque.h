@@ -0,0 +1,156 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#if defined __x86_64__ && !defined __LP64__
+
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace cbu {
+namespace coroutine {
+
+// Chase-Lev work-stealing deque (with the memory orderings of Le et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP'13).
+//
+// Only the owner thread may Push and Pop, which work on the bottom end;
+// any thread may Steal from the top end.  T must be trivially copyable
+// (we only store pointers).  Arrays outgrown by Push are kept until
+// destruction, because a thief may still be reading from them.
+template <typename T>
+class WorkStealingDeque {
+ public:
+  // capacity must be a power of 2
+  explicit WorkStealingDeque(size_t capacity = 256) :
+      array_(new Array(capacity)) {}
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+  ~WorkStealingDeque() { delete array_.load(std::memory_order_relaxed); }
+
+  // Owner only
+  void Push(T x) {
+    ptrdiff_t b = bottom_.load(std::memory_order_relaxed);
+    ptrdiff_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+    if (b - t >= ptrdiff_t(a->capacity))
+      a = Grow(a, t, b);
+    a->Put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only.  Returns false if empty.
+  bool Pop(T* x) noexcept {
+    ptrdiff_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ptrdiff_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    *x = a->Get(b);
+    if (t == b) {
+      // The last element.  Race with thieves for it.
+      bool won = top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread.  Returns false if empty or if we lost a race.
+  bool Steal(T* x) noexcept {
+    ptrdiff_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ptrdiff_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b)
+      return false;
+    // consume would do, but compilers promote it to acquire anyway
+    Array* a = array_.load(std::memory_order_acquire);
+    T v = a->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+      return false;
+    *x = v;
+    return true;
+  }
+
+  // Any thread, but only a hint if called by thieves
+  bool empty() const noexcept {
+    ptrdiff_t b = bottom_.load(std::memory_order_relaxed);
+    ptrdiff_t t = top_.load(std::memory_order_relaxed);
+    return b <= t;
+  }
+
+ private:
+  struct Array {
+    explicit Array(size_t cap) :
+        capacity(cap), mask(cap - 1), slots(new std::atomic<T>[cap]) {}
+
+    T Get(ptrdiff_t i) const noexcept {
+      return slots[i & mask].load(std::memory_order_relaxed);
+    }
+    void Put(ptrdiff_t i, T x) noexcept {
+      slots[i & mask].store(x, std::memory_order_relaxed);
+    }
+
+    size_t capacity;  // Always a power of 2
+    size_t mask;
+    std::unique_ptr<std::atomic<T>[]> slots;
+  };
+
+  Array* Grow(Array* a, ptrdiff_t t, ptrdiff_t b) {
+    std::unique_ptr<Array> new_array(new Array(a->capacity * 2));
+    for (ptrdiff_t i = t; i < b; ++i)
+      new_array->Put(i, a->Get(i));
+    retired_.emplace_back(a);
+    a = new_array.release();
+    array_.store(a, std::memory_order_release);
+    return a;
+  }
+
+ private:
+  // top_ is written by thieves, and bottom_ by the owner.  Keep them on
+  // separate cache lines.
+  alignas(64) std::atomic<ptrdiff_t> top_{0};
+  alignas(64) std::atomic<ptrdiff_t> bottom_{0};
+  std::atomic<Array*> array_;
+  std::vector<std::unique_ptr<Array>> retired_;  // Owner only
+};
+
+} // namespace coroutine
+} // namespace cbu
+
+#endif
@@ -129,6 +129,7 @@ struct rlimit;
 struct pollfd;
 struct utimbuf;
 struct sysinfo;
+struct io_uring_params;
 
 #if defined __cplusplus && __cplusplus >= 201103L
 static_assert(_NSIG == 64 || _NSIG == 65, "_NSIG wrong");
@@ -458,6 +459,9 @@ def_fsys(umount2,umount2,int,2,const char *,int)
 def_fsys(pivot_root,pivot_root,int,2,const char *,const char *)
 def_fsys(memfd_create,memfd_create,int,2,const char *,unsigned)
 def_fsys_nomem(copy_file_range,copy_file_range,long,6,int,long*,int,long*,unsigned long,unsigned)
+def_fsys(io_uring_setup,io_uring_setup,int,2,unsigned,struct io_uring_params *)
+def_fsys(io_uring_enter_raw,io_uring_enter,int,6,unsigned,unsigned,unsigned,unsigned,const void*,unsigned long)
+#define fsys_io_uring_enter(fd,to_submit,min_complete,flags) fsys_io_uring_enter_raw(fd,to_submit,min_complete,flags,0,_NSIG/8)
 
 // vsyscall is nowadays deprecated; We should use vDSO instead,
 // of which modern glibc takes good care.
@@ -675,6 +679,8 @@ fsys_inline int fsys_posix_fadvise(int fd, __OFF64_T_TYPE off,
 #define fsys_pivot_root pivot_root
 #define fsys_memfd_create memfd_create
 #define fsys_copy_file_range copy_file_range
+#define fsys_io_uring_setup(a,b) ((int)syscall(__NR_io_uring_setup,a,b))
+#define fsys_io_uring_enter(a,b,c,d) ((int)syscall(__NR_io_uring_enter,a,b,c,d,0,_NSIG/8))
 
 #endif
 
@@ -27,27 +27,44 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/pagesize.h"
+#include "cbu/alloc/stats.h"
+#include "cbu/fsyscall/fsyscall.h"
 #include "cbu/malloc/malloc.h"
+#include "cbu/malloc/trace.h"
 #include "cbu/malloc/visibility.h"
 #include "cbu/math/strict_overflow.h"
 
 namespace alloc = cbu::alloc;
+namespace trace = cbu::malloc_trace;
 
-extern "C" void* cbu_malloc(size_t n) noexcept { return alloc::allocate(n); }
+extern "C" void* cbu_malloc(size_t n) noexcept {
+  void* ptr = alloc::allocate(n);
+  trace::on_alloc(trace::kMalloc, ptr, n);
+  return ptr;
+}
 
 extern "C" void* cbu_calloc(size_t m, size_t l) noexcept {
   size_t n;
   if (cbu::mul_overflow(m, l, &n)) [[unlikely]]
     return alloc::nomem();
-  return alloc::allocate(n, alloc::AllocateOptions().with_zero(true));
+  void* ptr = alloc::allocate(n, alloc::AllocateOptions().with_zero(true));
+  trace::on_alloc(trace::kCalloc, ptr, n);
+  return ptr;
 }
 
 extern "C" void* cbu_realloc(void* ptr, size_t newsize) noexcept {
-  return alloc::reallocate(ptr, newsize);
+  uint64_t trace_start = trace::on_realloc_start();
+  void* res = alloc::reallocate(ptr, newsize);
+  trace::on_realloc(trace_start, ptr, newsize, res);
+  return res;
 }
 
 extern "C" void* cbu_reallocarray(void* ptr, size_t m, size_t l) noexcept {
@@ -60,7 +77,9 @@ extern "C" void* cbu_reallocarray(void* ptr, size_t m, size_t l) noexcept {
 extern "C" void* cbu_memalign(size_t boundary, size_t n) noexcept {
   if (!alloc::is_alignment_valid(boundary)) [[unlikely]]
     return nullptr;
-  return alloc::allocate(n, alloc::AllocateOptions().with_align(boundary));
+  void* ptr = alloc::allocate(n, alloc::AllocateOptions().with_align(boundary));
+  trace::on_alloc(trace::kMemalign, ptr, n, boundary);
+  return ptr;
 }
 
 // C11 says the boundary must be "supported by the implementation", so we
@@ -77,14 +96,19 @@ extern "C" void* cbu_aligned_alloc(size_t boundary, size_t n) noexcept
 
 extern "C" void* cbu_valloc(size_t n) noexcept {
   // Don't directly call alloc_large, which doesn't like n == 0
-  return alloc::allocate(n,
-                         alloc::AllocateOptions().with_align(alloc::kPageSize));
+  void* ptr =
+      alloc::allocate(n, alloc::AllocateOptions().with_align(alloc::kPageSize));
+  trace::on_alloc(trace::kMemalign, ptr, n, alloc::kPageSize);
+  return ptr;
 }
 
 extern "C" void* cbu_pvalloc(size_t) noexcept
   __attribute__((alias("cbu_valloc"), malloc));
 
-extern "C" void cbu_free(void* ptr) noexcept { alloc::reclaim(ptr); }
+extern "C" void cbu_free(void* ptr) noexcept {
+  trace::on_free(ptr);
+  alloc::reclaim(ptr);
+}
 
 extern "C" void cbu_cfree(void* ) noexcept __attribute__((alias("cbu_free")));
 
@@ -93,6 +117,7 @@ extern "C" int cbu_posix_memalign(void** pret, size_t boundary,
   if (!alloc::is_alignment_valid_posix(boundary)) [[unlikely]]
     return EINVAL;
   void* ptr = alloc::allocate(n, alloc::AllocateOptions().with_align(boundary));
+  trace::on_alloc(trace::kMemalign, ptr, n, boundary);
   *pret = ptr;
 #ifdef CBU_ASSUME_MEMORY_ALLOCATION_NEVER_FAILS
   return 0;
@@ -105,6 +130,18 @@ extern "C" size_t cbu_malloc_usable_size(void* ptr) noexcept {
   return alloc::allocated_size(ptr);
 }
 
+extern "C" size_t cbu_malloc_batch(size_t size, size_t n, void** out) noexcept {
+  size_t res = alloc::allocate_batch(size, n, out);
+  for (size_t i = 0; i < res; ++i)
+    trace::on_alloc(trace::kMalloc, out[i], size);
+  return res;
+}
+
+extern "C" void cbu_free_batch(void** ptrs, size_t n) noexcept {
+  for (size_t i = 0; i < n; ++i) trace::on_free(ptrs[i]);
+  alloc::reclaim_batch(ptrs, n);
+}
+
 extern "C" int cbu_malloc_trim(size_t pad) noexcept {
 #ifdef CBU_NEED_MALLOC_TRIM
   alloc::trim(pad);
@@ -114,6 +151,138 @@ extern "C" int cbu_malloc_trim(size_t pad) noexcept {
 #endif
 }
 
+#if defined __GLIBC__ && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+extern "C" struct mallinfo2 cbu_mallinfo2() noexcept {
+  alloc::Stats stats;
+  alloc::get_stats(&stats);
+
+  size_t small_in_use = 0;
+  size_t small_cached = 0;
+  size_t small_run_bytes = 0;
+  for (unsigned i = 0; i < stats.small_category_count; ++i) {
+    const alloc::SmallCategoryStats& s = stats.small[i];
+    small_in_use += (s.allocations - s.frees) * s.block_size;
+    small_cached += s.cached_blocks * s.block_size;
+    small_run_bytes += (s.runs - s.runs_reclaimed) * alloc::kPageSize;
+  }
+
+  struct mallinfo2 res = {};
+  size_t pages_in_use = 0;
+  for (unsigned i = 0; i < stats.arena_count; ++i) {
+    const alloc::ArenaStats& a = stats.arenas[i];
+    res.arena += a.bytes_mapped;
+    res.fordblks +=
+        a.bytes_clean + a.bytes_dirty + a.bytes_lazy + a.bytes_raw_cached;
+    res.keepcost += a.bytes_dirty;
+    pages_in_use += a.bytes_in_use;
+  }
+  // Runs in huge page superblocks aren't taken from arenas
+  if (stats.superblocks) {
+    size_t sb_pages = stats.superblocks * (alloc::kTHPSize / alloc::kPageSize);
+    size_t sb_in_use = stats.superblock_pages_in_use * alloc::kPageSize;
+    res.arena += stats.superblocks * alloc::kTHPSize;
+    // Headers are neither free nor in use; count them as free
+    res.fordblks += sb_pages * alloc::kPageSize - sb_in_use;
+    small_run_bytes -= std::min(small_run_bytes, sb_in_use);
+  }
+  // Statistics aren't a consistent snapshot; don't underflow
+  size_t large_in_use =
+      pages_in_use > small_run_bytes ? pages_in_use - small_run_bytes : 0;
+  res.uordblks = small_in_use + large_in_use;
+  res.fsmblks = small_cached;
+  res.fordblks += small_cached;
+  res.hblks = stats.direct_blocks;
+  res.hblkhd = stats.direct_bytes;
+  res.uordblks += stats.direct_bytes;
+  return res;
+}
+#endif
+
+namespace {
+
+// Returns huge pages backing anonymous memory of the process (THP coverage)
+// in KiB, or -1 if unknown
+long long anon_huge_pages_kb() noexcept {
+  int fd = fsys_open2("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  char buf[4096];
+  ssize_t l = fsys_read(fd, buf, sizeof(buf) - 1);
+  fsys_close(fd);
+  if (l <= 0) return -1;
+  buf[l] = '\0';
+  const char* p = strstr(buf, "\nAnonHugePages:");
+  if (p == nullptr) return -1;
+  return strtoll(p + strlen("\nAnonHugePages:"), nullptr, 10);
+}
+
+}  // namespace
+
+extern "C" void cbu_malloc_stats() noexcept {
+  alloc::Stats stats;
+  alloc::get_stats(&stats);
+
+  // Don't use stdio, which may allocate memory
+  char buf[256];
+  auto print = [&buf](const char* fmt, auto... args) {
+    int n = snprintf(buf, sizeof(buf), fmt, args...);
+    if (n > 0) fsys_write(2, buf, std::min<size_t>(n, sizeof(buf) - 1));
+  };
+
+  print("Config: small_cache_flush=%u,min_trim_threshold=%llu,"
+        "max_trim_threshold=%llu,initial_alloc_size=%llu,brk=%d,thp=%s\n",
+        stats.small_cache_flush,
+        (unsigned long long)stats.min_trim_threshold,
+        (unsigned long long)stats.max_trim_threshold,
+        (unsigned long long)stats.initial_alloc_size, int(stats.use_brk),
+        stats.thp);
+  print("Thread caches: %u\n", stats.thread_caches);
+  print("Direct mappings: %llu blocks, %llu bytes\n",
+        (unsigned long long)stats.direct_blocks,
+        (unsigned long long)stats.direct_bytes);
+  if (stats.superblocks) {
+    unsigned long long sb_pages =
+        stats.superblocks * (alloc::kTHPSize / alloc::kPageSize - 1);
+    print("Run superblocks: %llu (%llu empty), run pages %llu/%llu (%.1f%%)\n",
+          (unsigned long long)stats.superblocks,
+          (unsigned long long)stats.superblocks_empty,
+          (unsigned long long)stats.superblock_pages_in_use, sb_pages,
+          100. * stats.superblock_pages_in_use / sb_pages);
+  }
+  if (stats.thread_cache_budget)
+    print("Thread cache budget: %llu/%llu bytes, %llu idle caches scavenged\n",
+          (unsigned long long)stats.thread_cache_budget_used,
+          (unsigned long long)stats.thread_cache_budget,
+          (unsigned long long)stats.thread_caches_scavenged);
+  if (stats.pressure_trims)
+    print("Pressure trims: %llu\n", (unsigned long long)stats.pressure_trims);
+  if (long long kb = anon_huge_pages_kb(); kb >= 0)
+    print("AnonHugePages: %lld KiB\n", kb);
+  print("%10s %16s %16s %12s %12s %12s\n", "Size", "Allocations", "Frees",
+        "Runs", "Reclaimed", "Cached");
+  for (unsigned i = 0; i < stats.small_category_count; ++i) {
+    const alloc::SmallCategoryStats& s = stats.small[i];
+    print("%10zu %16llu %16llu %12llu %12llu %12llu\n", s.block_size,
+          (unsigned long long)s.allocations, (unsigned long long)s.frees,
+          (unsigned long long)s.runs, (unsigned long long)s.runs_reclaimed,
+          (unsigned long long)s.cached_blocks);
+  }
+  for (unsigned i = 0; i < stats.arena_count; ++i) {
+    const alloc::ArenaStats& a = stats.arenas[i];
+    print("Arena %s:\n", a.name);
+    print("  in use %llu, clean %llu, dirty %llu, lazy %llu\n",
+          (unsigned long long)a.bytes_in_use, (unsigned long long)a.bytes_clean,
+          (unsigned long long)a.bytes_dirty, (unsigned long long)a.bytes_lazy);
+    print("  mapped %llu, raw cached %llu, reclaimed %llu\n",
+          (unsigned long long)a.bytes_mapped,
+          (unsigned long long)a.bytes_raw_cached,
+          (unsigned long long)a.bytes_reclaimed);
+    print("  madvise calls %llu, munmap calls %llu\n",
+          (unsigned long long)a.madvise_calls,
+          (unsigned long long)a.munmap_calls);
+  }
+}
+
 extern "C" {
 
 void* malloc(size_t) noexcept
@@ -146,5 +315,14 @@ size_t malloc_usable_size(void*) noexcept
 int malloc_trim(size_t) noexcept
   __attribute__((alias("cbu_malloc_trim"), cold))
   cbu_malloc_visibility_default;
+#if defined __GLIBC__ && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+struct mallinfo2 mallinfo2() noexcept
+  __attribute__((alias("cbu_mallinfo2"), cold))
+  cbu_malloc_visibility_default;
+#endif
+void malloc_stats() noexcept
+  __attribute__((alias("cbu_malloc_stats"), cold))
+  cbu_malloc_visibility_default;
 
 } // extern "C"
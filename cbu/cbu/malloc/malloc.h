@@ -29,6 +29,9 @@
 #pragma once
 
 #include <stddef.h>
+#if __has_include(<malloc.h>)
+#  include <malloc.h>
+#endif
 
 #include "cbu/malloc/visibility.h"
 
@@ -68,6 +71,15 @@ int cbu_posix_memalign(void**, size_t, size_t) noexcept
 size_t cbu_malloc_usable_size(void *) noexcept
   __attribute__((__cold__, __pure__)) cbu_malloc_visibility_default;
 
+// Allocates n blocks of size bytes into out, and returns the number of blocks
+// allocated (less than n only if memory is exhausted)
+size_t cbu_malloc_batch(size_t size, size_t n, void **out) noexcept
+  __attribute__((__nonnull__(3))) cbu_malloc_visibility_default;
+
+// Frees n blocks.  The contents of ptrs are clobbered.
+void cbu_free_batch(void **ptrs, size_t n) noexcept
+  cbu_malloc_visibility_default;
+
 int cbu_malloc_trim(size_t) noexcept
 #ifndef CBU_NEED_MALLOC_TRIM
   __attribute__((__cold__))
@@ -75,4 +87,25 @@ int cbu_malloc_trim(size_t) noexcept
   cbu_malloc_visibility_default
   ;
 
+#if defined __GLIBC__ && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+struct mallinfo2 cbu_mallinfo2() noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+#endif
+
+void cbu_malloc_stats() noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Starts recording allocations and frees to <prefix>.<pid>.<tid>.trace,
+// one file per thread (see trace_format.h).  Recording starts at startup if
+// environment variable CBU_MALLOC_TRACE is set to the prefix.
+// Returns 0 on success, or an errno value (ENOSYS unless compiled with
+// CBU_MALLOC_TRACE).
+int cbu_malloc_trace_start(const char *prefix) noexcept
+  __attribute__((__cold__, __nonnull__(1))) cbu_malloc_visibility_default;
+
+// Stops recording and writes out buffered events.  Called on exit.
+void cbu_malloc_trace_stop() noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
 } // extern "C"
@@ -34,22 +34,27 @@
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/common/procutil.h"
+#include "cbu/malloc/trace.h"
 #include "cbu/malloc/visibility.h"
 
 namespace {
 
 namespace alloc = cbu::alloc;
+namespace trace = cbu::malloc_trace;
 
 extern "C" void* new_nothrow(size_t n, const std::nothrow_t&) noexcept {
   // C standard says malloc(0) may or may not return NULL
   // C++ standard says ::operator new(0) must reutrn a non-NULL pointer
   if (n == 0) n = 1;
-  return alloc::allocate(n);
+  void* r = alloc::allocate(n);
+  trace::on_alloc(trace::kMalloc, r, n);
+  return r;
 }
 
 extern "C" void* new_throw(size_t n) {
   if (n == 0) n = 1;
   void* r = alloc::allocate(n);
+  trace::on_alloc(trace::kMalloc, r, n);
 #ifndef CBU_ASSUME_MEMORY_ALLOCATION_NEVER_FAILS
   if (r == nullptr)
     throw std::bad_alloc();
@@ -69,6 +74,7 @@ extern "C" void* new_aligned(size_t n, std::align_val_t alignment) {
   }
   void* ptr = alloc::allocate(
       n, alloc::AllocateOptions().with_align(size_t(alignment)));
+  trace::on_alloc(trace::kMemalign, ptr, n, size_t(alignment));
 #ifndef CBU_ASSUME_MEMORY_ALLOCATION_NEVER_FAILS
   if (ptr == nullptr) throw std::bad_alloc();
 #endif
@@ -79,12 +85,18 @@ extern "C" void* new_aligned_nothrow(size_t n, std::align_val_t alignment,
                                      const std::nothrow_t&) noexcept {
   if (n == 0) n = 1;
   if (!alloc::is_alignment_valid(size_t(alignment))) return nullptr;
-  return alloc::allocate(
+  void* ptr = alloc::allocate(
       n, alloc::AllocateOptions().with_align(size_t(alignment)));
+  trace::on_alloc(trace::kMemalign, ptr, n, size_t(alignment));
+  return ptr;
 }
 
-extern "C" void delete_regular(void* p) noexcept { alloc::reclaim(p); }
+extern "C" void delete_regular(void* p) noexcept {
+  trace::on_free(p);
+  alloc::reclaim(p);
+}
 extern "C" void delete_sized(void* p, size_t size) noexcept {
+  trace::on_free(p);
   alloc::reclaim(p, size);
 }
 
@@ -172,7 +184,10 @@ namespace cbu {
 void* new_realloc(void* ptr, size_t n) {
   if (n == 0)
     n = 1;
-  ptr = alloc::reallocate(ptr, n);
+  uint64_t trace_start = trace::on_realloc_start();
+  void* res = alloc::reallocate(ptr, n);
+  trace::on_realloc(trace_start, ptr, n, res);
+  ptr = res;
 #ifndef CBU_ASSUME_MEMORY_ALLOCATION_NEVER_FAILS
   if (ptr == NULL)
     throw std::bad_alloc();
@@ -189,8 +204,11 @@ void* new_aligned_realloc(void* ptr, size_t n, size_t alignment) {
     throw std::bad_alloc();
 #endif
   }
-  ptr = alloc::reallocate(
+  uint64_t trace_start = trace::on_realloc_start();
+  void* res = alloc::reallocate(
       ptr, n, alloc::AllocateOptions().with_align(size_t(alignment)));
+  trace::on_realloc(trace_start, ptr, n, res);
+  ptr = res;
 #ifndef CBU_ASSUME_MEMORY_ALLOCATION_NEVER_FAILS
   if (ptr == nullptr) throw std::bad_alloc();
 #endif
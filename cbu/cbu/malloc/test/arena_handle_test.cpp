@@ -0,0 +1,77 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Pages an arena handle purges must stay mapped until the handle is destroyed,
+// since destroy_arena_handle unmaps every mapping of the handle, and would
+// otherwise unmap whatever the kernel has put in the holes meanwhile.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cbu/alloc/alloc.h"
+
+namespace {
+
+constexpr size_t kBlockSize = 1024 * 1024;
+// Well beyond twice the minimum trim threshold
+constexpr unsigned kBlocks = 64;
+
+}  // namespace
+
+int main() {
+  cbu::alloc::ArenaHandle* handle = cbu::alloc::create_arena_handle();
+  if (handle == nullptr) {
+    fprintf(stderr, "create_arena_handle failed\n");
+    return 1;
+  }
+  cbu::alloc::AllocateOptions options{.arena = handle};
+
+  void* blocks[kBlocks];
+  for (unsigned i = 0; i < kBlocks; ++i) {
+    blocks[i] = cbu::alloc::allocate(kBlockSize, options);
+    if (blocks[i] == nullptr) {
+      fprintf(stderr, "allocate failed\n");
+      return 1;
+    }
+    // Dirty pages are the ones to trim
+    memset(blocks[i], 1, kBlockSize);
+  }
+  for (void* p : blocks) cbu::alloc::reclaim(p);
+
+  int err = 0;
+  for (unsigned i = 0; i < kBlocks; ++i) {
+    if (msync(blocks[i], kBlockSize, MS_ASYNC) != 0) {
+      fprintf(stderr, "Block %u was unmapped before destroy: %m\n", i);
+      err = 1;
+    }
+  }
+  cbu::alloc::destroy_arena_handle(handle);
+  if (err == 0) puts("OK");
+  return err;
+}
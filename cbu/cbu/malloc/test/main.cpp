@@ -29,16 +29,20 @@
 #include <malloc.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <atomic>
+#include <new>
 #if (defined __i386__ || defined __x86_64__) && __has_include(<x86intrin.h>)
 # include <x86intrin.h>
 #endif
@@ -48,6 +52,18 @@
 extern "C" {
 void cbu_sized_free(void *, size_t) __attribute__((__weak__));
 void cbu_sized_free(void *p, size_t) { free(p); }
+size_t cbu_malloc_batch(size_t, size_t, void **) __attribute__((__weak__));
+size_t cbu_malloc_batch(size_t size, size_t n, void **out) {
+  for (size_t i = 0; i < n; ++i)
+    if ((out[i] = malloc(size)) == NULL)
+      return i;
+  return n;
+}
+void cbu_free_batch(void **, size_t) __attribute__((__weak__));
+void cbu_free_batch(void **ptrs, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    free(ptrs[i]);
+}
 } // extern "C"
 
 namespace {
@@ -213,24 +229,57 @@ void *realloc_check(void* = 0) {
   return nullptr;
 }
 
+// Check that a block beyond page alignment survives realloc, both growing
+// and shrinking
+bool realloc_aligned_check(char* p, size_t n) {
+  p[0] = 1;
+  p[n - 1] = 2;
+  p = (char*)realloc(p, n * 2);
+  if (p == nullptr || p[0] != 1 || p[n - 1] != 2)
+    return false;
+  p[n * 2 - 1] = 3;
+  p = (char*)realloc(p, n / 2);
+  if (p == nullptr || p[0] != 1)
+    return false;
+  free(p);
+  return true;
+}
+
 void* align_check(void* = 0) {
-  for (size_t boundary = 8; boundary <= 4096; boundary *= 2) {
-    void* p =
-        aligned_alloc(boundary, (rand_r(&seed) % 8192 + 1 + boundary - 1) /
-                                    boundary * boundary);
+  // Beyond the page size, 2 MiB blocks come from the arena, and 64 MiB
+  // blocks are mapped directly
+  for (size_t boundary = 8; boundary <= 64 * 1024 * 1024; boundary *= 2) {
+    size_t n = (rand_r(&seed) % 8192 + 1 + boundary - 1) / boundary * boundary;
+    void* p = aligned_alloc(boundary, n);
     if ((uintptr_t)p % boundary) {
       fprintf (stderr, "Misalign %p on %zu boundary.\n", p, boundary);
       return (void *)1;
     }
     void* q = nullptr;
+    size_t m = rand_r(&seed) % 8192 + 1;
     // posix_memalign is marked as warn_unused_result
-    if (posix_memalign(&q, boundary, rand_r(&seed) % 8192 + 1) == 0) {}
+    if (posix_memalign(&q, boundary, m) == 0) {}
     if ((uintptr_t)q % boundary) {
       fprintf (stderr, "Misalign %p on %zu boundary.\n", q, boundary);
       return (void *)1;
     }
-    free(p);
+    // Sized (and aligned) delete
+    void* r = operator new(m, std::align_val_t(boundary));
+    if ((uintptr_t)r % boundary) {
+      fprintf (stderr, "Misalign %p on %zu boundary.\n", r, boundary);
+      return (void *)1;
+    }
+    memset(r, 0, m);
+    operator delete(r, m, std::align_val_t(boundary));
     free(q);
+    if (boundary > 4096) {
+      if (!realloc_aligned_check((char*)p, n)) {
+        fprintf (stderr, "realloc failed on %zu boundary.\n", boundary);
+        return (void *)1;
+      }
+      continue;
+    }
+    free(p);
   }
   void* p = valloc(rand_r(&seed) % 8192 + 1);
   if ((uintptr_t)p % 4096)
@@ -296,6 +345,40 @@ void performance_test() {
   printf(" %12.3g %12.3g\n", perf.v(1), perf.v(2));
 }
 
+// Allocate N blocks of M bytes and free them together, ROUNDS times
+template <bool BATCH, size_t ROUNDS, size_t N, size_t M>
+[[gnu::noinline]]
+void performance_batch() {
+  Perf perf;
+
+  static void *p[N];
+  double alloc_time = 0, free_time = 0;
+  for (size_t r=0; r<ROUNDS; ++r) {
+    perf.tick(0);
+    if (BATCH) {
+      if (cbu_malloc_batch(M, N, p) != N)
+        abort();
+    } else {
+      for (size_t k=0; k<N; ++k)
+        p[k] = malloc(M);
+    }
+    for (size_t k=0; k<N; ++k)
+      *(size_t *)p[k] = k;
+    perf.tick(1);
+    if (BATCH) {
+      cbu_free_batch(p, N);
+    } else {
+      for (size_t k=0; k<N; ++k)
+        free(p[k]);
+    }
+    perf.tick(2);
+    alloc_time += perf.v(1);
+    free_time += perf.v(2);
+  }
+
+  printf(" %12.3g %12.3g\n", alloc_time, free_time);
+}
+
 template <size_t N, size_t MAXBLOCK>
 [[gnu::noinline]]
 void performance_realloc() {
@@ -330,6 +413,27 @@ void performance_realloc() {
   printf(" %12.3g %12.3g %12.3g\n", perf.v(1), perf.v(2), perf.v(3));
 }
 
+// Grows a buffer step by step, touching each new page, like a growing
+// vector or string would
+template <size_t MAXSIZE, size_t STEP>
+[[gnu::noinline]]
+void performance_realloc_grow() {
+  Perf perf;
+
+  char *p = nullptr;
+  for (size_t size = STEP; size <= MAXSIZE; size += STEP) {
+    p = static_cast<char *>(realloc(p, size));
+    for (size_t i = size - STEP; i < size; i += 4096)
+      p[i] = 1;
+  }
+
+  perf.tick(1);
+
+  free(p);
+
+  printf(" %12.3g\n", perf.v(1));
+}
+
 template <size_t N>
 [[gnu::noinline]]
 void performance_real() {
@@ -358,6 +462,111 @@ void performance_real() {
   printf(" %12.3g\n", perf.v(1));
 }
 
+// Single-producer single-consumer queue of pointers
+class PipelineQueue {
+ public:
+  void push(void* p) {
+    size_t t = tail_.load(std::memory_order_relaxed);
+    while (t - head_.load(std::memory_order_acquire) >= kCapacity)
+      sched_yield();
+    items_[t % kCapacity] = p;
+    tail_.store(t + 1, std::memory_order_release);
+  }
+
+  void* pop() {
+    size_t h = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) == h)
+      sched_yield();
+    void* p = items_[h % kCapacity];
+    head_.store(h + 1, std::memory_order_release);
+    return p;
+  }
+
+ private:
+  static constexpr size_t kCapacity = 4096;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  void* items_[kCapacity];
+};
+
+// Current RSS in KiB, read without allocating memory
+long current_rss() {
+  char buf[128] = {};
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (read(fd, buf, sizeof(buf) - 1) < 0) {}
+  close(fd);
+  long pages = 0, resident = 0;
+  sscanf(buf, "%ld%ld", &pages, &resident);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void* pipeline_consumer(void* arg) {
+  PipelineQueue* queue = static_cast<PipelineQueue*>(arg);
+  while (void* p = queue->pop())
+    free(p);
+  return nullptr;
+}
+
+// One thread allocates, CONSUMERS threads free.
+// Prints the time and how much RSS grew (in KiB) while the consumers are
+// still alive.
+template <size_t CONSUMERS, size_t N, size_t M>
+[[gnu::noinline]]
+void performance_pipeline() {
+  static PipelineQueue queues[CONSUMERS];
+  pthread_t id[CONSUMERS];
+  for (size_t i = 0; i < CONSUMERS; ++i)
+    pthread_create(&id[i], NULL, pipeline_consumer, &queues[i]);
+
+  long rss = current_rss();
+  Perf perf;
+  for (size_t k = 0; k < N; ++k) {
+    void* p = malloc(rand_r(&seed) % M + 1);
+    *static_cast<char*>(p) = 0;
+    queues[k % CONSUMERS].push(p);
+  }
+  rss = current_rss() - rss;
+  for (size_t i = 0; i < CONSUMERS; ++i)
+    queues[i].push(nullptr);
+  for (size_t i = 0; i < CONSUMERS; ++i)
+    pthread_join(id[i], nullptr);
+  perf.tick(1);
+
+  printf(" %12.3g %12ld\n", perf.v(1), rss);
+}
+
+template <size_t ROUNDS, size_t N, size_t M>
+void* scaling_worker(void*) {
+  void* p[N];
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    for (size_t k = 0; k < N; ++k) {
+      p[k] = malloc(rand_r(&seed) % M + 1);
+      *static_cast<char*>(p[k]) = 0;
+    }
+    for (size_t k = 0; k < N; ++k)
+      free(p[k]);
+  }
+  return nullptr;
+}
+
+// THREADS threads do the same work concurrently, so ideally the time
+// doesn't grow with THREADS.
+template <size_t THREADS, size_t ROUNDS, size_t N, size_t M>
+[[gnu::noinline]]
+void performance_scaling() {
+  pthread_t id[THREADS];
+  Perf perf;
+  for (size_t i = 0; i < THREADS; ++i)
+    pthread_create(&id[i], NULL, scaling_worker<ROUNDS, N, M>, nullptr);
+  for (size_t i = 0; i < THREADS; ++i)
+    pthread_join(id[i], nullptr);
+  perf.tick(1);
+
+  printf(" %12.3g\n", perf.v(1));
+}
+
 } // namespace
 
 int main (int argc, char **argv) {
@@ -473,15 +682,33 @@ int main (int argc, char **argv) {
     TEST(" 1MiB calloc:", performance_test<true, 256,1024*1024>());
     TEST("32MiB calloc:", performance_test<true,16,32*1024*1024>());
 
+    TEST("  48B loop:", performance_batch<false, 16, 1048576, 48>());
+    TEST("  48B batch:", performance_batch<true, 16, 1048576, 48>());
+
     TEST("1KiB realloc:", performance_realloc<65536,1024>());
     TEST("1MiB realloc:", performance_realloc<128,1024*1024>());
     TEST("32MiB realloc:", performance_realloc<16,32*1024*1024>());
+    TEST("Grow to 256MiB:",
+         performance_realloc_grow<256*1024*1024, 1024*1024>());
 
     TEST("\"Real\" 128", performance_real<128>());
     TEST("\"Real\" 1024", performance_real<1024>());
     TEST("\"Real\" 2048", performance_real<2048>());
     TEST("\"Real\" 4096", performance_real<4096>());
     TEST("\"Real\" 8192", performance_real<8192>());
+
+    TEST("Pipeline 1x256B", performance_pipeline<1, 1048576, 256>());
+    TEST("Pipeline 4x256B", performance_pipeline<4, 1048576, 256>());
+    TEST("Pipeline 16x1KiB", performance_pipeline<16, 1048576, 1024>());
+
+    TEST("64KiB malloc x1", performance_scaling<1, 1024, 16, 64*1024>());
+    TEST("64KiB malloc x4", performance_scaling<4, 1024, 16, 64*1024>());
+    TEST("64KiB malloc x16", performance_scaling<16, 1024, 16, 64*1024>());
+    TEST("64KiB malloc x64", performance_scaling<64, 1024, 16, 64*1024>());
+    TEST(" 1MiB malloc x1", performance_scaling<1, 256, 4, 1024*1024>());
+    TEST(" 1MiB malloc x4", performance_scaling<4, 256, 4, 1024*1024>());
+    TEST(" 1MiB malloc x16", performance_scaling<16, 256, 4, 1024*1024>());
+    TEST(" 1MiB malloc x64", performance_scaling<64, 256, 4, 1024*1024>());
   }
 
   struct rusage ru;
@@ -511,5 +738,7 @@ int main (int argc, char **argv) {
   puts("RSS");
   sys();
 
+  malloc_stats();
+
   return 0;
 }
@@ -0,0 +1,104 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// Latency of the first write to freshly allocated large buffers, as on a hot
+// path that receives into new buffers: without populate, every page faults on
+// first touch; with AllocateOptions::populate or after prewarm, the faults
+// are taken at allocation (off the hot path) or at startup.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "cbu/alloc/alloc.h"
+
+namespace {
+
+constexpr size_t kBufferSize = 256 * 1024;
+constexpr unsigned kBuffers = 2048;  // 512 MiB in total
+
+using cbu::alloc::AllocateOptions;
+
+uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+struct Result {
+  double alloc_total_ms;
+  uint64_t p50, p99, p999, max;  // Nanoseconds per first write
+};
+
+[[gnu::noinline]] Result run(AllocateOptions options) {
+  std::vector<void*> buffers(kBuffers);
+  std::vector<uint64_t> lat(kBuffers);
+  uint64_t alloc_ns = 0;
+  for (unsigned i = 0; i < kBuffers; ++i) {
+    uint64_t t0 = now_ns();
+    buffers[i] = cbu::alloc::allocate(kBufferSize, options);
+    uint64_t t1 = now_ns();
+    // The hot path
+    memset(buffers[i], int(i), kBufferSize);
+    uint64_t t2 = now_ns();
+    alloc_ns += t1 - t0;
+    lat[i] = t2 - t1;
+  }
+  for (void* p : buffers) cbu::alloc::reclaim(p);
+  // Return everything, so that the next run starts from unpopulated memory
+  cbu::alloc::trim(0);
+
+  std::sort(lat.begin(), lat.end());
+  return {alloc_ns / 1e6, lat[kBuffers / 2], lat[kBuffers * 99 / 100],
+          lat[kBuffers * 999 / 1000], lat.back()};
+}
+
+void print(const char* name, const Result& r) {
+  printf("%12s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, r.alloc_total_ms,
+         r.p50 / 1e3, r.p99 / 1e3, r.p999 / 1e3, r.max / 1e3);
+}
+
+}  // namespace
+
+int main() {
+  Result plain = run({});
+  Result populate = run(AllocateOptions().with_populate(true));
+  cbu::alloc::prewarm(kBuffers * kBufferSize);
+  Result prewarmed = run({});
+
+  printf("%u buffers of %zu KiB; first write latency in microseconds\n",
+         kBuffers, kBufferSize / 1024);
+  printf("%12s %10s %10s %10s %10s %10s\n", "", "alloc ms", "p50", "p99",
+         "p99.9", "max");
+  print("default:", plain);
+  print("populate:", populate);
+  print("prewarm:", prewarmed);
+  return 0;
+}
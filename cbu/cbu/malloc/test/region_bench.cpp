@@ -0,0 +1,119 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Compares cbu::alloc::Region against plain malloc/free (and the default
+// std::pmr resource, i.e., operator new) for a request-shaped pattern:
+// each request makes a few hundred small allocations that all die at the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "cbu/alloc/region.h"
+
+namespace {
+
+constexpr unsigned kRequests = 100000;
+constexpr unsigned kAllocsPerRequest = 256;
+constexpr unsigned kStringsPerRequest = 64;
+
+double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+inline unsigned next_rand(unsigned* seed) {
+  return (*seed = 1664525 * *seed + 1013904223) >> 8;
+}
+
+// Raw allocations of 16 to 512 bytes, freed at the end of each request
+template <typename Alloc, typename EndRequest>
+[[gnu::noinline]] double raw_requests(Alloc alloc, EndRequest end_request) {
+  unsigned seed = 1;
+  void* ptrs[kAllocsPerRequest];
+  double start = now();
+  for (unsigned r = 0; r < kRequests; ++r) {
+    for (unsigned i = 0; i < kAllocsPerRequest; ++i) {
+      size_t size = 16 + next_rand(&seed) % 497;
+      ptrs[i] = alloc(size);
+      memset(ptrs[i], i, 16);
+    }
+    end_request(ptrs);
+  }
+  return now() - start;
+}
+
+// A vector of strings built through a memory resource
+[[gnu::noinline]] double pmr_requests(std::pmr::memory_resource* resource,
+                                      cbu::alloc::Region* region) {
+  unsigned seed = 1;
+  double start = now();
+  for (unsigned r = 0; r < kRequests; ++r) {
+    {
+      std::pmr::vector<std::pmr::string> v(resource);
+      for (unsigned i = 0; i < kStringsPerRequest; ++i)
+        v.emplace_back(24 + next_rand(&seed) % 200, 'x');
+    }
+    if (region) region->reset();
+  }
+  return now() - start;
+}
+
+}  // namespace
+
+int main() {
+  double t_malloc = raw_requests(
+      [](size_t size) { return malloc(size); },
+      [](void** ptrs) {
+        for (unsigned i = 0; i < kAllocsPerRequest; ++i) free(ptrs[i]);
+      });
+
+  cbu::alloc::Region region;
+  double t_region = raw_requests(
+      [&region](size_t size) { return region.allocate(size); },
+      [&region](void**) { region.reset(); });
+
+  double t_pmr_default = pmr_requests(std::pmr::new_delete_resource(), nullptr);
+  cbu::alloc::RegionResource resource(&region);
+  double t_pmr_region = pmr_requests(&resource, &region);
+
+  printf("%u requests, %u allocations each\n", kRequests, kAllocsPerRequest);
+  printf("%20s %8.3fs\n", "malloc/free:", t_malloc);
+  printf("%20s %8.3fs\n", "Region:", t_region);
+  printf("%u requests, %u pmr::strings each\n", kRequests, kStringsPerRequest);
+  printf("%20s %8.3fs\n", "new_delete_resource:", t_pmr_default);
+  printf("%20s %8.3fs\n", "RegionResource:", t_pmr_region);
+  printf("Region reserved %zu bytes\n", region.bytes_reserved());
+  return 0;
+}
@@ -0,0 +1,429 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replays malloc traces recorded with CBU_MALLOC_TRACE against the malloc
+// this program is linked with (cbumalloc_replay), glibc (ptmalloc_replay), or
+// any allocator preloaded into ptmalloc_replay with LD_PRELOAD, and reports
+// time and memory usage.
+//
+// Usage: <program> [-n] <prefix>.<pid>.*.trace
+//
+// Give all trace files of one process.  Each file is replayed by a thread of
+// its own, as fast as possible.  Events of each thread are replayed in order,
+// and a thread freeing or reallocating a block allocated by another thread
+// waits until it has been allocated, so the replay is deterministic up to the
+// interleaving of independent events.  Frees of blocks allocated before
+// recording started are skipped.  Unless -n is given, one byte of every page
+// of an allocated block is written, as the traced program presumably did.
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <type_traits>
+
+#include "cbu/malloc/trace_format.h"
+
+namespace {
+
+using namespace cbu::malloc_trace;
+
+[[noreturn]] void die(const char* msg, const char* arg = "") {
+  fprintf(stderr, "%s%s\n", msg, arg);
+  exit(1);
+}
+
+// A growable array outside the heap, so that the allocator under test only
+// sees the replayed workload
+template <typename T>
+class MapArray {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+ public:
+  MapArray() = default;
+  MapArray(const MapArray&) = delete;
+  MapArray& operator=(const MapArray&) = delete;
+  ~MapArray() { release(); }
+
+  T* data() noexcept { return p_; }
+  size_t size() const noexcept { return n_; }
+  T& operator[](size_t i) noexcept { return p_[i]; }
+  T* begin() noexcept { return p_; }
+  T* end() noexcept { return p_ + n_; }
+
+  void push_back(const T& v) {
+    if (n_ == cap_) reserve(cap_ ? cap_ * 2 : 4096);
+    p_[n_++] = v;
+  }
+
+  // New elements are zero
+  void resize(size_t n) {
+    if (n > cap_) reserve(n);
+    n_ = n;
+  }
+
+  void release() noexcept {
+    if (p_) munmap(p_, cap_ * sizeof(T));
+    p_ = nullptr;
+    n_ = cap_ = 0;
+  }
+
+ private:
+  void reserve(size_t cap) {
+    void* p = p_ ? mremap(p_, cap_ * sizeof(T), cap * sizeof(T), MREMAP_MAYMOVE)
+                 : mmap(nullptr, cap * sizeof(T), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) die("Out of memory");
+    p_ = static_cast<T*>(p);
+    cap_ = cap;
+  }
+
+  T* p_ = nullptr;
+  size_t n_ = 0;
+  size_t cap_ = 0;
+};
+
+constexpr uint32_t kNoObject = UINT32_MAX;
+
+// Stands for NULL returned by malloc(0) in the object table
+void* const kNullObject = reinterpret_cast<void*>(1);
+
+// An event as loaded
+struct Event {
+  uint8_t op;          // kFree also stands for realloc to NULL
+  uint64_t size;
+  uint64_t align;
+  uint64_t ns;
+  uint64_t end_ns;     // When the new block of a realloc was returned
+  uintptr_t addr;      // Address freed or reallocated
+  uintptr_t new_addr;  // Address allocated
+};
+
+// An event to replay
+struct Action {
+  uint64_t size;
+  uint32_t align;
+  uint32_t in;   // Object freed or reallocated
+  uint32_t out;  // Object allocated
+  uint8_t op;
+};
+
+struct Thread {
+  MapArray<Event> events;
+  MapArray<Action> actions;
+  pthread_t id;
+  size_t unknown_frees = 0;
+};
+
+// An address allocated or freed, in the order of time
+struct AddrAction {
+  uint64_t ns;
+  uint32_t thread;
+  uint32_t index;
+  bool alloc;
+
+  bool operator<(const AddrAction& o) const noexcept {
+    // Frees are timed before, and allocations after, so on a tie, the free
+    // must have come first
+    if (ns != o.ns) return ns < o.ns;
+    return alloc < o.alloc;
+  }
+};
+
+void load(Thread* thread, const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) die("Failed to open ", path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < ssize_t(sizeof(kTraceMagic)))
+    die("Not a trace: ", path);
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) die("Failed to read ", path);
+  const char* p = static_cast<const char*>(map);
+  const char* end = p + st.st_size;
+  uint64_t tid, ns;
+  if (memcmp(p, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+      !(p = get_varint(p + sizeof(kTraceMagic), end, &tid)) ||
+      !(p = get_varint(p, end, &ns)))
+    die("Not a trace: ", path);
+
+  uintptr_t last_addr = 0;
+  auto get_addr = [&](uintptr_t* addr) {
+    uint64_t v;
+    if (!(p = get_varint(p, end, &v))) return false;
+    last_addr += zigzag_decode(v);
+    *addr = last_addr;
+    return true;
+  };
+
+  while (p < end) {
+    // Stop at a truncated event (e.g., if the program was killed)
+    Event e = {};
+    uint8_t op = *p++;
+    uint64_t delta;
+    if (!(p = get_varint(p, end, &delta))) break;
+    ns += delta;
+    e.op = op & kOpMask;
+    e.ns = e.end_ns = ns;
+    bool ok = true;
+    switch (e.op) {
+      case kMemalign:
+        ok = (p = get_varint(p, end, &e.align));
+        [[fallthrough]];
+      case kMalloc:
+      case kCalloc:
+        ok = ok && (p = get_varint(p, end, &e.size)) && get_addr(&e.new_addr);
+        break;
+      case kRealloc:
+        ok = (p = get_varint(p, end, &delta)) && get_addr(&e.addr) &&
+             (p = get_varint(p, end, &e.size)) &&
+             ((op & kNullResult) || get_addr(&e.new_addr));
+        e.end_ns += delta;
+        if (op & kNullResult) e.op = kFree;
+        break;
+      case kFree:
+        ok = get_addr(&e.addr);
+        break;
+      default:
+        die("Corrupt trace: ", path);
+    }
+    if (!ok) break;
+    thread->events.push_back(e);
+  }
+  if (p != end) fprintf(stderr, "Warning: %s is truncated\n", path);
+  munmap(map, st.st_size);
+}
+
+// Converts events to actions, assigning object IDs, and returns the number of
+// objects
+uint32_t resolve_objects(Thread* threads, size_t n) {
+  MapArray<AddrAction> actions;
+  for (size_t t = 0; t < n; ++t) {
+    threads[t].actions.resize(threads[t].events.size());
+    for (size_t i = 0; i < threads[t].events.size(); ++i) {
+      const Event& e = threads[t].events[i];
+      threads[t].actions[i] = {e.size, uint32_t(e.align), kNoObject,
+                               kNoObject, e.op};
+      if (e.addr) actions.push_back({e.ns, uint32_t(t), uint32_t(i), false});
+      if (e.new_addr)
+        actions.push_back({e.end_ns, uint32_t(t), uint32_t(i), true});
+    }
+  }
+  std::stable_sort(actions.begin(), actions.end());
+
+  // Live addresses to objects, with linear probing
+  unsigned bits = 10;
+  while ((size_t(1) << bits) < actions.size()) ++bits;
+  size_t mask = (size_t(1) << bits) - 1;
+  struct Slot {
+    uintptr_t addr;
+    uint32_t object;
+  };
+  MapArray<Slot> table;
+  table.resize(mask + 1);
+  auto hash = [bits](uintptr_t addr) -> size_t {
+    return (addr * 0x9e3779b97f4a7c15) >> (64 - bits);
+  };
+
+  uint32_t objects = 0;
+  for (const AddrAction& a : actions) {
+    const Event& e = threads[a.thread].events[a.index];
+    Action& r = threads[a.thread].actions[a.index];
+    uintptr_t addr = a.alloc ? e.new_addr : e.addr;
+    size_t i = hash(addr);
+    while (table[i].addr && table[i].addr != addr) i = (i + 1) & mask;
+    if (a.alloc) {
+      if (objects == kNoObject) die("Too many objects");
+      // An address allocated twice means a free wasn't recorded; forget
+      // the old object
+      table[i] = {addr, objects};
+      r.out = objects++;
+    } else if (table[i].addr) {
+      r.in = table[i].object;
+      // Remove with backward shift
+      for (size_t j = i;;) {
+        j = (j + 1) & mask;
+        if (!table[j].addr) break;
+        // Move table[j] to the hole unless its home is between them
+        if (((j - hash(table[j].addr)) & mask) < ((j - i) & mask)) continue;
+        table[i] = table[j];
+        i = j;
+      }
+      table[i].addr = 0;
+    }
+  }
+  for (size_t t = 0; t < n; ++t) threads[t].events.release();
+  return objects;
+}
+
+MapArray<void*>* g_objects;
+bool g_touch = true;
+
+void* wait_for(uint32_t object) {
+  std::atomic_ref<void*> slot((*g_objects)[object]);
+  for (unsigned spins = 0;; ++spins) {
+    if (void* p = slot.load(std::memory_order_acquire)) return p;
+    if (spins >= 64) sched_yield();
+  }
+}
+
+void publish(uint32_t object, void* p, size_t size) {
+  if (p == nullptr) {
+    if (size) die("Out of memory");
+    p = kNullObject;
+  } else if (g_touch) {
+    for (size_t i = 0; i < size; i += 4096) static_cast<char*>(p)[i] = 1;
+  }
+  std::atomic_ref<void*>((*g_objects)[object])
+      .store(p, std::memory_order_release);
+}
+
+void* replay(void* arg) {
+  Thread* thread = static_cast<Thread*>(arg);
+  for (const Action& e : thread->actions) {
+    void* old = nullptr;
+    if (e.in != kNoObject) {
+      old = wait_for(e.in);
+      if (old == kNullObject) old = nullptr;
+    }
+    switch (e.op) {
+      case kMalloc:
+        publish(e.out, malloc(e.size), e.size);
+        break;
+      case kCalloc:
+        publish(e.out, calloc(1, e.size), e.size);
+        break;
+      case kMemalign:
+        publish(e.out, memalign(e.align, e.size), e.size);
+        break;
+      case kRealloc:
+        // Blocks allocated before recording started are replaced with new
+        // blocks
+        publish(e.out, realloc(old, e.size), e.size);
+        break;
+      case kFree:
+        // A block allocated before recording started
+        if (e.in == kNoObject) ++thread->unknown_frees;
+        free(old);
+        break;
+    }
+  }
+  return nullptr;
+}
+
+// Reads VmHWM and VmRSS (KiB) without allocating memory
+void read_rss(long* hwm, long* rss) {
+  char buf[4096] = {};
+  *hwm = *rss = -1;
+  int fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  ssize_t l = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (l <= 0) return;
+  if (const char* s = strstr(buf, "\nVmHWM:")) *hwm = atol(s + 7);
+  if (const char* s = strstr(buf, "\nVmRSS:")) *rss = atol(s + 7);
+}
+
+// Resets VmHWM to the current RSS (Linux 4.0+)
+bool reset_hwm() {
+  int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  bool ok = write(fd, "5", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+double seconds(const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+    g_touch = false;
+    ++first;
+  }
+  size_t n = argc - first;
+  if (n == 0) die("Usage: trace_replay [-n] <prefix>.<pid>.*.trace");
+
+  Thread* threads = new Thread[n];
+  size_t events = 0;
+  for (size_t i = 0; i < n; ++i) {
+    load(&threads[i], argv[first + i]);
+    events += threads[i].events.size();
+  }
+  uint32_t objects = resolve_objects(threads, n);
+  MapArray<void*> object_table;
+  object_table.resize(objects);
+  g_objects = &object_table;
+
+  long base_hwm, base_rss;
+  read_rss(&base_hwm, &base_rss);
+  bool hwm_reset = reset_hwm();
+
+  rusage ru0, ru1;
+  timespec t0, t1;
+  getrusage(RUSAGE_SELF, &ru0);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (size_t i = 0; i < n; ++i) {
+    if (pthread_create(&threads[i].id, nullptr, replay, &threads[i]) != 0)
+      die("Failed to create thread");
+  }
+  for (size_t i = 0; i < n; ++i) pthread_join(threads[i].id, nullptr);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  getrusage(RUSAGE_SELF, &ru1);
+
+  long hwm, rss;
+  read_rss(&hwm, &rss);
+
+  size_t unknown_frees = 0;
+  for (size_t i = 0; i < n; ++i) unknown_frees += threads[i].unknown_frees;
+  printf("Threads: %zu, events: %zu, objects: %u, unknown frees: %zu\n", n,
+         events, objects, unknown_frees);
+  printf("Time (s): wall %.3f, user %.3f, sys %.3f\n",
+         (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+         seconds(ru1.ru_utime) - seconds(ru0.ru_utime),
+         seconds(ru1.ru_stime) - seconds(ru0.ru_stime));
+  // The trace itself is in memory, so show RSS before replaying
+  printf("RSS before replay (KiB): %ld\n", base_rss);
+  printf("Peak RSS (KiB): %ld%s\n", hwm,
+         hwm_reset ? "" : " (including loading the trace)");
+  printf("Final RSS (KiB): %ld\n", rss);
+  return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/malloc/trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <new>
+
+#include "cbu/fsyscall/fsyscall.h"
+#include "cbu/malloc/malloc.h"
+#include "cbu/sys/low_level_mutex.h"
+
+#ifdef CBU_MALLOC_TRACE
+
+namespace cbu::malloc_trace {
+
+std::atomic<bool> g_tracing{false};
+
+namespace {
+
+constexpr size_t kBufferBytes = 64 * 1024;
+// Op byte and at most 5 varints
+constexpr size_t kMaxEventBytes = 1 + 5 * kMaxVarintBytes;
+
+// Events of a thread waiting to be written.  Placed at the beginning of a
+// mapping of kBufferBytes, followed by the data.
+struct TraceBuffer {
+  TraceBuffer* prev;  // In g_buffers
+  TraceBuffer* next;
+  // Protects everything below; only contended while tracing is stopped
+  LowLevelMutex lock;
+  unsigned generation;
+  int fd;  // -1: Not opened yet; -2: Failed to open
+  pid_t tid;
+  uint64_t last_ns;
+  uintptr_t last_addr;
+  size_t len;
+
+  char* data() noexcept { return reinterpret_cast<char*>(this + 1); }
+};
+
+constexpr size_t kBufferCapacity = kBufferBytes - sizeof(TraceBuffer);
+
+// Protects g_buffers and g_prefix, and serializes starting and stopping
+constinit LowLevelMutex g_registry_lock;
+constinit TraceBuffer* g_buffers = nullptr;
+constinit char g_prefix[256];
+// Incremented on every start, so that buffers know to begin new files
+std::atomic<unsigned> g_generation{0};
+constinit bool g_initialized = false;
+pthread_key_t g_key;
+
+constinit thread_local TraceBuffer* t_buffer = nullptr;
+// Set while recording, so that allocations by pthread_setspecific or the
+// like aren't recorded recursively
+constinit thread_local bool t_busy = false;
+// The thread has destroyed its buffer; don't create another one
+constinit thread_local bool t_exited = false;
+
+uint64_t timespec_ns(const timespec& ts) noexcept {
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Begins a new file for the current generation
+void reset_buffer(TraceBuffer* buf, unsigned generation) noexcept {
+  buf->generation = generation;
+  buf->fd = -1;
+  buf->last_ns = now_ns();
+  buf->last_addr = 0;
+  char* p = buf->data();
+  memcpy(p, kTraceMagic, sizeof(kTraceMagic));
+  p += sizeof(kTraceMagic);
+  p = put_varint(p, buf->tid);
+  p = put_varint(p, buf->last_ns);
+  buf->len = p - buf->data();
+}
+
+void write_all(int fd, const char* p, size_t n) noexcept {
+  while (n) {
+    ssize_t l = fsys_write(fd, p, n);
+    if (l > 0) {
+      p += l;
+      n -= l;
+    } else if (l == 0 || !fsys_errno(l, EINTR)) {
+      return;
+    }
+  }
+}
+
+void flush_buffer(TraceBuffer* buf) noexcept {
+  if (buf->len == 0) return;
+  if (buf->fd == -1) {
+    char path[sizeof(g_prefix) + 64];
+    snprintf(path, sizeof(path), "%s.%d.%d.trace", g_prefix, int(getpid()),
+             int(buf->tid));
+    int fd = fsys_open3(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    buf->fd = fsys_failure(fd) ? -2 : fd;
+  }
+  if (buf->fd >= 0) write_all(buf->fd, buf->data(), buf->len);
+  buf->len = 0;
+}
+
+void close_buffer(TraceBuffer* buf) noexcept {
+  flush_buffer(buf);
+  if (buf->fd >= 0) fsys_close(buf->fd);
+  buf->fd = -1;
+}
+
+// Called with g_registry_lock held
+void stop_locked() noexcept {
+  g_tracing.store(false, std::memory_order_relaxed);
+  for (TraceBuffer* buf = g_buffers; buf; buf = buf->next) {
+    std::lock_guard locker(buf->lock);
+    close_buffer(buf);
+  }
+}
+
+void destroy_buffer(void* arg) noexcept {
+  TraceBuffer* buf = static_cast<TraceBuffer*>(arg);
+  t_busy = true;
+  {
+    std::lock_guard locker(g_registry_lock);
+    if (buf->prev)
+      buf->prev->next = buf->next;
+    else
+      g_buffers = buf->next;
+    if (buf->next) buf->next->prev = buf->prev;
+    std::lock_guard buf_locker(buf->lock);
+    if (g_tracing.load(std::memory_order_relaxed) &&
+        buf->generation == g_generation.load(std::memory_order_relaxed))
+      close_buffer(buf);
+  }
+  fsys_munmap(buf, kBufferBytes);
+  t_buffer = nullptr;
+  t_exited = true;
+  t_busy = false;
+}
+
+TraceBuffer* create_buffer() noexcept {
+  void* p = fsys_mmap(nullptr, kBufferBytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fsys_mmap_failed(p)) return nullptr;
+  TraceBuffer* buf = new (p) TraceBuffer();
+  buf->tid = fsys_gettid();
+  buf->fd = -1;
+  pthread_setspecific(g_key, buf);
+  std::lock_guard locker(g_registry_lock);
+  buf->next = g_buffers;
+  if (g_buffers) g_buffers->prev = buf;
+  g_buffers = buf;
+  t_buffer = buf;
+  return buf;
+}
+
+// Returns the buffer of the current thread locked, with room for an event,
+// or nullptr if the event shouldn't be recorded
+TraceBuffer* begin_event() noexcept {
+  if (t_busy) return nullptr;
+  TraceBuffer* buf = t_buffer;
+  if (buf == nullptr) {
+    if (t_exited) return nullptr;
+    t_busy = true;
+    buf = create_buffer();
+    t_busy = false;
+    if (buf == nullptr) return nullptr;
+  }
+  buf->lock.lock();
+  if (!g_tracing.load(std::memory_order_acquire)) {
+    buf->lock.unlock();
+    return nullptr;
+  }
+  if (unsigned gen = g_generation.load(std::memory_order_relaxed);
+      buf->generation != gen)
+    reset_buffer(buf, gen);
+  else if (buf->len > kBufferCapacity - kMaxEventBytes)
+    flush_buffer(buf);
+  return buf;
+}
+
+// Writes op and the time delta
+char* put_head(TraceBuffer* buf, uint8_t op, uint64_t ns) noexcept {
+  char* p = buf->data() + buf->len;
+  *p++ = op;
+  // Events may be timed before earlier ones finished recording
+  if (ns < buf->last_ns) ns = buf->last_ns;
+  p = put_varint(p, ns - buf->last_ns);
+  buf->last_ns = ns;
+  return p;
+}
+
+char* put_addr(TraceBuffer* buf, char* p, const void* ptr) noexcept {
+  uintptr_t addr = uintptr_t(ptr);
+  p = put_varint(p, zigzag_encode(int64_t(addr - buf->last_addr)));
+  buf->last_addr = addr;
+  return p;
+}
+
+void end_event(TraceBuffer* buf, char* p) noexcept {
+  buf->len = p - buf->data();
+  buf->lock.unlock();
+}
+
+void child_after_fork() noexcept {
+  // Only this thread exists in the child.  Buffered events belong to the
+  // parent, and files are shared with it.
+  g_tracing.store(false, std::memory_order_relaxed);
+  new (&g_registry_lock) LowLevelMutex();
+  for (TraceBuffer* buf = g_buffers; buf; buf = buf->next) {
+    new (&buf->lock) LowLevelMutex();
+    if (buf->fd >= 0) fsys_close(buf->fd);
+    buf->fd = -1;
+    buf->len = 0;
+  }
+}
+
+// Stop on exit, so that buffered events are written
+[[gnu::destructor]] void stop_on_exit() noexcept { cbu_malloc_trace_stop(); }
+
+// Start with the environment variable CBU_MALLOC_TRACE=<prefix>
+[[gnu::constructor]] void start_from_env() noexcept {
+  if (const char* prefix = getenv("CBU_MALLOC_TRACE"); prefix && *prefix)
+    cbu_malloc_trace_start(prefix);
+}
+
+}  // namespace
+
+uint64_t now_ns() noexcept {
+  timespec ts;
+  fsys_clock_gettime_auto(CLOCK_MONOTONIC, &ts);
+  return timespec_ns(ts);
+}
+
+void record_alloc(Op op, const void* ptr, size_t size, size_t align) noexcept {
+  if (ptr == nullptr) return;
+  uint64_t ns = now_ns();
+  TraceBuffer* buf = begin_event();
+  if (buf == nullptr) return;
+  char* p = put_head(buf, op, ns);
+  if (op == kMemalign) p = put_varint(p, align);
+  p = put_varint(p, size);
+  p = put_addr(buf, p, ptr);
+  end_event(buf, p);
+}
+
+void record_realloc(uint64_t start_ns, const void* old_ptr, size_t size,
+                    const void* ptr) noexcept {
+  if (old_ptr == nullptr) return record_alloc(kMalloc, ptr, size, 0);
+  // Failed; the old block is intact
+  if (ptr == nullptr && size != 0) return;
+  uint64_t ns = now_ns();
+  TraceBuffer* buf = begin_event();
+  if (buf == nullptr) return;
+  char* p = put_head(buf, kRealloc | (ptr ? 0 : kNullResult), start_ns);
+  p = put_varint(p, ns - start_ns);
+  p = put_addr(buf, p, old_ptr);
+  p = put_varint(p, size);
+  if (ptr) p = put_addr(buf, p, ptr);
+  end_event(buf, p);
+}
+
+void record_free(const void* ptr) noexcept {
+  if (ptr == nullptr) return;
+  uint64_t ns = now_ns();
+  TraceBuffer* buf = begin_event();
+  if (buf == nullptr) return;
+  char* p = put_head(buf, kFree, ns);
+  p = put_addr(buf, p, ptr);
+  end_event(buf, p);
+}
+
+}  // namespace cbu::malloc_trace
+
+using namespace cbu::malloc_trace;
+
+extern "C" int cbu_malloc_trace_start(const char* prefix) noexcept {
+  size_t l = strlen(prefix);
+  if (l == 0 || l >= sizeof(g_prefix)) return EINVAL;
+  std::lock_guard locker(g_registry_lock);
+  if (!g_initialized) {
+    if (pthread_key_create(&g_key, destroy_buffer) != 0) return EAGAIN;
+    pthread_atfork(nullptr, nullptr, child_after_fork);
+    g_initialized = true;
+  }
+  stop_locked();
+  memcpy(g_prefix, prefix, l + 1);
+  g_generation.fetch_add(1, std::memory_order_relaxed);
+  g_tracing.store(true, std::memory_order_release);
+  return 0;
+}
+
+extern "C" void cbu_malloc_trace_stop() noexcept {
+  std::lock_guard locker(g_registry_lock);
+  stop_locked();
+}
+
+#else  // !CBU_MALLOC_TRACE
+
+extern "C" int cbu_malloc_trace_start(const char*) noexcept { return ENOSYS; }
+extern "C" void cbu_malloc_trace_stop() noexcept {}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// Recording hooks called by the malloc and operator new implementations.
+// They compile to nothing unless CBU_MALLOC_TRACE is defined.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "cbu/malloc/trace_format.h"
+
+namespace cbu::malloc_trace {
+
+#ifdef CBU_MALLOC_TRACE
+
+extern std::atomic<bool> g_tracing;
+
+uint64_t now_ns() noexcept;
+void record_alloc(Op op, const void* ptr, size_t size, size_t align) noexcept;
+void record_realloc(uint64_t start_ns, const void* old_ptr, size_t size,
+                    const void* ptr) noexcept;
+void record_free(const void* ptr) noexcept;
+
+#endif
+
+// Parameters are unused if CBU_MALLOC_TRACE isn't defined
+inline void on_alloc([[maybe_unused]] Op op, [[maybe_unused]] const void* ptr,
+                     [[maybe_unused]] size_t size,
+                     [[maybe_unused]] size_t align = 0) noexcept {
+#ifdef CBU_MALLOC_TRACE
+  if (g_tracing.load(std::memory_order_relaxed)) [[unlikely]]
+    record_alloc(op, ptr, size, align);
+#endif
+}
+
+// Call before freeing ptr, so that no other thread can record the address
+// being allocated before it's recorded as freed here
+inline void on_free([[maybe_unused]] const void* ptr) noexcept {
+#ifdef CBU_MALLOC_TRACE
+  if (g_tracing.load(std::memory_order_relaxed)) [[unlikely]]
+    record_free(ptr);
+#endif
+}
+
+// Returns a token to be passed to on_realloc
+inline uint64_t on_realloc_start() noexcept {
+#ifdef CBU_MALLOC_TRACE
+  if (g_tracing.load(std::memory_order_relaxed)) [[unlikely]]
+    return now_ns();
+#endif
+  return 0;
+}
+
+inline void on_realloc([[maybe_unused]] uint64_t start,
+                       [[maybe_unused]] const void* old_ptr,
+                       [[maybe_unused]] size_t size,
+                       [[maybe_unused]] const void* ptr) noexcept {
+#ifdef CBU_MALLOC_TRACE
+  if (start) [[unlikely]]
+    record_realloc(start, old_ptr, size, ptr);
+#endif
+}
+
+}  // namespace cbu::malloc_trace
@@ -0,0 +1,108 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2026, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// Binary format of malloc traces written with CBU_MALLOC_TRACE, shared by the
+// recorder (trace.cpp) and the replay tool (test/trace_replay.cpp).
+//
+// Each thread writes a file of its own, <prefix>.<pid>.<tid>.trace:
+//
+//   header: kTraceMagic, then varints tid and start time (CLOCK_MONOTONIC ns)
+//   events: an op byte, then varint fields:
+//     kMalloc/kCalloc:  time delta, size, address
+//     kMemalign:        time delta, alignment, size, address
+//     kRealloc:         time delta, duration, old address, size,
+//                       new address (absent with kNullResult)
+//     kFree:            time delta, address
+//
+// Time deltas are nanoseconds since the previous event of the same thread.
+// Addresses are zigzag encoded differences from the previous address of the
+// same thread.  Failed allocations aren't recorded.
+//
+// Addresses identify objects among those alive at the same time; the replay
+// tool merges all threads by time and assigns object IDs.  A free is timed
+// before the memory is released, and an allocation after it's returned, so
+// no address appears to be reused before it's freed.  A realloc frees the old
+// address at the time delta and allocates the new one after the duration.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cbu::malloc_trace {
+
+inline constexpr char kTraceMagic[8] = {'C', 'B', 'U', 'M', 'T', 'R', 'C', '1'};
+
+enum Op : uint8_t {
+  kMalloc = 1,
+  kCalloc = 2,
+  kMemalign = 3,
+  kRealloc = 4,
+  kFree = 5,
+};
+
+inline constexpr uint8_t kOpMask = 0x0f;
+// realloc returned NULL, having freed the old block (size 0)
+inline constexpr uint8_t kNullResult = 0x10;
+
+// Longest encoding of a uint64_t
+inline constexpr size_t kMaxVarintBytes = 10;
+
+inline char* put_varint(char* p, uint64_t v) noexcept {
+  while (v >= 0x80) {
+    *p++ = char(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = char(v);
+  return p;
+}
+
+// Returns nullptr if the input is truncated or malformed
+inline const char* get_varint(const char* p, const char* end,
+                              uint64_t* res) noexcept {
+  uint64_t v = 0;
+  for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t c = *p++;
+    v |= uint64_t(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *res = v;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+constexpr uint64_t zigzag_encode(int64_t v) noexcept {
+  return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+constexpr int64_t zigzag_decode(uint64_t v) noexcept {
+  return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+}  // namespace cbu::malloc_trace